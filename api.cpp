@@ -13,167 +13,102 @@
 #include "cJSON.h"
 #include "httpss.h"
 #include "api_priv.hpp"
+#include "web_index.hpp"
+#include "resp_stream.hpp"
+#include "file_meta.hpp"
 
 #define TAG "FILE_SERVER"
+#define LIST_BATCH 8 // Entries copied out of the index per lock
+#define LIST_ENTRY_MAX (2 * FILE_PATH_MAX + 80)
 
-static esp_err_t file_rename_handler(httpd_req_t* req)
+// Copy src into a JSON string body, quotes not included.
+static void json_escape(const char* src, char* dst, size_t size)
 {
-    // char from[64];
-    // char to[64];
-    // if (get_value_from_query(req, "from", from, sizeof(from)) == false)
-    //     return ESP_FAIL;
-    // if (get_value_from_query(req, "to", to, sizeof(to)) == false)
-    //     return ESP_FAIL;
-
-    // ESP_LOGI(TAG, "Renaming file: %s to %s", from, to);
-
-    // char to_path[128];
-    // snprintf(to_path, sizeof(to_path), "%s/%s", dirname(from), to);
-
-    // if (rename(from, to_path) != 0)
-    // {
-    //     ESP_LOGE(TAG, "Failed to rename file: %s", from);
-    //     httpd_resp_sendstr(req, "{\"message\": \"Failed to rename file\"}");
-    //     return ESP_FAIL;
-    // }
-
-    // httpd_resp_sendstr(req, "{\"message\": \"File renamed successfully\"}");
-    return ESP_OK;
-}
-
-static esp_err_t file_copy_handler(httpd_req_t* req)
-{
-    return ESP_OK;
+    size_t n = 0;
+    for (; *src && n + 7 < size; src++)
+    {
+        unsigned char c = *src;
+        if (c == '"' || c == '\\')
+        {
+            dst[n++] = '\\';
+            dst[n++] = c;
+        }
+        else if (c < 0x20)
+            n += snprintf(dst + n, size - n, "\\u%04x", c);
+        else
+            dst[n++] = c;
+    }
+    dst[n] = 0;
 }
 
+// GET /api/list?dir=<dir>[&recursive=1][&offset=<n>][&limit=<n>][&refresh=1]
+//
+// Served from the file metadata index and written to the response in batches,
+// so the heap needed does not grow with the number of files. X-Total-Count
+// holds the number of files in the listing before paging.
 esp_err_t api_file_list_all_handler(httpd_req_t* req)
 {
-    char directory[128];
-    size_t len = httpd_req_get_url_query_len(req) + 1;
-    if (len > 1)
-    {
-        char query[255];
-        httpd_req_get_url_query_str(req, query, len);
-        httpd_query_key_value(query, "dir", directory, sizeof(directory));
-    }
-    else
-    {
+    char directory[FILE_PATH_MAX];
+    char value[16];
+    if (!get_optional_value_from_query(req, "dir", directory, sizeof(directory)))
         strcpy(directory, "/littlefs");
-    }
+    size_t len = strlen(directory);
+    while (len > 1 && directory[len - 1] == '/')
+        directory[--len] = 0;
 
-    cJSON* json_array = cJSON_CreateArray();
+    bool recursive = get_optional_value_from_query(req, "recursive", value, sizeof(value)) && strcmp(value, "0") != 0;
+    bool refresh = get_optional_value_from_query(req, "refresh", value, sizeof(value)) && strcmp(value, "0") != 0;
+    size_t offset = get_optional_value_from_query(req, "offset", value, sizeof(value)) ? strtoul(value, NULL, 10) : 0;
+    size_t limit = get_optional_value_from_query(req, "limit", value, sizeof(value)) ? strtoul(value, NULL, 10) : SIZE_MAX;
 
-    DIR* dir = opendir(directory);
-    if (dir == NULL)
+    if (!file_meta_scan(directory, refresh))
     {
         ESP_LOGE(TAG, "Failed to open directory : %s", directory);
-        // httpd_resp_send_500(req);
         httpd_resp_sendstr(req, "{\"message\": \"Failed to open directory\"}");
-
-        cJSON_Delete(json_array);
         return ESP_FAIL;
     }
 
-    struct dirent* entry;
-    while ((entry = readdir(dir)) != NULL)
+    file_meta_entry_t* batch = (file_meta_entry_t*)malloc(LIST_BATCH * sizeof(file_meta_entry_t));
+    char* buf = (char*)malloc(LIST_ENTRY_MAX);
+    if (batch == NULL || buf == NULL)
     {
-        if (entry->d_type == DT_REG)
-        { // Check if it is a regular file
-            char filepath[512];
-            snprintf(filepath, sizeof(filepath), "%s/%s", directory, entry->d_name);
-            struct stat file_stat;
-            stat(filepath, &file_stat);
-
-            cJSON* file_obj = cJSON_CreateObject();
-            cJSON_AddStringToObject(file_obj, "path", filepath);
-            cJSON_AddNumberToObject(file_obj, "size", file_stat.st_size);
-            cJSON_AddNumberToObject(file_obj, "modification_time", file_stat.st_mtime);
-            cJSON_AddItemToArray(json_array, file_obj);
-        }
-    }
-    closedir(dir);
-
-    const char* json_str = cJSON_Print(json_array);
-    httpd_resp_set_type(req, "application/json");
-    httpd_resp_sendstr(req, json_str);
-
-    cJSON_Delete(json_array);
-    cJSON_free((void*)json_str);
-
-    return ESP_OK;
-}
-
-static esp_err_t file_delete_handler(httpd_req_t* req)
-{
-    char buf[512];
-    int total_len = req->content_len;
-    int cur_len = 0;
-    int received = 0;
-
-    char* json_str = (char*)malloc(total_len + 1);
-    if (!json_str)
-    {
-        ESP_LOGE(TAG, "Failed to allocate memory for JSON string");
+        free(batch);
+        free(buf);
         httpd_resp_send_500(req);
         return ESP_FAIL;
     }
 
-    while (cur_len < total_len)
-    {
-        received = httpd_req_recv(req, buf, MIN(total_len - cur_len, sizeof(buf)));
-        if (received <= 0)
-        {
-            if (received == HTTPD_SOCK_ERR_TIMEOUT)
-            {
-                continue;
-            }
-            free(json_str);
-            ESP_LOGE(TAG, "File deletion failed, received error: %d", received);
-            httpd_resp_send_500(req);
-            return ESP_FAIL;
-        }
-        memcpy(json_str + cur_len, buf, received);
-        cur_len += received;
-    }
-    json_str[total_len] = '\0';
-
-    cJSON* json = cJSON_Parse(json_str);
-    if (!json)
-    {
-        ESP_LOGE(TAG, "JSON parse error");
-        free(json_str);
-        httpd_resp_send_500(req);
-        return ESP_FAIL;
-    }
+    char total[16];
+    snprintf(total, sizeof(total), "%u", (unsigned)file_meta_count(directory, recursive));
+    httpd_resp_set_hdr(req, "X-Total-Count", total);
+    httpd_resp_set_type(req, "application/json");
 
-    cJSON* files = cJSON_GetObjectItem(json, "files");
-    if (!cJSON_IsArray(files))
-    {
-        ESP_LOGE(TAG, "JSON format error: files is not an array");
-        cJSON_Delete(json);
-        free(json_str);
-        httpd_resp_send_500(req);
-        return ESP_FAIL;
-    }
+    resp_stream_t out;
+    resp_stream_begin(&out, req);
+    resp_stream_send(&out, "[", 1);
 
-    cJSON* file = NULL;
-    cJSON_ArrayForEach(file, files)
+    file_meta_cursor_t cursor;
+    cursor.skip = offset;
+    size_t sent = 0;
+    size_t n;
+    while (sent < limit && out.err == ESP_OK &&
+           (n = file_meta_read(directory, recursive, &cursor, batch, MIN(LIST_BATCH, limit - sent))) > 0)
     {
-        if (cJSON_IsString(file))
+        for (size_t i = 0; i < n; i++, sent++)
         {
-            if (remove(file->valuestring) != 0)
-            {
-                ESP_LOGE(TAG, "Failed to delete file: %s", file->valuestring);
-            }
+            char path[2 * FILE_PATH_MAX];
+            json_escape(batch[i].path, path, sizeof(path));
+            int written = snprintf(buf, LIST_ENTRY_MAX, "%s\n{\"path\": \"%s\", \"size\": %lu, \"modification_time\": %lu}",
+                                   sent ? "," : "", path, (unsigned long)batch[i].size, (unsigned long)batch[i].mtime);
+            resp_stream_send(&out, buf, MIN(written, LIST_ENTRY_MAX - 1));
         }
     }
+    resp_stream_send(&out, "\n]", 2);
+    esp_err_t err = resp_stream_end(&out);
 
-    cJSON_Delete(json);
-    free(json_str);
-
-    httpd_resp_sendstr(req, "{\"message\": \"Files deleted successfully\"}");
-
-    return ESP_OK;
+    free(batch);
+    free(buf);
+    return err;
 }
 
 static esp_err_t api_reboot(httpd_req_t* req)
@@ -186,14 +121,20 @@ static esp_err_t api_reboot(httpd_req_t* req)
 
 static esp_err_t start_file_server()
 {
+    file_meta_init();
     httpss_register_url("/api/list", false, api_file_list_all_handler, HTTP_GET, NULL);
     httpss_register_url("/api/upload", false, api_file_upload_handler, HTTP_POST, NULL);
+    api_upload_session_register();
     httpss_register_url("/api/download", false, api_file_download_handler, HTTP_GET, NULL);
-    httpss_register_url("/api/delete", false, file_delete_handler, HTTP_POST, NULL);
-    httpss_register_url("/api/rename", false, file_rename_handler, HTTP_POST, NULL);
-    httpss_register_url("/api/copy", false, file_copy_handler, HTTP_POST, NULL);
+    httpss_register_url("/api/delete", false, api_file_delete_handler, HTTP_POST, NULL);
+    httpss_register_url("/api/delete/status", false, api_file_delete_status, HTTP_GET, NULL);
+    httpss_register_url("/api/rename", false, api_file_rename_handler, HTTP_POST, NULL);
+    httpss_register_url("/api/copy", false, api_file_copy_handler, HTTP_POST, NULL);
+    httpss_register_url("/api/extract", false, api_file_extract_handler, HTTP_POST, NULL);
+    httpss_register_url("/api/extract/status", false, api_file_extract_status, HTTP_GET, NULL);
     httpss_register_url("/api/reboot", false, api_reboot, HTTP_POST, NULL);
     httpss_register_url("/api/nvs", false, api_nvs, HTTP_GET, NULL);
+    httpss_register_url("/api/nvs", false, api_nvs, HTTP_POST, NULL);
 
     return ESP_OK;
 }
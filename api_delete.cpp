@@ -0,0 +1,420 @@
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/param.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "esp_http_server.h"
+#include "cJSON.h"
+#include "api_priv.hpp"
+#include "web_index.hpp"
+#include "web_slot.hpp"
+#include "file_meta.hpp"
+#include "resp_stream.hpp"
+
+// Bulk delete.
+//
+//   POST /api/delete                {"files": ["<path>", ...]} -> 202 {"id": "<id>", "total": <n>}
+//   GET  /api/delete/status?id=<id> -> {"id", "state", "total", "deleted", "failed", "errors": [{"path", "error"}]}
+//
+// The body is parsed as it is received and only the paths are kept, so the
+// memory needed is bounded by DELETE_BODY_MAX. The files are removed by a
+// background task below httpd priority and the request returns at once.
+// "state" is "running" or "done". The first DELETE_ERRORS_MAX failures are
+// listed, "failed" counts them all, paths rejected while parsing included.
+// The last DELETE_JOBS_MAX jobs can be polled, without an id the latest one.
+
+static const char *TAG = "FILE_DELETE";
+
+#define DELETE_BODY_MAX (64 * 1024)
+#define DELETE_ERRORS_MAX 32
+#define DELETE_JOBS_MAX 4
+#define DELETE_BATCH 32 // Removed files handed to the web index at a time
+#define DELETE_STACK 4096
+#define DELETE_PRIORITY (tskIDLE_PRIORITY + 1) // Below httpd, deleting yields to serving
+
+typedef struct
+{
+    std::string path;
+    const char *error;
+} delete_error_t;
+
+typedef struct
+{
+    uint32_t id;
+    httpd_handle_t server;
+    std::string paths; // NUL separated
+    size_t total;
+    // Progress, under the lock
+    bool running;
+    size_t deleted;
+    size_t failed;
+    std::vector<delete_error_t> errors;
+    int64_t start_us;
+    int64_t end_us;
+} delete_job_t;
+
+// Picks the strings of the top level "files" array out of a JSON body fed in
+// pieces. Anything else in the body is skipped.
+typedef struct
+{
+    int depth;
+    bool in_string;
+    bool escape;
+    int unicode; // \u hex digits still to come
+    uint32_t code;
+    uint32_t high; // High surrogate waiting for its low half
+    bool in_files;
+    bool has_files;
+    bool invalid;
+    std::string str;
+    std::string last; // Last string at the top level, the key when a ':' follows
+    delete_job_t *job; // Paths are appended, rejected ones counted as failed
+    size_t count;
+} delete_parser_t;
+
+// Jobs by id. Created, looked up and freed on the httpd task only.
+static std::map<uint32_t, delete_job_t *> jobs;
+static uint32_t latest = 0;
+static SemaphoreHandle_t lock = NULL;
+
+static void utf8_append(std::string &s, uint32_t code)
+{
+    if (code < 0x80)
+        s += (char)code;
+    else if (code < 0x800)
+    {
+        s += (char)(0xc0 | code >> 6);
+        s += (char)(0x80 | (code & 0x3f));
+    }
+    else if (code < 0x10000)
+    {
+        s += (char)(0xe0 | code >> 12);
+        s += (char)(0x80 | (code >> 6 & 0x3f));
+        s += (char)(0x80 | (code & 0x3f));
+    }
+    else
+    {
+        s += (char)(0xf0 | code >> 18);
+        s += (char)(0x80 | (code >> 12 & 0x3f));
+        s += (char)(0x80 | (code >> 6 & 0x3f));
+        s += (char)(0x80 | (code & 0x3f));
+    }
+}
+
+// A decoded \u escape. NUL would split the path list and surrogates must come
+// in pairs, anything else makes the body invalid.
+static void parser_code(delete_parser_t *p, uint32_t code)
+{
+    bool low = code >= 0xdc00 && code <= 0xdfff;
+    if (p->high)
+    {
+        p->invalid = !low;
+        if (low)
+            utf8_append(p->str, 0x10000 + ((p->high - 0xd800) << 10) + (code - 0xdc00));
+        p->high = 0;
+    }
+    else if (code >= 0xd800 && code <= 0xdbff)
+        p->high = code;
+    else if (code == 0 || low)
+        p->invalid = true;
+    else
+        utf8_append(p->str, code);
+}
+
+static void parser_string_end(delete_parser_t *p)
+{
+    if (p->in_files && p->depth == 2)
+    {
+        if (!p->str.empty() && p->str.size() < FILE_PATH_MAX)
+        {
+            p->job->paths.append(p->str);
+            p->job->paths.push_back(0);
+        }
+        else
+        {
+            ESP_LOGW(TAG, "Invalid path of %u bytes skipped", (unsigned)p->str.size());
+            if (p->job->failed++ < DELETE_ERRORS_MAX)
+                p->job->errors.push_back({p->str.substr(0, FILE_PATH_MAX - 1), "Invalid path"});
+        }
+        p->count++;
+    }
+    else if (p->depth == 1)
+        p->last.swap(p->str);
+}
+
+static void parser_feed(delete_parser_t *p, const char *data, size_t len)
+{
+    for (size_t i = 0; i < len && !p->invalid; i++)
+    {
+        char c = data[i];
+        if (p->in_string)
+        {
+            if (p->high && p->unicode == 0 && !p->escape && c != '\\')
+                p->invalid = true;
+            else if (p->unicode > 0)
+            {
+                char *end;
+                char hex[2] = {c, 0};
+                uint32_t digit = strtoul(hex, &end, 16);
+                p->invalid = *end != 0;
+                p->code = p->code << 4 | digit;
+                if (--p->unicode == 0 && !p->invalid)
+                    parser_code(p, p->code);
+            }
+            else if (p->escape)
+            {
+                p->escape = false;
+                const char *from = "\"\\/bfnrt";
+                const char *to = "\"\\/\b\f\n\r\t";
+                const char *e = strchr(from, c);
+                if (c == 'u')
+                {
+                    p->unicode = 4;
+                    p->code = 0;
+                }
+                else if (e != NULL && c != 0 && !p->high)
+                    p->str += to[e - from];
+                else
+                    p->invalid = true;
+            }
+            else if (c == '\\')
+                p->escape = true;
+            else if (c == '"')
+            {
+                p->in_string = false;
+                parser_string_end(p);
+            }
+            else if (p->str.size() <= FILE_PATH_MAX)
+                p->str += c;
+            continue;
+        }
+
+        switch (c)
+        {
+        case '"':
+            p->in_string = true;
+            p->str.clear();
+            break;
+        case '{':
+        case '[':
+            if (p->depth == 0 && c != '{')
+                p->invalid = true;
+            if (p->depth == 1 && c == '[' && p->last == "files")
+                p->in_files = p->has_files = true;
+            p->depth++;
+            break;
+        case '}':
+        case ']':
+            if (--p->depth < 0)
+                p->invalid = true;
+            if (p->depth == 1)
+                p->in_files = false;
+            break;
+        case ':':
+            break;
+        case ',':
+            if (p->depth == 1)
+                p->last.clear();
+            break;
+        default:
+            if (p->depth == 0 && c != ' ' && c != '\t' && c != '\r' && c != '\n')
+                p->invalid = true;
+            break;
+        }
+    }
+}
+
+static void delete_task(void *arg)
+{
+    delete_job_t *job = (delete_job_t *)arg;
+    web_index_changes_t *changes = new web_index_changes_t;
+    for (const char *path = job->paths.c_str(); path < job->paths.c_str() + job->paths.size(); path += strlen(path) + 1)
+    {
+        bool ok = remove(path) == 0;
+        const char *error = ok ? NULL : errno == ENOENT ? "Not found" : strerror(errno);
+        if (ok)
+        {
+            file_meta_changed(path);
+            changes->removed.push_back(path);
+            if (changes->removed.size() >= DELETE_BATCH)
+            {
+                web_index_queue_changes(job->server, changes);
+                changes = new web_index_changes_t;
+            }
+        }
+        else
+            ESP_LOGE(TAG, "Failed to delete file: %s (%s)", path, error);
+
+        xSemaphoreTake(lock, portMAX_DELAY);
+        if (ok)
+            job->deleted++;
+        else if (job->failed++ < DELETE_ERRORS_MAX)
+            job->errors.push_back({path, error});
+        xSemaphoreGive(lock);
+    }
+    web_index_queue_changes(job->server, changes);
+    web_slot_unhold();
+
+    ESP_LOGI(TAG, "Delete %08lx done: %u deleted, %u failed", (unsigned long)job->id, (unsigned)job->deleted,
+             (unsigned)job->failed);
+    // The job may be dropped by the httpd task from here on.
+    xSemaphoreTake(lock, portMAX_DELAY);
+    job->end_us = esp_timer_get_time();
+    job->running = false;
+    xSemaphoreGive(lock);
+    vTaskDelete(NULL);
+}
+
+static void send_job(httpd_req_t *req, delete_job_t *job)
+{
+    char id[9];
+    snprintf(id, sizeof(id), "%08lx", (unsigned long)job->id);
+    cJSON *json = cJSON_CreateObject();
+    xSemaphoreTake(lock, portMAX_DELAY);
+    int64_t now = job->running ? esp_timer_get_time() : job->end_us;
+    cJSON_AddStringToObject(json, "id", id);
+    cJSON_AddStringToObject(json, "state", job->running ? "running" : "done");
+    cJSON_AddNumberToObject(json, "total", job->total);
+    cJSON_AddNumberToObject(json, "deleted", job->deleted);
+    cJSON_AddNumberToObject(json, "failed", job->failed);
+    cJSON_AddNumberToObject(json, "elapsed_ms", (double)((now - job->start_us) / 1000));
+    cJSON *errors = cJSON_AddArrayToObject(json, "errors");
+    for (auto &e : job->errors)
+    {
+        cJSON *item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item, "path", e.path.c_str());
+        cJSON_AddStringToObject(item, "error", e.error);
+        cJSON_AddItemToArray(errors, item);
+    }
+    xSemaphoreGive(lock);
+
+    char *str = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    httpd_resp_set_type(req, "application/json");
+    if (str == NULL)
+        httpd_resp_send_500(req);
+    else
+        resp_stream_sendstr(req, str);
+    cJSON_free(str);
+}
+
+// Make room for a new job by dropping the oldest finished one. False when
+// all of them are still running.
+static bool drop_old_job(void)
+{
+    if (jobs.size() < DELETE_JOBS_MAX)
+        return true;
+    auto oldest = jobs.end();
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (auto it = jobs.begin(); it != jobs.end(); it++)
+    {
+        if (!it->second->running && (oldest == jobs.end() || it->second->start_us < oldest->second->start_us))
+            oldest = it;
+    }
+    xSemaphoreGive(lock);
+    if (oldest == jobs.end())
+        return false;
+    delete oldest->second;
+    jobs.erase(oldest);
+    return true;
+}
+
+esp_err_t api_file_delete_handler(httpd_req_t *req)
+{
+    if (req->content_len > DELETE_BODY_MAX)
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Request too large");
+        return ESP_FAIL;
+    }
+    if (lock == NULL)
+        lock = xSemaphoreCreateMutex();
+    if (lock == NULL || !drop_old_job())
+        return _send_busy(req);
+
+    delete_job_t *job = new delete_job_t();
+    delete_parser_t parser = {};
+    parser.job = job;
+
+    char buf[512];
+    size_t remaining = req->content_len;
+    while (remaining > 0)
+    {
+        int received = _recv(req, buf, MIN(remaining, sizeof(buf)));
+        if (received <= 0)
+        {
+            ESP_LOGE(TAG, "File deletion failed, received error: %d", received);
+            delete job;
+            httpd_resp_send_500(req);
+            return ESP_FAIL;
+        }
+        parser_feed(&parser, buf, received);
+        remaining -= received;
+    }
+
+    if (parser.invalid || parser.depth != 0 || parser.in_string || !parser.has_files)
+    {
+        ESP_LOGE(TAG, "JSON format error: expected {\"files\": [...]}");
+        delete job;
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Expected {\"files\": [\"<path>\"]}");
+        return ESP_FAIL;
+    }
+
+    uint32_t id;
+    do
+        id = esp_random();
+    while (id == 0 || jobs.count(id));
+    job->id = id;
+    job->server = req->handle;
+    job->total = parser.count;
+    job->running = true;
+    job->start_us = esp_timer_get_time();
+    job->paths.shrink_to_fit();
+
+    if (!web_slot_hold())
+    {
+        delete job;
+        return _send_busy(req);
+    }
+    if (xTaskCreate(delete_task, "file_delete", DELETE_STACK, job, DELETE_PRIORITY, NULL) != pdPASS)
+    {
+        delete job;
+        web_slot_unhold();
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+    jobs[id] = job;
+    latest = id;
+    ESP_LOGI(TAG, "Delete %08lx started for %u files", (unsigned long)id, (unsigned)job->total);
+
+    char resp[64];
+    snprintf(resp, sizeof(resp), "{\"id\": \"%08lx\", \"total\": %u}", (unsigned long)id, (unsigned)parser.count);
+    httpd_resp_set_status(req, "202 Accepted");
+    httpd_resp_set_type(req, "application/json");
+    return httpd_resp_sendstr(req, resp);
+}
+
+esp_err_t api_file_delete_status(httpd_req_t *req)
+{
+    char value[16];
+    uint32_t id = latest;
+    if (get_optional_value_from_query(req, "id", value, sizeof(value)))
+        id = strtoul(value, NULL, 16);
+
+    auto it = jobs.find(id);
+    if (it == jobs.end())
+    {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Unknown delete job");
+        return ESP_FAIL;
+    }
+    send_job(req, it->second);
+    return ESP_OK;
+}
@@ -5,14 +5,163 @@
 #include <errno.h>
 #include "esp_log.h"
 #include "esp_err.h"
+#include "esp_timer.h"
 #include "esp_http_server.h"
 #include "cJSON.h"
 #include "httpss.h"
 #include "api_priv.hpp"
+#include "file_stream.hpp"
+#include "web_index.hpp"
+#include "web_slot.hpp"
+#include "resp_stream.hpp"
+#include "tar_stream.hpp"
+#include "worker_pool.hpp"
+
+#define TAR_CHUNK_SIZE 4096 // Bytes per chunk sent
+#define TAR_READ_SIZE 4096  // File read buffer
 
 static const char *TAG = "FILE_SERVER";
 
-extern void serviceweb_set_content_type(httpd_req_t *req, const char *filename);
+extern const char *serviceweb_content_type(const char *filename);
+
+//-- Directory archive ------------------------------------------------------------
+//
+//   GET /api/download?dir=<dir>[&gzip=1]
+//
+// The tree below dir as a tar, or tar.gz, built while it is sent. The memory
+// used is the read and chunk buffers plus the compressor budget, whatever the
+// size of the archive.
+
+typedef struct
+{
+    char dir[FILE_PATH_MAX];
+    bool gzip;
+} tar_job_t;
+
+typedef struct
+{
+    httpd_req_t *req;
+    deflate_stream_t *deflate;
+    size_t len;
+    char chunk[TAR_CHUNK_SIZE];
+    uint8_t buf[TAR_READ_SIZE];
+} tar_sender_t;
+
+// Collect the many small writes of the tar and deflate stages into full chunks.
+static esp_err_t tar_send(void *ctx, const uint8_t *data, size_t len)
+{
+    tar_sender_t *s = (tar_sender_t *)ctx;
+    while (len > 0)
+    {
+        size_t n = MIN(len, sizeof(s->chunk) - s->len);
+        memcpy(s->chunk + s->len, data, n);
+        s->len += n;
+        data += n;
+        len -= n;
+        if (s->len == sizeof(s->chunk))
+        {
+            esp_err_t err = httpd_resp_send_chunk(s->req, s->chunk, s->len);
+            s->len = 0;
+            if (err != ESP_OK)
+                return err;
+        }
+    }
+    return ESP_OK;
+}
+
+static esp_err_t tar_output(void *ctx, const uint8_t *data, size_t len)
+{
+    tar_sender_t *s = (tar_sender_t *)ctx;
+    return s->deflate ? deflate_write(s->deflate, data, len) : tar_send(s, data, len);
+}
+
+static esp_err_t tar_job_run(httpd_req_t *req, void *arg)
+{
+    tar_job_t *job = (tar_job_t *)arg;
+    tar_sender_t *s = (tar_sender_t *)calloc(1, sizeof(tar_sender_t));
+    if (s == NULL)
+    {
+        web_slot_unhold();
+        httpd_resp_send_500(req);
+        return ESP_ERR_NO_MEM;
+    }
+    s->req = req;
+    if (job->gzip && (s->deflate = resp_stream_create_deflate(tar_send, s)) == NULL)
+        ESP_LOGW(TAG, "No memory for compression, sending %s as tar", job->dir);
+
+    const char *name = strrchr(job->dir, '/');
+    name = name && name[1] ? name + 1 : "root";
+    char disposition[128];
+    snprintf(disposition, sizeof(disposition), "attachment; filename=\"%s.%s\"", name, s->deflate ? "tar.gz" : "tar");
+    httpd_resp_set_type(req, s->deflate ? "application/gzip" : "application/x-tar");
+    httpd_resp_set_hdr(req, "Content-Disposition", disposition);
+
+    int64_t start = esp_timer_get_time();
+    tar_stats_t stats;
+    esp_err_t err = tar_write_tree(job->dir, tar_output, s, s->buf, sizeof(s->buf), &stats);
+    if (s->deflate)
+    {
+        if (err == ESP_OK)
+            err = deflate_finish(s->deflate);
+        deflate_free(s->deflate);
+    }
+    if (err == ESP_OK && s->len > 0)
+        err = httpd_resp_send_chunk(req, s->chunk, s->len);
+    if (err == ESP_OK)
+        err = httpd_resp_send_chunk(req, NULL, 0);
+    free(s);
+    web_slot_unhold();
+
+    // An error after the first chunk can only be reported by closing the
+    // connection, the worker does that when this returns an error.
+    ESP_LOGI(TAG, "Archive %s: %u files, %u skipped, %u bytes in %lld ms: %s", job->dir, (unsigned)stats.files,
+             (unsigned)stats.skipped, (unsigned)stats.bytes, (long long)(esp_timer_get_time() - start) / 1000,
+             esp_err_to_name(err));
+    return err;
+}
+
+static esp_err_t api_dir_download(httpd_req_t *req, const char *dir)
+{
+    struct stat st;
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Directory not found");
+        return ESP_FAIL;
+    }
+
+    tar_job_t *job = (tar_job_t *)calloc(1, sizeof(tar_job_t));
+    if (job == NULL)
+    {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+    snprintf(job->dir, sizeof(job->dir), "%s", dir);
+    size_t len = strlen(job->dir);
+    while (len > 1 && job->dir[len - 1] == '/')
+        job->dir[--len] = 0;
+    char value[8];
+    job->gzip = get_optional_value_from_query(req, "gzip", value, sizeof(value)) && strcmp(value, "0") != 0;
+
+    if (!web_slot_hold())
+    {
+        free(job);
+        return _send_busy(req);
+    }
+    esp_err_t err = worker_pool_submit(req, tar_job_run, job, WORKER_PRIORITY_LOW);
+    if (err == ESP_OK)
+        return ESP_OK;
+    if (err == ESP_ERR_INVALID_STATE)
+    {
+        free(job);
+        web_slot_unhold();
+        return _send_busy(req);
+    }
+
+    // No async support, send in place.
+    err = tar_job_run(req, job);
+    free(job);
+    return err == ESP_OK ? ESP_OK : ESP_FAIL;
+}
 
 esp_err_t api_file_download_handler(httpd_req_t *req)
 {
@@ -21,8 +170,9 @@ esp_err_t api_file_download_handler(httpd_req_t *req)
     char filepath[FILE_PATH_MAX];
     FILE *file = NULL;
     struct stat file_stat;
-    int bytes_read;
 
+    if (get_optional_value_from_query(req, "dir", filepath, sizeof(filepath)))
+        return api_dir_download(req, filepath);
     if (get_value_from_query(req, "file", filepath, FILE_PATH_MAX) == false)
         return ESP_FAIL;
 
@@ -42,76 +192,41 @@ esp_err_t api_file_download_handler(httpd_req_t *req)
         return ESP_FAIL;
     }
 
-    // if file ends with .gz, set gzip_supported to true
-    bool gzip_supported = false;
-    if (strstr(filepath, ".gz") != NULL)
-    {
-        if (ESP_OK != _set_gz_support(req, gzip_supported))
-        {
-            ESP_LOGE(TAG, "Error setting gzip support for file %s", req->uri);
-            return ESP_FAIL;
-        }
-    }
+    file_stream_info_t info = {};
+    info.content_type = serviceweb_content_type(filepath);
+
+    // A .gz file is sent gzip encoded to clients that accept it
+    if (strstr(filepath, ".gz") != NULL &&
+        _negotiate_encoding(req, WEB_VARIANT_IDENTITY | WEB_VARIANT_GZIP) == SERVICEWEB_ENCODING_GZIP)
+        info.content_encoding = "gzip";
 
     printf("File path: %s\n", filepath);
     printf("File size: %ld\n", file_stat.st_size);
-    char length_header[32];
-    snprintf(length_header, sizeof(length_header), "%ld", file_stat.st_size);
-    // httpd_resp_set_hdr(req, "Content-Length", length_header);
-
-    serviceweb_set_content_type(req, filepath);
 
+    char disposition[128];
     char *filename = strrchr(filepath, '/');
     if (filename)
     {
-        char buf[128];
-        snprintf(buf, sizeof(buf), "attachment; filename=\"%s\"", filename + 1);
-        httpd_resp_set_hdr(req, "Content-Disposition", buf);
+        snprintf(disposition, sizeof(disposition), "attachment; filename=\"%s\"", filename + 1);
+        info.disposition = disposition;
     }
 
-    char *chunk = (char *)malloc(API_BUFFSIZE);
-    if (!chunk)
+    if (file_stat.st_size >= FILE_STREAM_ASYNC_MIN &&
+        file_stream_respond_async(req, filepath, &info, WORKER_PRIORITY_LOW) == ESP_OK)
     {
-        ESP_LOGE(TAG, "Failed to allocate memory for file download");
         fclose(file);
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to allocate memory for file download");
-        return ESP_FAIL;
+        return ESP_OK;
     }
 
-    // If the file is less than the buffer size, send it in one go
-    if (file_stat.st_size < API_BUFFSIZE)
+    esp_err_t err = file_stream_respond(req, file, file_stat.st_size, &info);
+    if (err != ESP_OK)
     {
-        bytes_read = fread(chunk, 1, file_stat.st_size, file);
-        esp_err_t err = httpd_resp_send(req, chunk, bytes_read);
-        if (err != ESP_OK)
-        {
-            ESP_LOGE(TAG, "Failed to send file download: %s", esp_err_to_name(err));
-            free(chunk);
-            fclose(file);
-            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to send file download");
-            return ESP_FAIL;
-        }
-        ESP_LOGI(TAG, "File %s, download complete", filepath);
-    }
-    else
-    {
-        while ((bytes_read = fread(chunk, 1, API_BUFFSIZE, file)) > 0)
-        {
-            esp_err_t err = httpd_resp_send_chunk(req, chunk, bytes_read);
-            if (err != ESP_OK)
-            {
-                ESP_LOGE(TAG, "Failed to send file download chunk: %s", esp_err_to_name(err));
-                free(chunk);
-                fclose(file);
-                httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to send file download chunk");
-                return ESP_FAIL;
-            }
-        }
-        httpd_resp_send_chunk(req, NULL, 0);
-        ESP_LOGI(TAG, "Chunked file %s, download complete", filepath);
+        ESP_LOGE(TAG, "Failed to send file download %s: %s", filepath, esp_err_to_name(err));
+        fclose(file);
+        return ESP_FAIL;
     }
+    ESP_LOGI(TAG, "File %s, download complete", filepath);
 
-    free(chunk);
     fclose(file);
     return ESP_OK;
 }
@@ -0,0 +1,508 @@
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <atomic>
+#include <set>
+#include <string>
+#include <vector>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "esp_http_server.h"
+#include "cJSON.h"
+#include "api_priv.hpp"
+#include "web_index.hpp"
+#include "web_slot.hpp"
+#include "file_meta.hpp"
+#include "resp_stream.hpp"
+#include "worker_pool.hpp"
+#include "inflate.hpp"
+#include "tar_stream.hpp"
+
+// Archive upload.
+//
+//   POST /api/extract?dir=<dir>[&delete=1]   tar or tar.gz body -> summary
+//   GET  /api/extract/status                 -> progress of the current or last extraction
+//
+// Entries are written below dir as they arrive, the archive itself is never
+// stored. Each file goes to <path>.part and is renamed when complete, like an
+// upload. gzip is recognised by its magic and method bytes. With delete=1,
+// files and directories below dir that are not in the archive are removed,
+// only once the whole archive was extracted. Entries with an absolute path or
+// a ".." are skipped. Both answers are
+//   {"state": "done", "dir": ..., "total": <body bytes>, "received": ..., "files": 12, "bytes": 40960,
+//    "deleted": 2, "skipped": 0, "current": <path being written>, "elapsed_ms": ...}
+// with "error" added when the extraction failed. Files extracted before a
+// failure stay in place.
+
+static const char *TAG = "EXTRACT";
+
+#define EXTRACT_BUFFER 4096
+
+typedef struct
+{
+    const char *state; // "idle", "extracting", "done" or "failed"
+    const char *error;
+    char dir[FILE_PATH_MAX];
+    char current[FILE_PATH_MAX];
+    size_t total;
+    size_t received; // Body bytes, compressed for gzip
+    size_t files;
+    size_t bytes; // File bytes written
+    size_t deleted;
+    size_t skipped;
+    int64_t start_us;
+    int64_t end_us;
+} extract_status_t;
+
+typedef struct
+{
+    bool remove_missing;
+    char dir[FILE_PATH_MAX];
+} extract_job_t;
+
+typedef struct
+{
+    std::string dir;
+    std::string path; // Target of the current entry
+    std::string tmp;
+    FILE *f;
+    std::string last_dir;       // Parent of the previous entry relative to dir, known to exist
+    bool remove_missing;
+    std::set<std::string> kept; // With remove_missing, paths in the archive relative to dir and their parents
+    web_index_changes_t *changes;
+    extract_status_t status; // Copied to extract_status as it changes
+} extract_t;
+
+// Written by the extracting worker, read by the status handler on the httpd task.
+static extract_status_t extract_status = {"idle"};
+static SemaphoreHandle_t lock;
+static std::atomic<bool> busy(false);
+
+static void publish(const extract_t *x)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    extract_status = x->status;
+    xSemaphoreGive(lock);
+}
+
+static esp_err_t fail(extract_t *x, const char *error, const std::string &path)
+{
+    ESP_LOGE(TAG, "%s: %s (%s)", error, path.c_str(), strerror(errno));
+    if (x->status.error == NULL)
+        x->status.error = error;
+    return ESP_FAIL;
+}
+
+// Path below dir with "." and empty parts dropped. False for one that would
+// leave dir.
+static bool relative_path(const char *name, std::string &out)
+{
+    out.clear();
+    if (name[0] == '/')
+        return false;
+    const char *p = name;
+    while (*p)
+    {
+        size_t len = strcspn(p, "/");
+        if (len == 2 && p[0] == '.' && p[1] == '.')
+            return false;
+        if (len > 0 && !(len == 1 && p[0] == '.'))
+        {
+            if (!out.empty())
+                out += '/';
+            out.append(p, len);
+        }
+        p += len;
+        if (*p == '/')
+            p++;
+    }
+    return true;
+}
+
+// Create path and the directories above it.
+static bool make_dirs(const std::string &path)
+{
+    for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1))
+    {
+        std::string dir = path.substr(0, slash);
+        if (mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST)
+            return false;
+    }
+    return mkdir(path.c_str(), 0777) == 0 || errno == EEXIST;
+}
+
+// Create the directories above rel, and remember rel and them for remove_missing.
+static bool keep_path(extract_t *x, const std::string &rel)
+{
+    size_t last = rel.rfind('/');
+    std::string dir = last == std::string::npos ? "" : rel.substr(0, last);
+    // Entries of one directory usually follow each other.
+    if (dir != x->last_dir)
+    {
+        for (size_t slash = rel.find('/'); slash != std::string::npos; slash = rel.find('/', slash + 1))
+        {
+            std::string parent = rel.substr(0, slash);
+            std::string path = x->dir + "/" + parent;
+            if (mkdir(path.c_str(), 0777) != 0 && errno != EEXIST)
+                return false;
+            if (x->remove_missing)
+                x->kept.insert(parent);
+        }
+        x->last_dir = dir;
+    }
+    if (x->remove_missing)
+        x->kept.insert(rel);
+    return true;
+}
+
+static esp_err_t extract_entry_begin(void *ctx, const tar_entry_t *entry)
+{
+    extract_t *x = (extract_t *)ctx;
+    std::string rel;
+    if (!relative_path(entry->path, rel) || rel.size() + x->dir.size() + sizeof(UPLOAD_TMP_SUFFIX) + 1 > FILE_PATH_MAX)
+    {
+        ESP_LOGW(TAG, "Entry %s skipped", entry->path);
+        x->status.skipped++;
+        return ESP_OK;
+    }
+    if (rel.empty())
+        return ESP_OK; // The archive root, "./"
+
+    x->path = x->dir + "/" + rel;
+    snprintf(x->status.current, sizeof(x->status.current), "%s", x->path.c_str());
+    if (!keep_path(x, rel))
+        return fail(x, "Failed to create directory", x->path);
+    if (entry->type == TAR_TYPE_DIR)
+    {
+        if (mkdir(x->path.c_str(), 0777) != 0 && errno != EEXIST)
+            return fail(x, "Failed to create directory", x->path);
+        return ESP_OK;
+    }
+
+    x->tmp = x->path + UPLOAD_TMP_SUFFIX;
+    if ((x->f = fopen(x->tmp.c_str(), "wb")) == NULL)
+        return fail(x, "Failed to create file", x->tmp);
+    return ESP_OK;
+}
+
+static esp_err_t extract_data(void *ctx, const uint8_t *data, size_t len)
+{
+    extract_t *x = (extract_t *)ctx;
+    if (x->f == NULL)
+        return ESP_OK;
+    if (fwrite(data, 1, len, x->f) != len)
+        return fail(x, "Failed to write file", x->tmp);
+    x->status.bytes += len;
+    return ESP_OK;
+}
+
+static esp_err_t extract_entry_end(void *ctx, const tar_entry_t *entry)
+{
+    extract_t *x = (extract_t *)ctx;
+    if (x->f == NULL)
+        return ESP_OK;
+
+    bool ok = fclose(x->f) == 0;
+    x->f = NULL;
+    // rename replaces the destination on LittleFS, FAT needs it gone first.
+    if (ok && rename(x->tmp.c_str(), x->path.c_str()) != 0)
+        ok = unlink(x->path.c_str()) == 0 && rename(x->tmp.c_str(), x->path.c_str()) == 0;
+    if (!ok)
+    {
+        unlink(x->tmp.c_str());
+        return fail(x, "Failed to store file", x->path);
+    }
+
+    x->status.files++;
+    file_meta_changed(x->path.c_str());
+    x->changes->written.push_back(x->path);
+    return ESP_OK;
+}
+
+static esp_err_t extract_inflated(void *ctx, const uint8_t *data, size_t len)
+{
+    return tar_reader_feed((tar_reader_t *)ctx, data, len);
+}
+
+// Remove what is below rel and not in the archive. Uploads in progress stay.
+static void remove_missing(extract_t *x, const std::string &rel)
+{
+    std::string path = rel.empty() ? x->dir : x->dir + "/" + rel;
+    DIR *dp = opendir(path.c_str());
+    if (dp == NULL)
+        return;
+    std::vector<std::string> names;
+    struct dirent *entry;
+    while ((entry = readdir(dp)) != NULL)
+    {
+        if (strcmp(".", entry->d_name) != 0 && strcmp("..", entry->d_name) != 0)
+            names.push_back(entry->d_name);
+    }
+    closedir(dp);
+
+    size_t n = strlen(UPLOAD_TMP_SUFFIX);
+    for (auto &name : names)
+    {
+        if (name.size() > n && name.compare(name.size() - n, n, UPLOAD_TMP_SUFFIX) == 0)
+            continue;
+        std::string child_rel = rel.empty() ? name : rel + "/" + name;
+        std::string child = x->dir + "/" + child_rel;
+        bool kept = x->kept.count(child_rel) > 0;
+        struct stat st;
+        if (stat(child.c_str(), &st) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode))
+        {
+            remove_missing(x, child_rel);
+            // Fails while something is left in it, which is fine.
+            if (!kept && rmdir(child.c_str()) == 0)
+                ESP_LOGI(TAG, "Removed directory %s", child.c_str());
+        }
+        else if (!kept)
+        {
+            if (unlink(child.c_str()) != 0)
+            {
+                ESP_LOGW(TAG, "Failed to remove %s: %s", child.c_str(), strerror(errno));
+                continue;
+            }
+            ESP_LOGI(TAG, "Removed %s", child.c_str());
+            x->status.deleted++;
+            file_meta_changed(child.c_str());
+            x->changes->removed.push_back(child);
+        }
+    }
+}
+
+static char *extract_status_json(const extract_status_t *s)
+{
+    int64_t now = s->end_us ? s->end_us : esp_timer_get_time();
+    cJSON *json = cJSON_CreateObject();
+    if (json == NULL)
+        return NULL;
+    cJSON_AddStringToObject(json, "state", s->state);
+    cJSON_AddStringToObject(json, "dir", s->dir);
+    cJSON_AddNumberToObject(json, "total", s->total);
+    cJSON_AddNumberToObject(json, "received", s->received);
+    cJSON_AddNumberToObject(json, "files", s->files);
+    cJSON_AddNumberToObject(json, "bytes", s->bytes);
+    cJSON_AddNumberToObject(json, "deleted", s->deleted);
+    cJSON_AddNumberToObject(json, "skipped", s->skipped);
+    cJSON_AddStringToObject(json, "current", s->current);
+    cJSON_AddNumberToObject(json, "elapsed_ms", s->start_us ? (double)((now - s->start_us) / 1000) : 0);
+    if (s->error)
+        cJSON_AddStringToObject(json, "error", s->error);
+    char *str = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    return str;
+}
+
+static esp_err_t extract_receive(httpd_req_t *req, extract_t *x, tar_reader_t *tar, uint8_t *buf)
+{
+    inflate_stream_t *inflate = NULL;
+    esp_err_t err = ESP_OK;
+    bool detected = false;
+    size_t fill = 0; // Bytes in buf, more than one read only until the format is known
+    while (err == ESP_OK && x->status.received < req->content_len)
+    {
+        int received = _recv(req, (char *)buf + fill,
+                             MIN(req->content_len - x->status.received, EXTRACT_BUFFER - fill));
+        if (received <= 0)
+        {
+            ESP_LOGE(TAG, "Reception failed: %d", received);
+            x->status.error = "Reception failed";
+            err = ESP_FAIL;
+            break;
+        }
+        x->status.received += received;
+        fill += received;
+        if (!detected)
+        {
+            // A short first read can't tell gzip from tar yet.
+            if (fill < INFLATE_GZIP_ID_LEN && x->status.received < req->content_len)
+                continue;
+            detected = true;
+            if (inflate_is_gzip(buf, fill) && (inflate = inflate_create(extract_inflated, tar)) == NULL)
+            {
+                x->status.error = "Out of memory";
+                err = ESP_ERR_NO_MEM;
+                break;
+            }
+        }
+        err = inflate ? inflate_write(inflate, buf, fill) : tar_reader_feed(tar, buf, fill);
+        fill = 0;
+        publish(x);
+    }
+
+    if (err == ESP_OK && inflate)
+        err = inflate_finish(inflate);
+    if (err != ESP_OK && x->status.error == NULL)
+        x->status.error = err == ESP_ERR_INVALID_RESPONSE ? "Not a tar archive" : "Invalid gzip data";
+    if (err == ESP_OK && !tar_reader_done(tar))
+    {
+        x->status.error = "Archive incomplete";
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    inflate_free(inflate);
+
+    if (x->f != NULL)
+    {
+        // Body ended inside a file
+        fclose(x->f);
+        x->f = NULL;
+        unlink(x->tmp.c_str());
+    }
+    return err;
+}
+
+static esp_err_t extract_run(httpd_req_t *req, void *arg)
+{
+    extract_job_t *job = (extract_job_t *)arg;
+    extract_t x = {};
+    x.dir = job->dir;
+    x.remove_missing = job->remove_missing;
+    x.changes = new web_index_changes_t;
+    extract_status_t *s = &x.status;
+    s->state = "extracting";
+    s->total = req->content_len;
+    s->start_us = esp_timer_get_time();
+    snprintf(s->dir, sizeof(s->dir), "%s", job->dir);
+    publish(&x);
+    const tar_callbacks_t cb = {extract_entry_begin, extract_data, extract_entry_end};
+    tar_reader_t *tar = tar_reader_create(&cb, &x);
+    uint8_t *buf = (uint8_t *)malloc(EXTRACT_BUFFER);
+
+    esp_err_t err = ESP_OK;
+    if (tar == NULL || buf == NULL)
+    {
+        s->error = "Out of memory";
+        err = ESP_ERR_NO_MEM;
+    }
+    else if (!make_dirs(x.dir))
+        err = fail(&x, "Failed to create directory", x.dir);
+
+    if (err == ESP_OK)
+        err = extract_receive(req, &x, tar, buf);
+    if (err == ESP_OK && x.remove_missing)
+        remove_missing(&x, "");
+    tar_reader_free(tar);
+    free(buf);
+
+    s->state = err == ESP_OK ? "done" : "failed";
+    s->current[0] = 0;
+    s->end_us = esp_timer_get_time();
+    publish(&x);
+    ESP_LOGI(TAG, "Extract into %s %s: %u files, %u bytes, %u deleted, %u skipped%s%s", s->dir, s->state,
+             (unsigned)s->files, (unsigned)s->bytes, (unsigned)s->deleted, (unsigned)s->skipped, s->error ? ", " : "",
+             s->error ? s->error : "");
+
+    char *json = extract_status_json(s);
+    if (err == ESP_OK || json == NULL)
+    {
+        httpd_resp_set_type(req, "application/json");
+        err = json ? resp_stream_sendstr(req, json) : httpd_resp_send_500(req);
+    }
+    else
+    {
+        httpd_resp_set_status(req, err == ESP_FAIL ? "500 Internal Server Error" : "400 Bad Request");
+        httpd_resp_set_type(req, "application/json");
+        resp_stream_sendstr(req, json);
+        err = ESP_FAIL;
+    }
+    cJSON_free(json);
+
+    web_index_queue_changes(req->handle, x.changes);
+    web_slot_unhold();
+    busy = false;
+    return err;
+}
+
+esp_err_t api_file_extract_handler(httpd_req_t *req)
+{
+    char value[8];
+    extract_job_t *job = (extract_job_t *)calloc(1, sizeof(extract_job_t));
+    if (job == NULL)
+    {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+    if (!get_value_from_query(req, "dir", job->dir, sizeof(job->dir)))
+    {
+        free(job);
+        return ESP_FAIL;
+    }
+    size_t len = strlen(job->dir);
+    while (len > 1 && job->dir[len - 1] == '/')
+        job->dir[--len] = 0;
+    job->remove_missing = get_optional_value_from_query(req, "delete", value, sizeof(value)) && strcmp(value, "0") != 0;
+
+    struct stat st;
+    const char *error = NULL;
+    if (job->dir[0] != '/' || len < 2)
+        error = "Invalid dir";
+    else if (stat(job->dir, &st) == 0 && !S_ISDIR(st.st_mode))
+        error = "dir is a file";
+    else if (req->content_len == 0)
+        error = "Empty archive";
+    if (error)
+    {
+        free(job);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, error);
+        return ESP_FAIL;
+    }
+
+    if (lock == NULL)
+        lock = xSemaphoreCreateMutex();
+    if (lock == NULL)
+    {
+        free(job);
+        return _send_busy(req);
+    }
+    bool expected = false;
+    if (!busy.compare_exchange_strong(expected, true))
+    {
+        free(job);
+        httpd_resp_set_status(req, "409 Conflict");
+        httpd_resp_sendstr(req, "Extraction in progress");
+        return ESP_OK;
+    }
+    if (!web_slot_hold())
+    {
+        free(job);
+        busy = false;
+        return _send_busy(req);
+    }
+
+    // Extraction streams for as long as the upload takes, it must not hold one
+    // of the pool workers.
+    if (worker_pool_spawn(req, extract_run, job, "sw_extract") == ESP_OK)
+        return ESP_OK;
+
+    // No async support, run in place.
+    esp_err_t err = extract_run(req, job);
+    free(job);
+    return err;
+}
+
+esp_err_t api_file_extract_status(httpd_req_t *req)
+{
+    // The lock comes with the first extraction, before it nothing writes.
+    if (lock != NULL)
+        xSemaphoreTake(lock, portMAX_DELAY);
+    extract_status_t s = extract_status;
+    if (lock != NULL)
+        xSemaphoreGive(lock);
+    char *json = extract_status_json(&s);
+    if (json == NULL)
+        return httpd_resp_send_500(req);
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t err = resp_stream_sendstr(req, json);
+    cJSON_free(json);
+    return err;
+}
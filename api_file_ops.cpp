@@ -0,0 +1,426 @@
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include "esp_log.h"
+#include "esp_err.h"
+#include "esp_http_server.h"
+#include "cJSON.h"
+#include "api_priv.hpp"
+#include "web_index.hpp"
+#include "web_slot.hpp"
+#include "file_meta.hpp"
+#include "resp_stream.hpp"
+#include "worker_pool.hpp"
+
+// Server side copy and rename.
+//
+//   POST /api/copy     {"items": [{"from": "<path>", "to": "<path>"}, ...], "overwrite": false}
+//   POST /api/rename   same body
+//
+// A single item can be given as ?from=<path>&to=<path>[&overwrite=1] instead.
+// Directories are copied or moved with everything below them, into an
+// existing destination directory only with overwrite. The answer has one
+// result per item:
+//   {"results": [{"from": ..., "to": ..., "ok": true, "files": 3, "bytes": 1234},
+//                {"from": ..., "to": ..., "ok": false, "error": "Destination exists"}]}
+//
+// Runs on a worker task. A copy goes to <to>.part and is renamed when
+// complete, like an upload. A rename that the file system can't do in place,
+// across mounts or onto a non-empty directory, is a copy and a delete.
+
+static const char *TAG = "FILE_OPS";
+
+#define FILE_OP_BUFFER (16 * 1024)
+#define FILE_OP_BUFFER_MIN 4096
+#define FILE_OP_BODY_MAX 4096
+
+typedef struct
+{
+    bool move;
+    bool overwrite;
+    size_t body_len; // JSON body, follows the struct. 0 for a single item from the query
+    char from[FILE_PATH_MAX];
+    char to[FILE_PATH_MAX];
+} file_op_job_t;
+
+typedef struct
+{
+    char *buf;
+    size_t bufsize;
+    bool overwrite;
+    size_t files;
+    size_t bytes;
+    const char *error;
+    web_index_changes_t *changes; // Handed to the httpd task when the job is done
+} file_op_t;
+
+static void file_written(file_op_t *op, const std::string &path)
+{
+    file_meta_changed(path.c_str());
+    op->changes->written.push_back(path);
+}
+
+static void file_removed(file_op_t *op, const std::string &path)
+{
+    file_meta_changed(path.c_str());
+    op->changes->removed.push_back(path);
+}
+
+static bool fail(file_op_t *op, const char *error, const std::string &path)
+{
+    ESP_LOGE(TAG, "%s: %s (%s)", error, path.c_str(), strerror(errno));
+    if (op->error == NULL)
+        op->error = error;
+    return false;
+}
+
+// Create the directories above path.
+static bool make_parents(const std::string &path)
+{
+    for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1))
+    {
+        std::string dir = path.substr(0, slash);
+        if (mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST)
+            return false;
+    }
+    return true;
+}
+
+static bool copy_file(file_op_t *op, const std::string &from, const std::string &to)
+{
+    FILE *src = fopen(from.c_str(), "rb");
+    if (src == NULL)
+        return fail(op, "Failed to open source", from);
+
+    std::string tmp = to + UPLOAD_TMP_SUFFIX;
+    FILE *dst = fopen(tmp.c_str(), "wb");
+    if (dst == NULL)
+    {
+        fclose(src);
+        return fail(op, "Failed to create destination", tmp);
+    }
+
+    size_t total = 0;
+    size_t n;
+    bool ok = true;
+    while ((n = fread(op->buf, 1, op->bufsize, src)) > 0)
+    {
+        if (fwrite(op->buf, 1, n, dst) != n)
+        {
+            ok = false;
+            break;
+        }
+        total += n;
+    }
+    ok = ok && !ferror(src);
+    fclose(src);
+    ok = fclose(dst) == 0 && ok;
+
+    // rename replaces the destination on LittleFS, FAT needs it gone first.
+    if (ok && rename(tmp.c_str(), to.c_str()) != 0)
+        ok = unlink(to.c_str()) == 0 && rename(tmp.c_str(), to.c_str()) == 0;
+    if (!ok)
+    {
+        unlink(tmp.c_str());
+        return fail(op, "Failed to write destination", to);
+    }
+
+    op->files++;
+    op->bytes += total;
+    file_written(op, to);
+    return true;
+}
+
+static bool copy_tree(file_op_t *op, const std::string &from, const std::string &to)
+{
+    struct stat st;
+    if (stat(from.c_str(), &st) != 0)
+        return fail(op, "Source not found", from);
+    if (!S_ISDIR(st.st_mode))
+        return copy_file(op, from, to);
+
+    if (mkdir(to.c_str(), 0777) != 0 && errno != EEXIST)
+        return fail(op, "Failed to create directory", to);
+    DIR *dp = opendir(from.c_str());
+    if (dp == NULL)
+        return fail(op, "Failed to open directory", from);
+
+    bool ok = true;
+    struct dirent *entry;
+    while (ok && (entry = readdir(dp)) != NULL)
+    {
+        if (strcmp(".", entry->d_name) == 0 || strcmp("..", entry->d_name) == 0)
+            continue;
+        ok = copy_tree(op, from + "/" + entry->d_name, to + "/" + entry->d_name);
+    }
+    closedir(dp);
+    return ok;
+}
+
+static bool remove_tree(file_op_t *op, const std::string &path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return true;
+    if (!S_ISDIR(st.st_mode))
+    {
+        if (unlink(path.c_str()) != 0)
+            return fail(op, "Failed to remove source", path);
+        file_removed(op, path);
+        return true;
+    }
+
+    DIR *dp = opendir(path.c_str());
+    if (dp == NULL)
+        return fail(op, "Failed to open directory", path);
+    std::vector<std::string> names;
+    struct dirent *entry;
+    while ((entry = readdir(dp)) != NULL)
+    {
+        if (strcmp(".", entry->d_name) != 0 && strcmp("..", entry->d_name) != 0)
+            names.push_back(entry->d_name);
+    }
+    closedir(dp);
+
+    bool ok = true;
+    for (auto &name : names)
+        ok = remove_tree(op, path + "/" + name) && ok;
+    if (ok && rmdir(path.c_str()) != 0)
+        return fail(op, "Failed to remove source", path);
+    return ok;
+}
+
+// After a directory was renamed in place, report every file under it at its
+// old and new path.
+static void renamed_tree(file_op_t *op, const std::string &from, const std::string &to)
+{
+    struct stat st;
+    if (stat(to.c_str(), &st) != 0)
+        return;
+    if (!S_ISDIR(st.st_mode))
+    {
+        op->files++;
+        op->bytes += st.st_size;
+        file_removed(op, from);
+        file_written(op, to);
+        return;
+    }
+
+    DIR *dp = opendir(to.c_str());
+    if (dp == NULL)
+        return;
+    struct dirent *entry;
+    while ((entry = readdir(dp)) != NULL)
+    {
+        if (strcmp(".", entry->d_name) != 0 && strcmp("..", entry->d_name) != 0)
+            renamed_tree(op, from + "/" + entry->d_name, to + "/" + entry->d_name);
+    }
+    closedir(dp);
+}
+
+static bool move_tree(file_op_t *op, const std::string &from, const std::string &to)
+{
+    if (rename(from.c_str(), to.c_str()) == 0)
+    {
+        renamed_tree(op, from, to);
+        return true;
+    }
+    ESP_LOGI(TAG, "Rename %s in place failed (%s), copying", from.c_str(), strerror(errno));
+    return copy_tree(op, from, to) && remove_tree(op, from);
+}
+
+static void file_op_item(file_op_t *op, bool move, const char *from, const char *to)
+{
+    op->files = 0;
+    op->bytes = 0;
+    op->error = NULL;
+
+    std::string src(from);
+    std::string dst(to);
+    while (src.size() > 1 && src.back() == '/')
+        src.pop_back();
+    while (dst.size() > 1 && dst.back() == '/')
+        dst.pop_back();
+
+    struct stat from_st, to_st;
+    if (src.empty() || dst.empty() || src[0] != '/' || dst[0] != '/')
+        op->error = "Invalid path";
+    else if (stat(src.c_str(), &from_st) != 0)
+        op->error = "Source not found";
+    else if (src == dst)
+        op->error = "Source and destination are the same";
+    else if (S_ISDIR(from_st.st_mode) && dst.compare(0, src.size() + 1, src + "/") == 0)
+        op->error = "Destination inside source";
+    else if (stat(dst.c_str(), &to_st) == 0 && !op->overwrite)
+        op->error = "Destination exists";
+    else if (stat(dst.c_str(), &to_st) == 0 && S_ISDIR(to_st.st_mode) != S_ISDIR(from_st.st_mode))
+        op->error = "Destination is of another type";
+    else if (!make_parents(dst))
+        fail(op, "Failed to create directory", dst);
+    else if (move)
+        move_tree(op, src, dst);
+    else
+        copy_tree(op, src, dst);
+
+    ESP_LOGI(TAG, "%s %s to %s: %u files, %u bytes%s%s", move ? "Rename" : "Copy", from, to, (unsigned)op->files,
+             (unsigned)op->bytes, op->error ? ", " : "", op->error ? op->error : "");
+}
+
+static void file_op_result(cJSON *results, const file_op_t *op, const char *from, const char *to)
+{
+    cJSON *item = cJSON_CreateObject();
+    cJSON_AddStringToObject(item, "from", from);
+    cJSON_AddStringToObject(item, "to", to);
+    cJSON_AddBoolToObject(item, "ok", op->error == NULL);
+    cJSON_AddNumberToObject(item, "files", op->files);
+    cJSON_AddNumberToObject(item, "bytes", op->bytes);
+    if (op->error)
+        cJSON_AddStringToObject(item, "error", op->error);
+    cJSON_AddItemToArray(results, item);
+}
+
+static esp_err_t file_op_run(httpd_req_t *req, void *arg)
+{
+    file_op_job_t *job = (file_op_job_t *)arg;
+    file_op_t op = {};
+    op.overwrite = job->overwrite;
+    op.bufsize = FILE_OP_BUFFER;
+    op.buf = (char *)malloc(op.bufsize);
+    if (op.buf == NULL)
+    {
+        op.bufsize = FILE_OP_BUFFER_MIN;
+        op.buf = (char *)malloc(op.bufsize);
+    }
+    op.changes = new web_index_changes_t;
+
+    cJSON *response = cJSON_CreateObject();
+    cJSON *results = cJSON_AddArrayToObject(response, "results");
+    cJSON *body = job->body_len ? cJSON_ParseWithLength((const char *)(job + 1), job->body_len) : NULL;
+    esp_err_t err = ESP_OK;
+
+    if (op.buf == NULL || response == NULL)
+    {
+        httpd_resp_send_500(req);
+        err = ESP_ERR_NO_MEM;
+    }
+    else if (job->body_len == 0)
+    {
+        file_op_item(&op, job->move, job->from, job->to);
+        file_op_result(results, &op, job->from, job->to);
+    }
+    else
+    {
+        const cJSON *items = cJSON_GetObjectItem(body, "items");
+        if (!cJSON_IsArray(items))
+        {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Expected {\"items\": [{\"from\", \"to\"}]}");
+            err = ESP_ERR_INVALID_ARG;
+        }
+        else
+        {
+            op.overwrite = cJSON_IsTrue(cJSON_GetObjectItem(body, "overwrite"));
+            const cJSON *item;
+            cJSON_ArrayForEach(item, items)
+            {
+                const cJSON *from = cJSON_GetObjectItem(item, "from");
+                const cJSON *to = cJSON_GetObjectItem(item, "to");
+                const char *f = cJSON_IsString(from) ? from->valuestring : "";
+                const char *t = cJSON_IsString(to) ? to->valuestring : "";
+                file_op_item(&op, job->move, f, t);
+                file_op_result(results, &op, f, t);
+            }
+        }
+    }
+
+    if (err == ESP_OK)
+    {
+        char *json = cJSON_PrintUnformatted(response);
+        httpd_resp_set_type(req, "application/json");
+        err = json ? resp_stream_sendstr(req, json) : ESP_ERR_NO_MEM;
+        cJSON_free(json);
+    }
+    cJSON_Delete(body);
+    cJSON_Delete(response);
+    free(op.buf);
+
+    web_index_queue_changes(req->handle, op.changes);
+    web_slot_unhold();
+    return err;
+}
+
+static esp_err_t file_op_handler(httpd_req_t *req, bool move)
+{
+    char value[8];
+    size_t body_len = req->content_len;
+    if (body_len > FILE_OP_BODY_MAX)
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Request too large");
+        return ESP_FAIL;
+    }
+
+    file_op_job_t *job = (file_op_job_t *)calloc(1, sizeof(file_op_job_t) + body_len + 1);
+    if (job == NULL)
+    {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+    job->move = move;
+    job->overwrite = get_optional_value_from_query(req, "overwrite", value, sizeof(value)) && strcmp(value, "0") != 0;
+
+    if (body_len > 0)
+    {
+        char *body = (char *)(job + 1);
+        size_t len = 0;
+        int received;
+        while (len < body_len && (received = _recv(req, body + len, body_len - len)) > 0)
+            len += received;
+        if (len != body_len)
+        {
+            free(job);
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Incomplete body");
+            return ESP_FAIL;
+        }
+        job->body_len = body_len;
+    }
+    else if (!get_value_from_query(req, "from", job->from, sizeof(job->from)) ||
+             !get_value_from_query(req, "to", job->to, sizeof(job->to)))
+    {
+        free(job);
+        return ESP_FAIL;
+    }
+
+    if (!web_slot_hold())
+    {
+        free(job);
+        return _send_busy(req);
+    }
+    esp_err_t err = worker_pool_submit(req, file_op_run, job, WORKER_PRIORITY_LOW);
+    if (err == ESP_OK)
+        return ESP_OK;
+    if (err == ESP_ERR_INVALID_STATE)
+    {
+        free(job);
+        web_slot_unhold();
+        return _send_busy(req);
+    }
+
+    // No async support, run in place.
+    err = file_op_run(req, job);
+    free(job);
+    return err;
+}
+
+esp_err_t api_file_rename_handler(httpd_req_t *req)
+{
+    return file_op_handler(req, true);
+}
+
+esp_err_t api_file_copy_handler(httpd_req_t *req)
+{
+    return file_op_handler(req, false);
+}
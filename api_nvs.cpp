@@ -1,13 +1,513 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
 #include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <sys/param.h>
+#include <set>
+#include <string>
+#include <vector>
 #include <nvs_flash.h>
 #include "esp_http_server.h"
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "mbedtls/base64.h"
+#include "cJSON.h"
 #include "api_priv.hpp"
+#include "resp_stream.hpp"
+#include "nvs_cache.hpp"
+
+// NVS api.
+//
+//   GET  /api/nvs?cmd=erase&namespace=<ns>&key=<key>
+//   GET  /api/nvs?cmd=export&namespace=<ns>[&format=bin]
+//   POST /api/nvs?cmd=import&namespace=<ns>[&dry_run=1][&replace=1]   body as exported
+//
+// JSON: {"namespace": "<ns>", "entries": [{"key": "<key>", "type": "u8", "value": 1}, ...]}
+// with types u8, i8, u16, i16, u32, i32, u64, i64, str and blob. 64 bit
+// values are strings so they survive a double, blobs are base64. Integer
+// strings are decimal, or hex with a 0x prefix.
+// Binary: "SWNV" and a version byte, then per entry the nvs_type_t, the key
+// length, the key, the value length as u16 and the value. Last comes the
+// CRC-32 of everything before it as u32. Integers are little endian in their
+// own width, strings go without the NUL.
+//
+// An import is parsed and checked completely before anything is written, then
+// applied through one handle with one nvs_commit. The answer is the diff
+// against the namespace, with dry_run=1 nothing is written:
+//   {"applied": true, "added": ["k1"], "changed": ["k2"], "removed": [], "unchanged": 12}
+// replace=1 also erases the keys that are not in the import.
+// Export and the diff read the shared snapshot from nvs_cache, erase and
+// import drop it.
 
 static const char* TAG = "API_NVS";
 
+#define NVS_IMPORT_MAX (32 * 1024)
+#define NVS_STR_MAX 4000 // Including the NUL
+#define NVS_BIN_MAGIC "SWNV"
+#define NVS_BIN_VERSION 1
+
+static esp_err_t write_value(nvs_handle_t h, const nvs_item_t& item)
+{
+    const char* key = item.key.c_str();
+    const nvs_type_info_t* t = nvs_type_info(item.type);
+    uint64_t v = t->size ? nvs_int_value(t, item.value) : 0;
+    switch (item.type)
+    {
+    case NVS_TYPE_U8:
+        return nvs_set_u8(h, key, v);
+    case NVS_TYPE_I8:
+        return nvs_set_i8(h, key, v);
+    case NVS_TYPE_U16:
+        return nvs_set_u16(h, key, v);
+    case NVS_TYPE_I16:
+        return nvs_set_i16(h, key, v);
+    case NVS_TYPE_U32:
+        return nvs_set_u32(h, key, v);
+    case NVS_TYPE_I32:
+        return nvs_set_i32(h, key, v);
+    case NVS_TYPE_U64:
+        return nvs_set_u64(h, key, v);
+    case NVS_TYPE_I64:
+        return nvs_set_i64(h, key, v);
+    case NVS_TYPE_STR:
+        return nvs_set_str(h, key, item.value.c_str());
+    case NVS_TYPE_BLOB:
+        return nvs_set_blob(h, key, item.value.data(), item.value.size());
+    default:
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+}
+
+//-- Export ------------------------------------------------------------------------
+
+static cJSON* item_to_json(const nvs_item_t& item)
+{
+    const nvs_type_info_t* t = nvs_type_info(item.type);
+    cJSON* json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "key", item.key.c_str());
+    cJSON_AddStringToObject(json, "type", t->name);
+    if (t->size == 8)
+    {
+        char num[24];
+        uint64_t v = nvs_int_value(t, item.value);
+        if (t->is_signed)
+            snprintf(num, sizeof(num), "%" PRId64, (int64_t)v);
+        else
+            snprintf(num, sizeof(num), "%" PRIu64, v);
+        cJSON_AddStringToObject(json, "value", num);
+    }
+    else if (t->size)
+    {
+        uint64_t v = nvs_int_value(t, item.value);
+        cJSON_AddNumberToObject(json, "value", t->is_signed ? (double)(int64_t)v : (double)v);
+    }
+    else if (item.type == NVS_TYPE_STR)
+        cJSON_AddStringToObject(json, "value", item.value.c_str());
+    else
+    {
+        size_t len = 0;
+        std::string b64(4 * ((item.value.size() + 2) / 3) + 1, 0);
+        mbedtls_base64_encode((unsigned char*)&b64[0], b64.size(), &len, (const unsigned char*)item.value.data(),
+                              item.value.size());
+        b64.resize(len);
+        cJSON_AddStringToObject(json, "value", b64.c_str());
+    }
+    return json;
+}
+
+static esp_err_t export_json(httpd_req_t* req, const char* ns, const std::vector<nvs_item_t>& items)
+{
+    resp_stream_t out;
+    httpd_resp_set_type(req, "application/json");
+    resp_stream_begin(&out, req);
+
+    cJSON* name = cJSON_CreateString(ns);
+    char* str = cJSON_PrintUnformatted(name);
+    cJSON_Delete(name);
+    resp_stream_send(&out, "{\"namespace\": ", HTTPD_RESP_USE_STRLEN);
+    resp_stream_send(&out, str ? str : "\"\"", HTTPD_RESP_USE_STRLEN);
+    resp_stream_send(&out, ", \"entries\": [", HTTPD_RESP_USE_STRLEN);
+    cJSON_free(str);
+
+    // One entry at a time, a namespace with large strings is never held twice.
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        cJSON* json = item_to_json(items[i]);
+        str = cJSON_PrintUnformatted(json);
+        cJSON_Delete(json);
+        if (i > 0)
+            resp_stream_send(&out, ",", 1);
+        resp_stream_send(&out, str ? str : "null", HTTPD_RESP_USE_STRLEN);
+        cJSON_free(str);
+    }
+    resp_stream_send(&out, "]}", 2);
+    return resp_stream_end(&out);
+}
+
+static esp_err_t send_bin(httpd_req_t* req, uint32_t* crc, const void* data, size_t len)
+{
+    *crc = esp_rom_crc32_le(*crc, (const uint8_t*)data, len);
+    return httpd_resp_send_chunk(req, (const char*)data, len);
+}
+
+static esp_err_t export_bin(httpd_req_t* req, const std::vector<nvs_item_t>& items)
+{
+    for (auto& item : items)
+    {
+        if (item.value.size() > UINT16_MAX)
+        {
+            ESP_LOGE(TAG, "%s too large for the binary format", item.key.c_str());
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Value too large for format=bin");
+            return ESP_FAIL;
+        }
+    }
+
+    httpd_resp_set_type(req, "application/octet-stream");
+    uint32_t crc = 0;
+    uint8_t hdr[4 + 1] = {'S', 'W', 'N', 'V', NVS_BIN_VERSION};
+    esp_err_t err = send_bin(req, &crc, hdr, sizeof(hdr));
+    for (auto& item : items)
+    {
+        uint8_t entry[2 + NVS_KEY_NAME_MAX_SIZE + 2];
+        size_t n = 0;
+        entry[n++] = item.type;
+        entry[n++] = item.key.size();
+        memcpy(entry + n, item.key.data(), item.key.size());
+        n += item.key.size();
+        entry[n++] = item.value.size() & 0xff;
+        entry[n++] = item.value.size() >> 8;
+        if (err == ESP_OK)
+            err = send_bin(req, &crc, entry, n);
+        if (err == ESP_OK && !item.value.empty())
+            err = send_bin(req, &crc, item.value.data(), item.value.size());
+    }
+    uint8_t trailer[4] = {(uint8_t)crc, (uint8_t)(crc >> 8), (uint8_t)(crc >> 16), (uint8_t)(crc >> 24)};
+    if (err == ESP_OK)
+        err = httpd_resp_send_chunk(req, (const char*)trailer, sizeof(trailer));
+    if (err == ESP_OK)
+        err = httpd_resp_send_chunk(req, NULL, 0);
+    return err;
+}
+
+static esp_err_t nvs_export(httpd_req_t* req, const char* ns, bool bin)
+{
+    nvs_snapshot_ptr_t snapshot = nvs_cache_get(ns);
+    if (snapshot == NULL)
+    {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to read nvs");
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "Exporting %u keys of %s", (unsigned)snapshot->items.size(), ns);
+    return bin ? export_bin(req, snapshot->items) : export_json(req, ns, snapshot->items);
+}
+
+//-- Import ------------------------------------------------------------------------
+
+// Checks common to both formats. NULL when the item is fine.
+static const char* check_item(const nvs_item_t& item)
+{
+    if (item.key.empty() || item.key.size() >= NVS_KEY_NAME_MAX_SIZE)
+        return "Invalid key";
+    const nvs_type_info_t* t = nvs_type_info(item.type);
+    if (t == NULL)
+        return "Invalid type";
+    if (t->size && item.value.size() != t->size)
+        return "Invalid value size";
+    if (item.type == NVS_TYPE_STR && (item.value.size() >= NVS_STR_MAX || memchr(item.value.data(), 0, item.value.size())))
+        return "Invalid string";
+    return NULL;
+}
+
+static const char* parse_int(const nvs_type_info_t* t, const cJSON* value, std::string& out)
+{
+    uint64_t v;
+    if (cJSON_IsNumber(value))
+    {
+        double d = value->valuedouble;
+        if (d < -9.2e18 || d > 9.2e18)
+            return "Out of range";
+        if (d != (double)(int64_t)d)
+            return "Not an integer";
+        v = (uint64_t)(int64_t)d;
+        if (!t->is_signed && d < 0)
+            return "Out of range";
+    }
+    else if (cJSON_IsString(value) && value->valuestring[0])
+    {
+        // Decimal, hex only with 0x. A leading 0 is not octal.
+        const char* digits = value->valuestring + (value->valuestring[0] == '-');
+        int base = strncasecmp(digits, "0x", 2) == 0 ? 16 : 10;
+        char* end;
+        errno = 0;
+        v = t->is_signed ? (uint64_t)strtoll(value->valuestring, &end, base) : strtoull(value->valuestring, &end, base);
+        if (*end || errno || (!t->is_signed && value->valuestring[0] == '-'))
+            return "Not an integer";
+    }
+    else
+        return "Missing value";
+
+    if (t->size < 8)
+    {
+        int bits = 8 * t->size;
+        int64_t s = (int64_t)v;
+        bool fits = t->is_signed ? s >= -(1LL << (bits - 1)) && s < (1LL << (bits - 1)) : v < (1ULL << bits);
+        if (!fits)
+            return "Out of range";
+    }
+    out = nvs_int_bytes(t, v);
+    return NULL;
+}
+
+static const char* parse_json(const char* body, size_t len, std::vector<nvs_item_t>& items, std::string& bad_key)
+{
+    cJSON* json = cJSON_ParseWithLength(body, len);
+    const cJSON* entries = cJSON_GetObjectItem(json, "entries");
+    const char* error = cJSON_IsArray(entries) ? NULL : "Expected {\"entries\": [...]}";
+    const cJSON* entry;
+    cJSON_ArrayForEach(entry, entries)
+    {
+        const cJSON* key = cJSON_GetObjectItem(entry, "key");
+        const cJSON* type = cJSON_GetObjectItem(entry, "type");
+        const cJSON* value = cJSON_GetObjectItem(entry, "value");
+        const nvs_type_info_t* t = cJSON_IsString(type) ? nvs_type_by_name(type->valuestring) : NULL;
+        bad_key = cJSON_IsString(key) ? key->valuestring : "";
+        if (!cJSON_IsString(key))
+            error = "Invalid key";
+        else if (t == NULL)
+            error = "Invalid type";
+        else
+        {
+            items.push_back({key->valuestring, t->type, std::string()});
+            std::string& v = items.back().value;
+            if (t->size)
+                error = parse_int(t, value, v);
+            else if (!cJSON_IsString(value))
+                error = "Missing value";
+            else if (t->type == NVS_TYPE_STR)
+                v = value->valuestring;
+            else
+            {
+                size_t n = 0;
+                size_t slen = strlen(value->valuestring);
+                v.resize(slen * 3 / 4 + 3);
+                if (mbedtls_base64_decode((unsigned char*)&v[0], v.size(), &n, (const unsigned char*)value->valuestring, slen) != 0)
+                    error = "Invalid base64";
+                v.resize(n);
+            }
+        }
+        if (error)
+            break;
+    }
+    cJSON_Delete(json);
+    return error;
+}
+
+static const char* parse_bin(const uint8_t* body, size_t len, std::vector<nvs_item_t>& items, std::string& bad_key)
+{
+    if (len < 4 + 1 + 4 || body[4] != NVS_BIN_VERSION)
+        return "Unsupported binary version";
+    len -= 4;
+    uint32_t crc = body[len] | body[len + 1] << 8 | body[len + 2] << 16 | (uint32_t)body[len + 3] << 24;
+    if (esp_rom_crc32_le(0, body, len) != crc)
+        return "CRC mismatch";
+
+    size_t pos = 4 + 1;
+    while (pos < len)
+    {
+        if (len - pos < 2 || len - pos - 2 < body[pos + 1] + 2u)
+            return "Truncated entry";
+        nvs_type_t type = (nvs_type_t)body[pos];
+        size_t key_len = body[pos + 1];
+        bad_key.assign((const char*)body + pos + 2, key_len);
+        pos += 2 + key_len;
+        size_t value_len = body[pos] | body[pos + 1] << 8;
+        pos += 2;
+        if (len - pos < value_len)
+            return "Truncated entry";
+        items.push_back({bad_key, type, std::string((const char*)body + pos, value_len)});
+        pos += value_len;
+    }
+    return NULL;
+}
+
+static esp_err_t recv_body(httpd_req_t* req, char* body, size_t len)
+{
+    size_t got = 0;
+    while (got < len)
+    {
+        int received = _recv(req, body + got, len - got);
+        if (received <= 0)
+            return ESP_FAIL;
+        got += received;
+    }
+    return ESP_OK;
+}
+
+static void add_key(cJSON* array, const std::string& key)
+{
+    cJSON_AddItemToArray(array, cJSON_CreateString(key.c_str()));
+}
+
+static esp_err_t send_json(httpd_req_t* req, const char* status, cJSON* json)
+{
+    char* str = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    if (str == NULL)
+        return httpd_resp_send_500(req);
+    if (status)
+        httpd_resp_set_status(req, status);
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t err = resp_stream_sendstr(req, str);
+    cJSON_free(str);
+    return err;
+}
+
+static esp_err_t import_error(httpd_req_t* req, const char* status, const char* error, const std::string& key)
+{
+    ESP_LOGE(TAG, "Import failed: %s (%s)", error, key.c_str());
+    cJSON* json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "error", error);
+    if (!key.empty())
+        cJSON_AddStringToObject(json, "key", key.c_str());
+    send_json(req, status, json);
+    return ESP_FAIL;
+}
+
+static esp_err_t nvs_import(httpd_req_t* req, const char* ns, bool dry_run, bool replace)
+{
+    if (req->content_len == 0 || req->content_len > NVS_IMPORT_MAX)
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, req->content_len ? "Request too large" : "Empty body");
+        return ESP_FAIL;
+    }
+    char* body = (char*)malloc(req->content_len);
+    if (body == NULL)
+    {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+    if (recv_body(req, body, req->content_len) != ESP_OK)
+    {
+        free(body);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Incomplete body");
+        return ESP_FAIL;
+    }
+
+    std::vector<nvs_item_t> items;
+    std::string key;
+    const char* error = req->content_len >= 4 && memcmp(body, NVS_BIN_MAGIC, 4) == 0
+                            ? parse_bin((const uint8_t*)body, req->content_len, items, key)
+                            : parse_json(body, req->content_len, items, key);
+    free(body);
+
+    // Everything is checked before the first write.
+    std::set<std::string> keys;
+    for (size_t i = 0; error == NULL && i < items.size(); i++)
+    {
+        key = items[i].key;
+        error = check_item(items[i]);
+        if (error == NULL && !keys.insert(key).second)
+            error = "Duplicate key";
+    }
+    if (error)
+        return import_error(req, "400 Bad Request", error, key);
+
+    nvs_snapshot_ptr_t snapshot = nvs_cache_get(ns);
+    if (snapshot == NULL)
+        return import_error(req, "500 Internal Server Error", "Failed to read nvs", "");
+    const std::vector<nvs_item_t>& current = snapshot->items;
+
+    cJSON* json = cJSON_CreateObject();
+    cJSON_AddBoolToObject(json, "applied", !dry_run);
+    cJSON* added = cJSON_AddArrayToObject(json, "added");
+    cJSON* changed = cJSON_AddArrayToObject(json, "changed");
+    cJSON* removed = cJSON_AddArrayToObject(json, "removed");
+    size_t unchanged = 0;
+
+    // Writes and erases, in the order they are applied.
+    std::vector<const nvs_item_t*> writes;
+    std::vector<const nvs_item_t*> retyped; // Existing keys of another type, erased first
+    std::vector<const nvs_item_t*> erases;
+    for (auto& item : items)
+    {
+        auto it = current.begin();
+        while (it != current.end() && it->key != item.key)
+            it++;
+        if (it == current.end())
+            add_key(added, item.key);
+        else if (it->type != item.type || it->value != item.value)
+        {
+            add_key(changed, item.key);
+            if (it->type != item.type)
+                retyped.push_back(&*it);
+        }
+        else
+        {
+            unchanged++;
+            continue;
+        }
+        writes.push_back(&item);
+    }
+    if (replace)
+    {
+        for (auto& item : current)
+        {
+            if (!keys.count(item.key))
+            {
+                add_key(removed, item.key);
+                erases.push_back(&item);
+            }
+        }
+    }
+    cJSON_AddNumberToObject(json, "unchanged", unchanged);
+
+    if (!dry_run && (!writes.empty() || !erases.empty()))
+    {
+        nvs_handle_t h;
+        esp_err_t err = nvs_open(ns, NVS_READWRITE, &h);
+        if (err != ESP_OK)
+        {
+            cJSON_Delete(json);
+            return import_error(req, "500 Internal Server Error", "Error opening nvs", "");
+        }
+        const char* failed = NULL;
+        for (auto item : retyped)
+        {
+            if (err == ESP_OK && (err = nvs_erase_key(h, item->key.c_str())) != ESP_OK)
+                failed = item->key.c_str();
+        }
+        for (auto item : erases)
+        {
+            if (err == ESP_OK && (err = nvs_erase_key(h, item->key.c_str())) != ESP_OK)
+                failed = item->key.c_str();
+        }
+        for (auto item : writes)
+        {
+            if (err == ESP_OK && (err = write_value(h, *item)) != ESP_OK)
+                failed = item->key.c_str();
+        }
+        if (err == ESP_OK)
+            err = nvs_commit(h);
+        nvs_close(h);
+        // Also after a failure, some of the writes may have landed.
+        nvs_cache_invalidate(ns);
+        if (err != ESP_OK)
+        {
+            cJSON_Delete(json);
+            ESP_LOGE(TAG, "Writing %s failed: %s", ns, esp_err_to_name(err));
+            return import_error(req, "500 Internal Server Error", esp_err_to_name(err), failed ? failed : "");
+        }
+    }
+
+    ESP_LOGI(TAG, "Import into %s%s: %u written, %u erased, %u unchanged", ns, dry_run ? " (dry run)" : "",
+             (unsigned)writes.size(), (unsigned)erases.size(), (unsigned)unchanged);
+    send_json(req, NULL, json);
+    return ESP_OK;
+}
+
 esp_err_t api_nvs(httpd_req_t* req)
 {
     size_t len = httpd_req_get_url_query_len(req) + 1;
@@ -35,6 +535,20 @@ esp_err_t api_nvs(httpd_req_t* req)
         return ESP_FAIL;
     }
 
+    char value[8];
+    bool post = req->method == HTTP_POST;
+    if (strcmp(cmd, "export") == 0 && !post)
+    {
+        bool bin = httpd_query_key_value(query, "format", value, sizeof(value)) == ESP_OK && strcmp(value, "bin") == 0;
+        return nvs_export(req, nvsnamespace, bin);
+    }
+    if (strcmp(cmd, "import") == 0 && post)
+    {
+        bool dry_run = httpd_query_key_value(query, "dry_run", value, sizeof(value)) == ESP_OK && strcmp(value, "0") != 0;
+        bool replace = httpd_query_key_value(query, "replace", value, sizeof(value)) == ESP_OK && strcmp(value, "0") != 0;
+        return nvs_import(req, nvsnamespace, dry_run, replace);
+    }
+
     if (strcmp(cmd, "erase") == 0)
     {
         char keyval[64];
@@ -45,16 +559,27 @@ esp_err_t api_nvs(httpd_req_t* req)
             if (err == ESP_OK)
             {
                 ESP_LOGW(TAG, "Erasing NVS parameter %s", keyval);
-                ESP_ERROR_CHECK(nvs_erase_key(h, keyval));
-                ESP_ERROR_CHECK(nvs_commit(h));
+                err = nvs_erase_key(h, keyval);
+                if (err == ESP_OK)
+                    err = nvs_commit(h);
                 nvs_close(h);
-                httpd_resp_sendstr(req, "OK");
-                return ESP_OK;
+                nvs_cache_invalidate(nvsnamespace);
+                if (err == ESP_OK)
+                {
+                    httpd_resp_sendstr(req, "OK");
+                    return ESP_OK;
+                }
+                ESP_LOGE(TAG, "Error erasing %s (%s)", keyval, esp_err_to_name(err));
+                httpd_resp_send_err(req, err == ESP_ERR_NVS_NOT_FOUND ? HTTPD_404_NOT_FOUND : HTTPD_500_INTERNAL_SERVER_ERROR,
+                                    "Error erasing key");
+                return ESP_FAIL;
             }
 
             httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Error opening nvs");
             ESP_LOGE(TAG, "Error opening nvs (%d)", err);
+            return ESP_FAIL;
         }
     }
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Unknown cmd");
     return ESP_FAIL;
 }
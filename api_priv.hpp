@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdio.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <esp_err.h>
 #include <esp_vfs.h>
@@ -8,13 +10,33 @@
 #define BOUNDARY_MAX_LEN 100
 #define API_BUFFSIZE 1024
 #define FILE_PATH_MAX (ESP_VFS_PATH_MAX + 64)
+#define SHA256_SIZE 32
+#define UPLOAD_TMP_SUFFIX ".part" // Uploads are written here and renamed when complete
+#define RECV_RETRIES 5 // Receive timeouts in a row before a body is given up
 
 bool get_value_from_query(httpd_req_t *req, const char* value_name, char *destination, size_t dest_len);
+bool get_optional_value_from_query(httpd_req_t *req, const char *value_name, char *destination, size_t dest_len);
 esp_err_t api_file_upload_handler(httpd_req_t *req);
 esp_err_t api_file_download_handler(httpd_req_t *req);
 esp_err_t api_file_list_all_handler(httpd_req_t *req);
+esp_err_t api_file_rename_handler(httpd_req_t *req);
+esp_err_t api_file_copy_handler(httpd_req_t *req);
+esp_err_t api_file_extract_handler(httpd_req_t *req);
+esp_err_t api_file_extract_status(httpd_req_t *req);
+esp_err_t api_file_delete_handler(httpd_req_t *req);
+esp_err_t api_file_delete_status(httpd_req_t *req);
 esp_err_t api_nvs(httpd_req_t* req);
 esp_err_t _set_gz_support(httpd_req_t* req, bool& set);
+int _negotiate_encoding(httpd_req_t* req, uint8_t variants);
 esp_err_t _set_keepalive_support(httpd_req_t* req, bool& set);
 bool _get_boundary(httpd_req_t *req, char *boundary, size_t boundary_len);
+FILE *_create_file(httpd_req_t *req, const char *filepath);
+// httpd_req_recv, retrying up to RECV_RETRIES timeouts in a row.
+int _recv(httpd_req_t *req, char *buf, size_t len);
+// 503 with Retry-After, for work turned away because a queue or job is full.
+esp_err_t _send_busy(httpd_req_t *req);
+bool _parse_sha256(const char *hex, uint8_t digest[SHA256_SIZE]);
+void _format_sha256(const uint8_t digest[SHA256_SIZE], char hex[2 * SHA256_SIZE + 1]);
+esp_err_t _file_sha256(const char *path, uint8_t digest[SHA256_SIZE], char *buf, size_t bufsize);
+void api_upload_session_register(void);
 
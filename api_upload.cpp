@@ -10,6 +10,10 @@
 #include "cJSON.h"
 #include "httpss.h"
 #include "api_priv.hpp"
+#include "web_index.hpp"
+#include "file_meta.hpp"
+#include "multipart.hpp"
+#include "mbedtls/sha256.h"
 
 #define TAG "FILE_SERVER"
 
@@ -47,6 +51,23 @@ bool get_value_from_query(httpd_req_t *req, const char* value_name, char *destin
     return true;
 }
 
+// Like get_value_from_query, but a missing value is not an error and no
+// response is sent.
+bool get_optional_value_from_query(httpd_req_t *req, const char *value_name, char *destination, size_t dest_len)
+{
+    const int buf_len = httpd_req_get_url_query_len(req) + 1;
+    if (buf_len <= 1)
+        return false;
+
+    char *buf1 = (char *)malloc(buf_len);
+    if (buf1 == NULL)
+        return false;
+    bool found = httpd_req_get_url_query_str(req, buf1, buf_len) == ESP_OK &&
+                 httpd_query_key_value(buf1, value_name, destination, dest_len) == ESP_OK;
+    free(buf1);
+    return found;
+}
+
 bool _get_boundary(httpd_req_t *req, char *boundary, size_t boundary_len)
 {
     static char buf[100];
@@ -55,7 +76,12 @@ bool _get_boundary(httpd_req_t *req, char *boundary, size_t boundary_len)
         char *boundary_start = strstr(buf, "boundary=");
         if (boundary_start)
         {
-            snprintf(boundary, boundary_len, "--%s", boundary_start + 9);
+            // The boundary may be quoted and followed by more parameters
+            char *value = boundary_start + 9;
+            if (*value == '"')
+                value++;
+            value[strcspn(value, "\";")] = '\0';
+            snprintf(boundary, boundary_len, "--%s", value);
             return true;
         }
     }
@@ -65,7 +91,23 @@ bool _get_boundary(httpd_req_t *req, char *boundary, size_t boundary_len)
     return false;
 }
 
-static FILE *create_file(httpd_req_t *req, const char *filepath)
+int _recv(httpd_req_t *req, char *buf, size_t len)
+{
+    int received;
+    int retries = 0;
+    while ((received = httpd_req_recv(req, buf, len)) == HTTPD_SOCK_ERR_TIMEOUT && ++retries <= RECV_RETRIES)
+        ;
+    return received;
+}
+
+esp_err_t _send_busy(httpd_req_t *req)
+{
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_set_hdr(req, "Retry-After", "1");
+    return httpd_resp_send(req, "Busy", HTTPD_RESP_USE_STRLEN);
+}
+
+FILE *_create_file(httpd_req_t *req, const char *filepath)
 {
     char *slash = strrchr(filepath, '/');
     if (slash)
@@ -95,128 +137,200 @@ static FILE *create_file(httpd_req_t *req, const char *filepath)
     return f;
 }
 
-static bool extract_filename_from_content_disposition(httpd_req_t req, char *buf, char *filename, size_t filename_len)
+bool _parse_sha256(const char *hex, uint8_t digest[SHA256_SIZE])
 {
-    char *header_start = strstr(buf, "Content-Disposition: form-data; name=\"file\"; filename=\"");
-    if (header_start)
+    if (strlen(hex) != 2 * SHA256_SIZE)
+        return false;
+    for (int i = 0; i < SHA256_SIZE; i++)
     {
-        header_start += strlen("Content-Disposition: form-data; name=\"file\"; filename=\"");
-        char *filename_end = strchr(header_start, '"');
-        if (filename_end)
-        {
-            int len = filename_end - header_start;
-            if (len < filename_len)
-            {
-                strncpy(filename, header_start, len);
-                filename[len] = '\0';
-                printf("Filename: %s\n", filename);
-                return true;
-            }
-        }
+        char byte[3] = {hex[2 * i], hex[2 * i + 1], 0};
+        char *end;
+        digest[i] = strtoul(byte, &end, 16);
+        if (*end != '\0')
+            return false;
     }
+    return true;
+}
 
-    ESP_LOGE(TAG, "Filename not found in content disposition");
-    httpd_resp_send_500(&req);
-    return false;
+void _format_sha256(const uint8_t digest[SHA256_SIZE], char hex[2 * SHA256_SIZE + 1])
+{
+    for (int i = 0; i < SHA256_SIZE; i++)
+        sprintf(hex + 2 * i, "%02x", digest[i]);
+}
+
+esp_err_t _file_sha256(const char *path, uint8_t digest[SHA256_SIZE], char *buf, size_t bufsize)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return ESP_ERR_NOT_FOUND;
+
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    size_t n;
+    while ((n = fread(buf, 1, bufsize, f)) > 0)
+        mbedtls_sha256_update(&sha, (const unsigned char *)buf, n);
+    esp_err_t err = ferror(f) ? ESP_FAIL : ESP_OK;
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
+    fclose(f);
+    return err;
+}
+
+typedef struct
+{
+    httpd_req_t *req;
+    const char *filePath;
+    const char *tmpPath; // Written first, renamed to filePath when complete
+    FILE *f;
+    bool written;   // First part stored, later parts are ignored
+    bool responded; // An error response was already sent
+    mbedtls_sha256_context sha;
+    uint8_t digest[SHA256_SIZE];
+} upload_ctx_t;
+
+static esp_err_t upload_part_begin(void *arg, const multipart_part_t *part)
+{
+    upload_ctx_t *ctx = (upload_ctx_t *)arg;
+    if (ctx->written)
+        return ESP_OK;
+
+    if ((ctx->f = _create_file(ctx->req, ctx->tmpPath)) == NULL)
+    {
+        ctx->responded = true;
+        return ESP_FAIL;
+    }
+    mbedtls_sha256_starts(&ctx->sha, 0);
+    return ESP_OK;
+}
+
+static esp_err_t upload_data(void *arg, const multipart_part_t *part, const uint8_t *data, size_t len)
+{
+    upload_ctx_t *ctx = (upload_ctx_t *)arg;
+    if (ctx->f == NULL)
+        return ESP_OK;
+
+    mbedtls_sha256_update(&ctx->sha, data, len);
+    if (fwrite(data, 1, len, ctx->f) != len)
+    {
+        ESP_LOGE(TAG, "Failed to write %s", ctx->tmpPath);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t upload_part_end(void *arg, const multipart_part_t *part)
+{
+    upload_ctx_t *ctx = (upload_ctx_t *)arg;
+    if (ctx->f == NULL)
+        return ESP_OK;
+
+    int err = fclose(ctx->f);
+    ctx->f = NULL;
+    if (err != 0)
+    {
+        ESP_LOGE(TAG, "Failed to close %s", ctx->tmpPath);
+        return ESP_FAIL;
+    }
+    mbedtls_sha256_finish(&ctx->sha, ctx->digest);
+    ctx->written = true;
+    return ESP_OK;
 }
 
 esp_err_t api_file_upload_handler(httpd_req_t *req)
 {
-    esp_err_t res = ESP_OK;
-    char filePath[64];
+    char filePath[FILE_PATH_MAX];
+    char tmpPath[FILE_PATH_MAX + sizeof(UPLOAD_TMP_SUFFIX)];
     char boundary[BOUNDARY_MAX_LEN];
 
     if (!get_value_from_query(req, "file", filePath, sizeof(filePath)))
         return ESP_FAIL;
+    snprintf(tmpPath, sizeof(tmpPath), "%s" UPLOAD_TMP_SUFFIX, filePath);
 
     if (!_get_boundary(req, boundary, sizeof(boundary)))
         return ESP_FAIL;
 
     static char buf[API_BUFFSIZE];
-    int received = 0;
-    FILE *f = NULL;
+    char hex[2 * SHA256_SIZE + 1];
+    uint8_t expected[SHA256_SIZE];
+    bool verify = get_optional_value_from_query(req, "sha256", hex, sizeof(hex));
+    if (verify && !_parse_sha256(hex, expected))
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid sha256");
+        return ESP_FAIL;
+    }
 
-    while (1)
+    // An unchanged file is not written again, the body is discarded by httpd.
+    uint8_t stored[SHA256_SIZE];
+    if (verify && _file_sha256(filePath, stored, buf, sizeof(buf)) == ESP_OK &&
+        memcmp(stored, expected, SHA256_SIZE) == 0)
     {
-        received = httpd_req_recv(req, buf, API_BUFFSIZE);
-        if (received == HTTPD_SOCK_ERR_TIMEOUT)
-            continue;
+        ESP_LOGI(TAG, "File %s unchanged, skipping write", filePath);
+        httpd_resp_set_hdr(req, "X-Content-SHA256", hex);
+        httpd_resp_sendstr(req, "File unchanged");
+        return ESP_OK;
+    }
 
-        else if (received < 0)
-        {
-            ESP_LOGE(TAG, "File reception failed: %d", received);
-            res = ESP_FAIL;
-            break;
-        }
-        else if (received == 0)
-        {
-            if (f != NULL)
-            {
-                fclose(f);
-                f = NULL;
-            }
-            ESP_LOGI(TAG, "R%d: File reception complete for %s", received, filePath);
-            httpd_resp_sendstr(req, "File uploaded successfully");
-            break;
-        }
+    upload_ctx_t ctx = {};
+    ctx.req = req;
+    ctx.filePath = filePath;
+    ctx.tmpPath = tmpPath;
+    mbedtls_sha256_init(&ctx.sha);
+    const multipart_callbacks_t cb = {upload_part_begin, upload_data, upload_part_end};
+    multipart_t *mp = multipart_create(boundary, &cb, &ctx);
+    if (mp == NULL)
+    {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
 
-        char *data_start = buf;
-        char *data_end = NULL;
+    esp_err_t res = multipart_receive(req, mp, buf, sizeof(buf));
+    multipart_free(mp);
+    mbedtls_sha256_free(&ctx.sha);
 
-        while (data_start < buf + received)
-        {
-            if (f == NULL)
-            {
-                char *boundary_start = strstr(data_start, boundary);
-                if (boundary_start)
-                {
-                    data_start = boundary_start + strlen(boundary);
-                    char *header_end = strstr(data_start, "\r\n\r\n");
-                    if (header_end)
-                    {
-                        data_start = header_end + 4; // Move past the "\r\n\r\n" to the binary data start
-                        char filename[64];
-                        // if (extract_filename_from_content_disposition(*req, buf, filename, sizeof(filename)))
-                        // {
-                            if ((f = create_file(req, filePath)) == NULL)
-                            {
-                                res = ESP_FAIL;
-                                break;
-                            }
-                        // }
-                    }
-                }
-                else
-                {
-                    data_start += received; // Move to end of buffer if no boundary is found
-                }
-            }
-            
-            if (f != NULL)
-            {
-                data_end = strstr(data_start, boundary);
-                if (data_end)
-                {
-                    fwrite(data_start, 1, data_end - data_start, f);
-                    ESP_LOGI(TAG, "R%d: File reception complete for %s", received, filePath);
-                    fclose(f);
-                    f = NULL;
-                    data_start = data_end + strlen(boundary);
-                    break;
-                }
-                else
-                {
-                    fwrite(data_start, 1, buf + received - data_start, f);
-                    data_start = buf + received;
-                }
-            }
-        }
+    if (ctx.f != NULL)
+    {
+        // Body ended inside the part
+        fclose(ctx.f);
+    }
+    if (res == ESP_OK && ctx.written && verify && memcmp(ctx.digest, expected, SHA256_SIZE) != 0)
+    {
+        ESP_LOGE(TAG, "SHA-256 mismatch for %s", filePath);
+        unlink(tmpPath);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "SHA-256 mismatch");
+        return ESP_FAIL;
+    }
+    if (res != ESP_OK || !ctx.written)
+        unlink(tmpPath);
+
+    if (res == ESP_OK && !ctx.written)
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "No file in request");
+        return ESP_FAIL;
+    }
+    if (res != ESP_OK)
+    {
+        ESP_LOGE(TAG, "File reception failed for %s: %s", filePath, esp_err_to_name(res));
+        if (!ctx.responded)
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "File reception failed");
+        return ESP_FAIL;
     }
 
-    if (f != NULL)
+    // The old file stays in place until the new one is complete
+    if (rename(tmpPath, filePath) != 0)
     {
-        fclose(f);
+        ESP_LOGE(TAG, "Failed to rename %s to %s", tmpPath, filePath);
+        unlink(tmpPath);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to store file");
+        return ESP_FAIL;
     }
 
-    return res;
+    ESP_LOGI(TAG, "File reception complete for %s", filePath);
+    web_index_file_written(filePath);
+    file_meta_changed(filePath);
+    web_index_save();
+    _format_sha256(ctx.digest, hex);
+    httpd_resp_set_hdr(req, "X-Content-SHA256", hex);
+    httpd_resp_sendstr(req, "File uploaded successfully");
+    return ESP_OK;
 }
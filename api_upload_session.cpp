@@ -0,0 +1,384 @@
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <map>
+#include <vector>
+#include <utility>
+#include "esp_log.h"
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "esp_rom_crc.h"
+#include "esp_http_server.h"
+#include "httpss.h"
+#include "api_priv.hpp"
+#include "web_index.hpp"
+#include "file_meta.hpp"
+
+// Resumable chunked uploads.
+//
+//   POST /api/upload/start?file=<path>&size=<bytes>        -> session status
+//   POST /api/upload/chunk?id=<id>&offset=<n>&crc=<crc32>  raw body -> session status
+//   GET  /api/upload/status?id=<id>                        -> session status
+//   POST /api/upload/commit?id=<id>[&sha256=<hex>]
+//   POST /api/upload/abort?id=<id>
+//
+// Chunks go to <path>.part at their offset and may arrive in any order. They
+// are written on the httpd task one at a time, so chunks sent over several
+// connections are taken in turn. A chunk counts once its CRC-32 (as zlib
+// computes it) matches.
+// One that fails its CRC or breaks off leaves the bytes it overwrote
+// unverified, even where an earlier chunk had covered them.
+// Commit renames the .part file over <path> when every byte is received, so
+// the old file stays intact until then. Starting a session for a path that
+// already has one resumes it, status.offset is where to continue.
+
+#define UPLOAD_SESSIONS_MAX 4
+#define UPLOAD_SESSION_TIMEOUT_US (10 * 60 * 1000000LL) // Idle sessions are dropped when room is needed
+
+static const char* TAG = "UPLOAD_SESSION";
+
+typedef struct
+{
+    char path[FILE_PATH_MAX];
+    size_t size;
+    std::vector<std::pair<size_t, size_t>> ranges; // Verified [start, end), sorted and merged
+    int64_t last_used;
+} upload_session_t;
+
+static std::map<uint32_t, upload_session_t> sessions;
+
+static void tmp_path(const upload_session_t& s, char* buf, size_t size)
+{
+    snprintf(buf, size, "%s" UPLOAD_TMP_SUFFIX, s.path);
+}
+
+static void add_range(upload_session_t& s, size_t start, size_t end)
+{
+    std::vector<std::pair<size_t, size_t>> merged;
+    bool placed = false;
+    for (auto& r : s.ranges)
+    {
+        if (r.second < start)
+            merged.push_back(r);
+        else if (r.first > end)
+        {
+            if (!placed)
+                merged.push_back({start, end});
+            placed = true;
+            merged.push_back(r);
+        }
+        else
+        {
+            start = MIN(start, r.first);
+            end = MAX(end, r.second);
+        }
+    }
+    if (!placed)
+        merged.push_back({start, end});
+    s.ranges.swap(merged);
+}
+
+// Forget [start, end), for bytes overwritten by a chunk that didn't verify.
+static void remove_range(upload_session_t& s, size_t start, size_t end)
+{
+    std::vector<std::pair<size_t, size_t>> kept;
+    for (auto& r : s.ranges)
+    {
+        if (r.second <= start || r.first >= end)
+        {
+            kept.push_back(r);
+            continue;
+        }
+        if (r.first < start)
+            kept.push_back({r.first, start});
+        if (r.second > end)
+            kept.push_back({end, r.second});
+    }
+    s.ranges.swap(kept);
+}
+
+static size_t received_bytes(const upload_session_t& s)
+{
+    size_t total = 0;
+    for (auto& r : s.ranges)
+        total += r.second - r.first;
+    return total;
+}
+
+// First byte not yet received, where a sequential client continues.
+static size_t resume_offset(const upload_session_t& s)
+{
+    if (s.ranges.empty() || s.ranges[0].first != 0)
+        return 0;
+    return s.ranges[0].second;
+}
+
+static esp_err_t send_status(httpd_req_t* req, uint32_t id, const upload_session_t& s)
+{
+    char buf[FILE_PATH_MAX + 128];
+    snprintf(buf, sizeof(buf), "{\"id\": \"%08lx\", \"file\": \"%s\", \"size\": %u, \"received\": %u, \"offset\": %u}",
+             (unsigned long)id, s.path, (unsigned)s.size, (unsigned)received_bytes(s), (unsigned)resume_offset(s));
+    httpd_resp_set_type(req, "application/json");
+    return httpd_resp_sendstr(req, buf);
+}
+
+static bool get_number_from_query(httpd_req_t* req, const char* key, size_t* value, int base)
+{
+    char buf[24];
+    if (!get_value_from_query(req, key, buf, sizeof(buf)))
+        return false;
+
+    char* end = NULL;
+    *value = strtoul(buf, &end, base);
+    if (end == buf || *end != '\0')
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid number in query");
+        return false;
+    }
+    return true;
+}
+
+static upload_session_t* find_session(httpd_req_t* req, uint32_t* id)
+{
+    size_t value;
+    if (!get_number_from_query(req, "id", &value, 16))
+        return NULL;
+
+    auto it = sessions.find(value);
+    if (it == sessions.end())
+    {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Unknown upload session");
+        return NULL;
+    }
+    *id = value;
+    it->second.last_used = esp_timer_get_time();
+    return &it->second;
+}
+
+static void drop_session(uint32_t id)
+{
+    char path[FILE_PATH_MAX + sizeof(UPLOAD_TMP_SUFFIX)];
+    tmp_path(sessions[id], path, sizeof(path));
+    unlink(path);
+    sessions.erase(id);
+}
+
+static void drop_idle_sessions(void)
+{
+    int64_t now = esp_timer_get_time();
+    for (auto it = sessions.begin(); it != sessions.end();)
+    {
+        uint32_t id = it->first;
+        bool idle = now - it->second.last_used > UPLOAD_SESSION_TIMEOUT_US;
+        it++;
+        if (idle)
+        {
+            ESP_LOGW(TAG, "Dropping idle upload %s", sessions[id].path);
+            drop_session(id);
+        }
+    }
+}
+
+static esp_err_t upload_start_handler(httpd_req_t* req)
+{
+    char path[FILE_PATH_MAX];
+    size_t size;
+    if (!get_value_from_query(req, "file", path, sizeof(path)) || !get_number_from_query(req, "size", &size, 10))
+        return ESP_FAIL;
+
+    for (auto& it : sessions)
+    {
+        if (strcmp(it.second.path, path) != 0)
+            continue;
+        if (it.second.size == size)
+        {
+            ESP_LOGI(TAG, "Resuming upload %s at %u", path, (unsigned)resume_offset(it.second));
+            it.second.last_used = esp_timer_get_time();
+            return send_status(req, it.first, it.second);
+        }
+        drop_session(it.first);
+        break;
+    }
+
+    drop_idle_sessions();
+    if (sessions.size() >= UPLOAD_SESSIONS_MAX)
+    {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_sendstr(req, "Too many uploads in progress");
+        return ESP_FAIL;
+    }
+
+    uint32_t id;
+    do
+        id = esp_random();
+    while (id == 0 || sessions.count(id));
+
+    upload_session_t& s = sessions[id];
+    snprintf(s.path, sizeof(s.path), "%s", path);
+    s.size = size;
+    s.last_used = esp_timer_get_time();
+
+    char tmp[FILE_PATH_MAX + sizeof(UPLOAD_TMP_SUFFIX)];
+    tmp_path(s, tmp, sizeof(tmp));
+    FILE* f = _create_file(req, tmp);
+    if (f == NULL)
+    {
+        sessions.erase(id);
+        return ESP_FAIL;
+    }
+    fclose(f);
+
+    ESP_LOGI(TAG, "Upload %08lx started for %s, %u bytes", (unsigned long)id, path, (unsigned)size);
+    return send_status(req, id, s);
+}
+
+static esp_err_t upload_chunk_handler(httpd_req_t* req)
+{
+    uint32_t id;
+    size_t offset, crc;
+    upload_session_t* s = find_session(req, &id);
+    if (s == NULL || !get_number_from_query(req, "offset", &offset, 10) || !get_number_from_query(req, "crc", &crc, 16))
+        return ESP_FAIL;
+
+    size_t len = req->content_len;
+    if (offset > s->size || len > s->size - offset)
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Chunk outside of file");
+        return ESP_FAIL;
+    }
+
+    char tmp[FILE_PATH_MAX + sizeof(UPLOAD_TMP_SUFFIX)];
+    tmp_path(*s, tmp, sizeof(tmp));
+    FILE* f = fopen(tmp, "r+b");
+    if (f == NULL || fseek(f, offset, SEEK_SET) != 0)
+    {
+        ESP_LOGE(TAG, "Failed to open %s at %u", tmp, (unsigned)offset);
+        if (f)
+            fclose(f);
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+
+    static char buf[API_BUFFSIZE];
+    uint32_t chunk_crc = 0;
+    size_t remaining = len;
+    size_t written = 0; // Bytes handed to fwrite, possibly changed on disk
+    esp_err_t err = ESP_OK;
+    while (remaining > 0 && err == ESP_OK)
+    {
+        int received = _recv(req, buf, MIN(remaining, sizeof(buf)));
+        if (received <= 0)
+        {
+            ESP_LOGE(TAG, "Chunk reception failed: %d", received);
+            err = ESP_FAIL;
+            break;
+        }
+        chunk_crc = esp_rom_crc32_le(chunk_crc, (const uint8_t*)buf, received);
+        written += received;
+        if (fwrite(buf, 1, received, f) != (size_t)received)
+            err = ESP_FAIL;
+        remaining -= received;
+    }
+    if (fclose(f) != 0)
+        err = ESP_FAIL;
+
+    // The chunk went straight to its offset, so bytes that verified before may
+    // have been replaced. They are received again with the resent chunk.
+    if (err != ESP_OK || chunk_crc != crc)
+        remove_range(*s, offset, offset + written);
+    if (err != ESP_OK)
+    {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+    if (chunk_crc != crc)
+    {
+        ESP_LOGW(TAG, "CRC mismatch at %u: %08lx != %08lx", (unsigned)offset, (unsigned long)chunk_crc, (unsigned long)crc);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "CRC mismatch");
+        return ESP_FAIL;
+    }
+
+    if (len > 0)
+        add_range(*s, offset, offset + len);
+    return send_status(req, id, *s);
+}
+
+static esp_err_t upload_status_handler(httpd_req_t* req)
+{
+    uint32_t id;
+    upload_session_t* s = find_session(req, &id);
+    if (s == NULL)
+        return ESP_FAIL;
+    return send_status(req, id, *s);
+}
+
+static esp_err_t upload_commit_handler(httpd_req_t* req)
+{
+    uint32_t id;
+    upload_session_t* s = find_session(req, &id);
+    if (s == NULL)
+        return ESP_FAIL;
+
+    if (received_bytes(*s) != s->size)
+    {
+        httpd_resp_set_status(req, "409 Conflict");
+        send_status(req, id, *s);
+        return ESP_FAIL;
+    }
+
+    char tmp[FILE_PATH_MAX + sizeof(UPLOAD_TMP_SUFFIX)];
+    tmp_path(*s, tmp, sizeof(tmp));
+
+    char hex[2 * SHA256_SIZE + 1];
+    if (get_optional_value_from_query(req, "sha256", hex, sizeof(hex)))
+    {
+        static char buf[API_BUFFSIZE];
+        uint8_t expected[SHA256_SIZE], digest[SHA256_SIZE];
+        if (!_parse_sha256(hex, expected) || _file_sha256(tmp, digest, buf, sizeof(buf)) != ESP_OK ||
+            memcmp(expected, digest, SHA256_SIZE) != 0)
+        {
+            // Chunks passed their CRCs, so the client sent different content. Start over.
+            ESP_LOGE(TAG, "SHA-256 mismatch for %s", s->path);
+            drop_session(id);
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "SHA-256 mismatch");
+            return ESP_FAIL;
+        }
+    }
+
+    if (rename(tmp, s->path) != 0)
+    {
+        ESP_LOGE(TAG, "Failed to rename %s to %s", tmp, s->path);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to store file");
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "Upload %08lx committed to %s", (unsigned long)id, s->path);
+    web_index_file_written(s->path);
+    file_meta_changed(s->path);
+    web_index_save();
+    sessions.erase(id);
+    httpd_resp_sendstr(req, "{\"message\": \"File uploaded successfully\"}");
+    return ESP_OK;
+}
+
+static esp_err_t upload_abort_handler(httpd_req_t* req)
+{
+    uint32_t id;
+    if (find_session(req, &id) == NULL)
+        return ESP_FAIL;
+
+    drop_session(id);
+    httpd_resp_sendstr(req, "{\"message\": \"Upload aborted\"}");
+    return ESP_OK;
+}
+
+void api_upload_session_register(void)
+{
+    httpss_register_url("/api/upload/start", false, upload_start_handler, HTTP_POST, NULL);
+    httpss_register_url("/api/upload/chunk", false, upload_chunk_handler, HTTP_POST, NULL);
+    httpss_register_url("/api/upload/status", false, upload_status_handler, HTTP_GET, NULL);
+    httpss_register_url("/api/upload/commit", false, upload_commit_handler, HTTP_POST, NULL);
+    httpss_register_url("/api/upload/abort", false, upload_abort_handler, HTTP_POST, NULL);
+}
@@ -0,0 +1,298 @@
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "deflate.hpp"
+
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define NIL 0xffff
+#define OUT_SIZE 512
+
+static const char* TAG = "DEFLATE";
+
+static const uint16_t length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t dist_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t dist_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+static const uint16_t max_chain[10] = {0, 4, 8, 16, 32, 64, 128, 256, 512, 1024};
+
+struct deflate_stream
+{
+    deflate_output_t output;
+    void* ctx;
+    esp_err_t err;
+
+    uint8_t* window; // 2 * window_size bytes, history followed by lookahead
+    uint16_t* head;  // Most recent position per hash, window_size entries
+    uint16_t* prev;  // Previous position with the same hash, indexed by position % window_size
+    size_t window_size;
+    size_t fill;
+    size_t pos;
+    int chain;
+    bool insert_all;
+
+    uint32_t bitbuf;
+    int bitcount;
+    uint8_t out[OUT_SIZE];
+    size_t outlen;
+
+    uint32_t crc;
+    size_t total_in;
+    size_t total_out;
+};
+
+static void flush_out(deflate_stream_t* s)
+{
+    if (s->outlen == 0)
+        return;
+    if (s->err == ESP_OK)
+        s->err = s->output(s->ctx, s->out, s->outlen);
+    s->total_out += s->outlen;
+    s->outlen = 0;
+}
+
+static inline void put_byte(deflate_stream_t* s, uint8_t b)
+{
+    s->out[s->outlen++] = b;
+    if (s->outlen == OUT_SIZE)
+        flush_out(s);
+}
+
+// Deflate writes bits LSB first.
+static inline void put_bits(deflate_stream_t* s, uint32_t value, int count)
+{
+    s->bitbuf |= value << s->bitcount;
+    s->bitcount += count;
+    while (s->bitcount >= 8)
+    {
+        put_byte(s, s->bitbuf & 0xff);
+        s->bitbuf >>= 8;
+        s->bitcount -= 8;
+    }
+}
+
+// Huffman codes are defined MSB first.
+static inline void put_code(deflate_stream_t* s, uint32_t code, int len)
+{
+    uint32_t rev = 0;
+    for (int i = 0; i < len; i++)
+    {
+        rev = (rev << 1) | (code & 1);
+        code >>= 1;
+    }
+    put_bits(s, rev, len);
+}
+
+static void put_symbol(deflate_stream_t* s, int sym)
+{
+    if (sym < 144)
+        put_code(s, 0x30 + sym, 8);
+    else if (sym < 256)
+        put_code(s, 0x190 + sym - 144, 9);
+    else if (sym < 280)
+        put_code(s, sym - 256, 7);
+    else
+        put_code(s, 0xc0 + sym - 280, 8);
+}
+
+static void put_match(deflate_stream_t* s, int len, int dist)
+{
+    int l = 28;
+    while (length_base[l] > len)
+        l--;
+    put_symbol(s, 257 + l);
+    put_bits(s, len - length_base[l], length_extra[l]);
+
+    int d = 29;
+    while (dist_base[d] > dist)
+        d--;
+    put_code(s, d, 5);
+    put_bits(s, dist - dist_base[d], dist_extra[d]);
+}
+
+static inline uint32_t hash(const deflate_stream_t* s, const uint8_t* p)
+{
+    return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & (s->window_size - 1);
+}
+
+static inline void insert(deflate_stream_t* s, size_t pos)
+{
+    uint32_t h = hash(s, s->window + pos);
+    s->prev[pos & (s->window_size - 1)] = s->head[h];
+    s->head[h] = pos;
+}
+
+// Drop the oldest half of the buffer, positions below window_size are forgotten.
+static void slide(deflate_stream_t* s)
+{
+    size_t ws = s->window_size;
+    memmove(s->window, s->window + ws, ws);
+    s->fill -= ws;
+    s->pos -= ws;
+    for (size_t i = 0; i < ws; i++)
+    {
+        s->head[i] = (s->head[i] == NIL || s->head[i] < ws) ? NIL : s->head[i] - ws;
+        s->prev[i] = (s->prev[i] == NIL || s->prev[i] < ws) ? NIL : s->prev[i] - ws;
+    }
+}
+
+static int longest_match(deflate_stream_t* s, size_t* match_pos)
+{
+    const uint8_t* cur = s->window + s->pos;
+    size_t max_len = s->fill - s->pos;
+    if (max_len > MAX_MATCH)
+        max_len = MAX_MATCH;
+
+    int best = 0;
+    size_t cand = s->head[hash(s, cur)];
+    for (int chain = s->chain; chain > 0 && cand != NIL && cand < s->pos && s->pos - cand <= s->window_size; chain--)
+    {
+        const uint8_t* p = s->window + cand;
+        if (p[best] == cur[best] && p[0] == cur[0])
+        {
+            size_t len = 1;
+            while (len < max_len && p[len] == cur[len])
+                len++;
+            if ((int)len > best)
+            {
+                best = len;
+                *match_pos = cand;
+                if (len == max_len)
+                    break;
+            }
+        }
+
+        // Chains only go back in time, a larger position is a stale slot.
+        size_t next = s->prev[cand & (s->window_size - 1)];
+        if (next >= cand)
+            break;
+        cand = next;
+    }
+    return best;
+}
+
+static void compress(deflate_stream_t* s, bool flush)
+{
+    while (s->pos < s->fill && (flush || s->fill - s->pos >= MAX_MATCH + MIN_MATCH))
+    {
+        if (s->fill - s->pos < MIN_MATCH)
+        {
+            put_symbol(s, s->window[s->pos++]);
+            continue;
+        }
+
+        size_t match_pos = 0;
+        int len = longest_match(s, &match_pos);
+        insert(s, s->pos);
+
+        if (len >= MIN_MATCH)
+        {
+            put_match(s, len, s->pos - match_pos);
+            size_t end = s->pos + len;
+            if (s->insert_all)
+            {
+                while (++s->pos < end)
+                {
+                    if (s->pos + MIN_MATCH <= s->fill)
+                        insert(s, s->pos);
+                }
+            }
+            s->pos = end;
+        }
+        else
+            put_symbol(s, s->window[s->pos++]);
+    }
+}
+
+deflate_stream_t* deflate_create(int level, size_t memory_budget, deflate_output_t output, void* ctx)
+{
+    if (level < 1)
+        level = 1;
+    if (level > 9)
+        level = 9;
+
+    // Window, hash heads and chain links take 6 bytes per window byte.
+    size_t ws = DEFLATE_MAX_WINDOW;
+    while (ws >= DEFLATE_MIN_WINDOW && sizeof(deflate_stream_t) + 6 * ws > memory_budget)
+        ws >>= 1;
+    if (ws < DEFLATE_MIN_WINDOW)
+    {
+        ESP_LOGE(TAG, "Memory budget %u too small", (unsigned)memory_budget);
+        return NULL;
+    }
+
+    deflate_stream_t* s = (deflate_stream_t*)malloc(sizeof(deflate_stream_t) + 6 * ws);
+    if (s == NULL)
+        return NULL;
+    memset(s, 0, sizeof(deflate_stream_t));
+    s->output = output;
+    s->ctx = ctx;
+    s->window_size = ws;
+    s->head = (uint16_t*)(s + 1);
+    s->prev = s->head + ws;
+    s->window = (uint8_t*)(s->prev + ws);
+    memset(s->head, 0xff, 4 * ws);
+    s->chain = max_chain[level];
+    s->insert_all = level >= 4;
+
+    // gzip member header, deflate, no name, unknown OS. One final block with fixed codes.
+    static const uint8_t gzip_header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff};
+    for (int i = 0; i < 10; i++)
+        put_byte(s, gzip_header[i]);
+    put_bits(s, 1, 1); // BFINAL
+    put_bits(s, 1, 2); // BTYPE fixed Huffman
+    return s;
+}
+
+esp_err_t deflate_write(deflate_stream_t* s, const void* data, size_t len)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    s->crc = esp_rom_crc32_le(s->crc, p, len);
+    s->total_in += len;
+
+    while (len > 0 && s->err == ESP_OK)
+    {
+        if (s->fill == 2 * s->window_size)
+            slide(s);
+        size_t n = 2 * s->window_size - s->fill;
+        if (n > len)
+            n = len;
+        memcpy(s->window + s->fill, p, n);
+        s->fill += n;
+        p += n;
+        len -= n;
+        compress(s, false);
+    }
+    return s->err;
+}
+
+esp_err_t deflate_finish(deflate_stream_t* s)
+{
+    compress(s, true);
+    put_symbol(s, 256);
+    if (s->bitcount > 0)
+        put_bits(s, 0, 8 - s->bitcount);
+
+    for (int i = 0; i < 4; i++)
+        put_byte(s, s->crc >> (8 * i));
+    for (int i = 0; i < 4; i++)
+        put_byte(s, s->total_in >> (8 * i));
+    flush_out(s);
+    return s->err;
+}
+
+void deflate_free(deflate_stream_t* s)
+{
+    free(s);
+}
+
+size_t deflate_total_in(const deflate_stream_t* s)
+{
+    return s->total_in;
+}
+
+size_t deflate_total_out(const deflate_stream_t* s)
+{
+    return s->total_out + s->outlen;
+}
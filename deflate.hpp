@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+// Streaming gzip compressor with a small, bounded window. Uses LZ77 with hash
+// chains and the fixed Huffman codes, so no per block tables are kept and the
+// whole state fits the memory budget given to deflate_create.
+
+#define DEFLATE_MIN_WINDOW 512
+#define DEFLATE_MAX_WINDOW 16384
+
+// Called with compressed output as it is produced.
+typedef esp_err_t (*deflate_output_t)(void* ctx, const uint8_t* data, size_t len);
+
+typedef struct deflate_stream deflate_stream_t;
+
+// level 1..9 trades speed for ratio. memory_budget bounds every allocation made
+// by the stream, the window is the largest power of two that fits in it.
+deflate_stream_t* deflate_create(int level, size_t memory_budget, deflate_output_t output, void* ctx);
+esp_err_t deflate_write(deflate_stream_t* s, const void* data, size_t len);
+// Compress the remaining input and write the gzip trailer.
+esp_err_t deflate_finish(deflate_stream_t* s);
+void deflate_free(deflate_stream_t* s);
+size_t deflate_total_in(const deflate_stream_t* s);
+size_t deflate_total_out(const deflate_stream_t* s);
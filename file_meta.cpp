@@ -0,0 +1,306 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <vector>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "serviceweb.h"
+#include "file_meta.hpp"
+
+static const char* TAG = "FILE_META";
+
+// 12 bytes plus the name per file, so thousands of log files stay affordable.
+typedef struct
+{
+    std::unique_ptr<char[]> name;
+    uint32_t size;
+    uint32_t mtime;
+} file_meta_t;
+
+// Files of one directory sorted by name. Directories are keyed by full path,
+// so a sub tree is one contiguous range of the map.
+typedef std::vector<file_meta_t> dir_meta_t;
+typedef std::map<std::string, dir_meta_t> dir_map_t;
+
+static dir_map_t dirs;
+static SemaphoreHandle_t lock = NULL;
+static int scanning = 0;                 // Scans running outside the lock
+static std::vector<std::string> pending; // Changes seen while a scan ran, replayed after it
+
+static bool name_less(const file_meta_t& m, const char* name)
+{
+    return strcmp(m.name.get(), name) < 0;
+}
+
+static bool file_meta_less(const file_meta_t& a, const file_meta_t& b)
+{
+    return strcmp(a.name.get(), b.name.get()) < 0;
+}
+
+static file_meta_t make_meta(const char* name, const struct stat& st)
+{
+    file_meta_t m;
+    size_t len = strlen(name) + 1;
+    m.name.reset(new char[len]);
+    memcpy(m.name.get(), name, len);
+    m.size = st.st_size;
+    m.mtime = st.st_mtime;
+    return m;
+}
+
+// Uploads in progress are not listed.
+static bool is_tmp(const char* name)
+{
+    size_t len = strlen(name);
+    size_t n = strlen(UPLOAD_TMP_SUFFIX);
+    return len > n && strcmp(name + len - n, UPLOAD_TMP_SUFFIX) == 0;
+}
+
+// A directory is indexed when it, or one above it, was scanned.
+static bool covered(const std::string& dir)
+{
+    std::string d = dir;
+    while (true)
+    {
+        if (dirs.count(d))
+            return true;
+        size_t slash = d.rfind('/');
+        if (slash == 0 || slash == std::string::npos)
+            return false;
+        d.resize(slash);
+    }
+}
+
+static bool in_tree(const std::string& key, const std::string& dir)
+{
+    return key.size() > dir.size() && key.compare(0, dir.size(), dir) == 0 && key[dir.size()] == '/';
+}
+
+// Directories in listing order: dir itself, then its sub tree when recursive.
+static dir_map_t::iterator next_dir(dir_map_t::iterator it, const std::string& dir, bool recursive)
+{
+    if (!recursive)
+        return dirs.end();
+    it = it->first == dir ? dirs.lower_bound(dir + "/") : std::next(it);
+    return it != dirs.end() && in_tree(it->first, dir) ? it : dirs.end();
+}
+
+static dir_map_t::iterator first_dir(const std::string& dir, bool recursive)
+{
+    auto it = dirs.find(dir);
+    if (it != dirs.end())
+        return it;
+    it = dirs.lower_bound(dir + "/");
+    return recursive && it != dirs.end() && in_tree(it->first, dir) ? it : dirs.end();
+}
+
+static void update_locked(const char* path)
+{
+    const char* slash = strrchr(path, '/');
+    if (slash == NULL || slash == path || slash[1] == 0 || is_tmp(slash + 1))
+        return;
+    std::string dir(path, slash - path);
+    const char* name = slash + 1;
+    if (!covered(dir))
+        return;
+
+    struct stat st;
+    bool exists = stat(path, &st) == 0 && S_ISREG(st.st_mode);
+    auto d = dirs.find(dir);
+    if (d == dirs.end())
+    {
+        // A new directory in an indexed tree.
+        if (!exists)
+            return;
+        d = dirs.emplace(dir, dir_meta_t()).first;
+    }
+
+    dir_meta_t& files = d->second;
+    auto it = std::lower_bound(files.begin(), files.end(), name, name_less);
+    bool found = it != files.end() && strcmp(it->name.get(), name) == 0;
+    if (!exists)
+    {
+        if (found)
+            files.erase(it);
+    }
+    else if (found)
+    {
+        it->size = st.st_size;
+        it->mtime = st.st_mtime;
+    }
+    else
+        files.insert(it, make_meta(name, st));
+}
+
+// One stat per file, only on the first listing of a tree.
+static bool scan_tree(const std::string& dir, dir_map_t& out)
+{
+    DIR* dp = opendir(dir.c_str());
+    if (dp == NULL)
+    {
+        ESP_LOGE(TAG, "Unable to open directory %s: %s", dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    dir_meta_t& files = out[dir];
+    std::string path;
+    struct dirent* entry;
+    while ((entry = readdir(dp)) != NULL)
+    {
+        if (strcmp(".", entry->d_name) == 0 || strcmp("..", entry->d_name) == 0)
+            continue;
+        path = dir + "/" + entry->d_name;
+        if (entry->d_type == DT_DIR)
+        {
+            scan_tree(path, out);
+            continue;
+        }
+
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode))
+            scan_tree(path, out);
+        else if (!is_tmp(entry->d_name))
+            files.push_back(make_meta(entry->d_name, st));
+    }
+    closedir(dp);
+    std::sort(files.begin(), files.end(), file_meta_less);
+    return true;
+}
+
+void file_meta_init(void)
+{
+    if (lock == NULL)
+        lock = xSemaphoreCreateMutex();
+}
+
+bool file_meta_scan(const char* dir, bool refresh)
+{
+    if (lock == NULL)
+        return false;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    bool indexed = !refresh && covered(dir);
+    if (!indexed)
+        scanning++;
+    xSemaphoreGive(lock);
+    if (indexed)
+        return true;
+
+    // Scan without the lock, writers only queue their changes meanwhile.
+    dir_map_t found;
+    bool ok = scan_tree(dir, found);
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (ok)
+    {
+        std::string key(dir);
+        dirs.erase(key);
+        auto it = dirs.lower_bound(key + "/");
+        while (it != dirs.end() && in_tree(it->first, key))
+            it = dirs.erase(it);
+        size_t count = 0;
+        for (auto& d : found)
+        {
+            count += d.second.size();
+            dirs[d.first] = std::move(d.second);
+        }
+        ESP_LOGI(TAG, "Indexed %u files in %u directories under %s", (unsigned)count, (unsigned)found.size(), dir);
+    }
+    for (auto& path : pending)
+        update_locked(path.c_str());
+    if (--scanning == 0)
+        pending.clear();
+    xSemaphoreGive(lock);
+    return ok;
+}
+
+size_t file_meta_count(const char* dir, bool recursive)
+{
+    if (lock == NULL)
+        return 0;
+    std::string key(dir);
+    size_t count = 0;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (auto it = first_dir(key, recursive); it != dirs.end(); it = next_dir(it, key, recursive))
+        count += it->second.size();
+    xSemaphoreGive(lock);
+    return count;
+}
+
+size_t file_meta_read(const char* dir, bool recursive, file_meta_cursor_t* c, file_meta_entry_t* out, size_t max)
+{
+    if (lock == NULL)
+        return 0;
+    std::string key(dir);
+    size_t n = 0;
+    xSemaphoreTake(lock, portMAX_DELAY);
+
+    // Continue after the last entry read, wherever it is now.
+    dir_map_t::iterator it;
+    size_t index = 0;
+    if (c->dir.empty())
+        it = first_dir(key, recursive);
+    else if ((it = dirs.find(c->dir)) != dirs.end())
+    {
+        auto& files = it->second;
+        index = std::upper_bound(files.begin(), files.end(), c->name.c_str(),
+                                 [](const char* name, const file_meta_t& m) { return strcmp(name, m.name.get()) < 0; }) -
+                files.begin();
+    }
+    else
+    {
+        it = recursive ? dirs.lower_bound(c->dir) : dirs.end();
+        if (it != dirs.end() && !in_tree(it->first, key))
+            it = dirs.end();
+    }
+
+    while (it != dirs.end() && n < max)
+    {
+        auto& files = it->second;
+        size_t skip = MIN(c->skip, files.size() - MIN(index, files.size()));
+        index += skip;
+        c->skip -= skip;
+
+        for (; index < files.size() && n < max; index++, n++)
+        {
+            const file_meta_t& m = files[index];
+            snprintf(out[n].path, sizeof(out[n].path), "%s/%s", it->first.c_str(), m.name.get());
+            out[n].size = m.size;
+            out[n].mtime = m.mtime;
+            c->dir = it->first;
+            c->name = m.name.get();
+        }
+        if (index >= files.size())
+        {
+            it = next_dir(it, key, recursive);
+            index = 0;
+        }
+    }
+    xSemaphoreGive(lock);
+    return n;
+}
+
+void file_meta_changed(const char* path)
+{
+    if (lock == NULL)
+        return;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (scanning)
+        pending.push_back(path);
+    update_locked(path);
+    xSemaphoreGive(lock);
+}
+
+void serviceweb_file_changed(const char* path)
+{
+    file_meta_changed(path);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include "api_priv.hpp"
+
+// Size and modification time of every file under the directories listed so
+// far, kept in memory so /api/list needs no stat per entry. A directory is
+// scanned with its whole sub tree on first use. After that, the file api and
+// serviceweb_file_changed keep it current. Safe to call from any task.
+
+typedef struct
+{
+    char path[FILE_PATH_MAX];
+    uint32_t size;
+    uint32_t mtime;
+} file_meta_entry_t;
+
+// Position in a listing. Survives changes to the index between reads.
+typedef struct
+{
+    std::string dir;  // Directory of the last entry read, empty before the first
+    std::string name; // Name of the last entry read
+    size_t skip;      // Entries still to skip, set to the page offset
+} file_meta_cursor_t;
+
+void file_meta_init(void);
+// Index dir and its sub tree unless already done, refresh scans again. False
+// when dir can not be opened.
+bool file_meta_scan(const char* dir, bool refresh);
+size_t file_meta_count(const char* dir, bool recursive);
+// Copy up to max entries following the cursor and advance it. Files come
+// directory by directory, sorted by name within each.
+// Returns the number copied, 0 at the end.
+size_t file_meta_read(const char* dir, bool recursive, file_meta_cursor_t* cursor, file_meta_entry_t* out, size_t max);
+// path was written, or removed when it no longer exists.
+void file_meta_changed(const char* path);
@@ -0,0 +1,471 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "file_stream.hpp"
+#include "api_priv.hpp"
+#include "web_slot.hpp"
+
+#ifdef CONFIG_LWIP_TCP_SND_BUF_DEFAULT
+#define TCP_SEND_BUFFER CONFIG_LWIP_TCP_SND_BUF_DEFAULT
+#else
+#define TCP_SEND_BUFFER 5744
+#endif
+
+#define READER_STACK_SIZE 4096
+#define SEND_FAST_US 2000  // The socket took the chunk without waiting, try a larger one
+#define SEND_SLOW_US 50000 // The socket is backed up, use smaller chunks
+
+static const char* TAG = "FILE_STREAM";
+
+typedef struct
+{
+    int index; // Buffer index
+    int len;   // Bytes in buffer, 0 at end of file, -1 on read error
+} stream_block_t;
+
+typedef struct
+{
+    FILE* file;
+    size_t remaining;
+    volatile size_t chunk;
+    volatile bool abort;
+    TaskHandle_t sender;
+    QueueHandle_t free_q;
+    QueueHandle_t full_q;
+    char* buf[FILE_STREAM_BUFFERS];
+} file_stream_t;
+
+// Everything a worker needs once the handler has returned.
+typedef struct
+{
+    file_stream_info_t info;
+    char content_type[64];
+    char content_encoding[16];
+    char disposition[128];
+    char path[FILE_PATH_MAX];
+} file_job_t;
+
+static void reader_task(void* arg)
+{
+    file_stream_t* s = (file_stream_t*)arg;
+    stream_block_t block = {};
+
+    while (true)
+    {
+        xQueueReceive(s->free_q, &block.index, portMAX_DELAY);
+        if (s->abort || s->remaining == 0)
+        {
+            block.len = 0;
+            break;
+        }
+
+        size_t want = s->chunk < s->remaining ? s->chunk : s->remaining;
+        size_t read = fread(s->buf[block.index], 1, want, s->file);
+        if (read == 0)
+        {
+            block.len = -1;
+            break;
+        }
+        s->remaining -= read;
+        block.len = read;
+        xQueueSend(s->full_q, &block, portMAX_DELAY);
+    }
+
+    // The notification is the last thing touching the stream, it may be freed after it.
+    xQueueSend(s->full_q, &block, portMAX_DELAY);
+    xTaskNotifyGive(s->sender);
+    vTaskDelete(NULL);
+}
+
+// httpd_send may take only part of the buffer.
+static esp_err_t send_all(httpd_req_t* req, const char* buf, size_t len)
+{
+    while (len > 0)
+    {
+        int sent = httpd_send(req, buf, len);
+        if (sent < 0)
+            return ESP_FAIL;
+        buf += sent;
+        len -= sent;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t send_small(httpd_req_t* req, FILE* file, size_t length)
+{
+    char* buf = (char*)malloc(length > 0 ? length : 1);
+    if (buf == NULL)
+        return ESP_ERR_NO_MEM;
+    size_t read = fread(buf, 1, length, file);
+    esp_err_t err = (read == length) ? send_all(req, buf, length) : ESP_FAIL;
+    free(buf);
+    return err;
+}
+
+// Grow the chunk while the socket accepts it at once, shrink it when sends block.
+static void adapt_chunk(file_stream_t* s, int64_t send_us)
+{
+    size_t chunk = s->chunk;
+    if (send_us < SEND_FAST_US && chunk < FILE_STREAM_BUFSIZE)
+        chunk = chunk * 2 > FILE_STREAM_BUFSIZE ? FILE_STREAM_BUFSIZE : chunk * 2;
+    else if (send_us > SEND_SLOW_US && chunk > FILE_STREAM_MIN_CHUNK)
+        chunk = chunk / 2 < FILE_STREAM_MIN_CHUNK ? FILE_STREAM_MIN_CHUNK : chunk / 2;
+    s->chunk = chunk;
+}
+
+// Send length bytes of file from offset, read ahead when more than one buffer.
+static esp_err_t send_body(httpd_req_t* req, FILE* file, size_t offset, size_t length)
+{
+    if (fseek(file, offset, SEEK_SET) != 0)
+        return ESP_FAIL;
+    if (length <= FILE_STREAM_BUFSIZE)
+        return send_small(req, file, length);
+
+    file_stream_t* s = (file_stream_t*)calloc(1, sizeof(file_stream_t) + FILE_STREAM_BUFFERS * FILE_STREAM_BUFSIZE);
+    if (s == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to allocate stream buffers for %s", req->uri);
+        return ESP_ERR_NO_MEM;
+    }
+    s->file = file;
+    s->remaining = length;
+    s->chunk = TCP_SEND_BUFFER < FILE_STREAM_BUFSIZE ? TCP_SEND_BUFFER : FILE_STREAM_BUFSIZE;
+    s->sender = xTaskGetCurrentTaskHandle();
+    s->free_q = xQueueCreate(FILE_STREAM_BUFFERS, sizeof(int));
+    s->full_q = xQueueCreate(FILE_STREAM_BUFFERS + 1, sizeof(stream_block_t));
+    for (int i = 0; i < FILE_STREAM_BUFFERS; i++)
+    {
+        s->buf[i] = (char*)(s + 1) + i * FILE_STREAM_BUFSIZE;
+        if (s->free_q)
+            xQueueSend(s->free_q, &i, 0);
+    }
+
+    esp_err_t err = ESP_OK;
+    if (s->free_q == NULL || s->full_q == NULL ||
+        xTaskCreate(reader_task, "file_reader", READER_STACK_SIZE, s, uxTaskPriorityGet(NULL), NULL) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to start reader for %s", req->uri);
+        err = ESP_ERR_NO_MEM;
+        goto cleanup;
+    }
+
+    {
+        int64_t start = esp_timer_get_time();
+        stream_block_t block;
+        while (xQueueReceive(s->full_q, &block, portMAX_DELAY) == pdTRUE && block.len > 0)
+        {
+            if (err == ESP_OK)
+            {
+                int64_t t0 = esp_timer_get_time();
+                err = send_all(req, s->buf[block.index], block.len);
+                adapt_chunk(s, esp_timer_get_time() - t0);
+                if (err != ESP_OK)
+                {
+                    // Keep returning buffers until the reader has seen the abort.
+                    ESP_LOGE(TAG, "Error sending %s: %s", req->uri, esp_err_to_name(err));
+                    s->abort = true;
+                }
+            }
+            xQueueSend(s->free_q, &block.index, portMAX_DELAY);
+        }
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        if (err == ESP_OK && block.len < 0)
+        {
+            ESP_LOGE(TAG, "Error reading %s", req->uri);
+            err = ESP_FAIL;
+        }
+
+        int64_t us = esp_timer_get_time() - start;
+        ESP_LOGI(TAG, "%s: %u bytes in %lld ms, %lld kB/s", req->uri, (unsigned)length, us / 1000, us > 0 ? (int64_t)length * 1000 / us : 0);
+    }
+
+cleanup:
+    if (s->free_q)
+        vQueueDelete(s->free_q);
+    if (s->full_q)
+        vQueueDelete(s->full_q);
+    free(s);
+    return err;
+}
+
+typedef struct
+{
+    size_t first;
+    size_t last; // Inclusive
+} byte_range_t;
+
+// Size and modification time of the file, empty when it has no mtime.
+typedef struct
+{
+    char etag[40];
+    char last_modified[32];
+} validator_t;
+
+static void make_validator(FILE* file, size_t size, validator_t* v)
+{
+    v->etag[0] = 0;
+    v->last_modified[0] = 0;
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0 || st.st_mtime <= 0)
+        return;
+    snprintf(v->etag, sizeof(v->etag), "\"%x-%llx\"", (unsigned)size, (long long)st.st_mtime);
+    struct tm tm;
+    gmtime_r(&st.st_mtime, &tm);
+    strftime(v->last_modified, sizeof(v->last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+// If-Range holds an entity tag or a date. Ranges are served only when it
+// matches exactly, otherwise the file changed and is sent whole.
+static bool if_range_matches(httpd_req_t* req, const validator_t* v)
+{
+    char header[FILE_STREAM_HEADER_MAX];
+    size_t len = httpd_req_get_hdr_value_len(req, "If-Range");
+    if (len == 0)
+        return true;
+    if (len >= sizeof(header) || httpd_req_get_hdr_value_str(req, "If-Range", header, sizeof(header)) != ESP_OK)
+        return false;
+    const char* current = header[0] == '"' ? v->etag : v->last_modified;
+    return current[0] != 0 && strcmp(header, current) == 0;
+}
+
+// Parse "bytes=a-b, c-, -n". Returns the number of satisfiable ranges, 0 when
+// none is satisfiable, or -1 when the header is to be ignored and the whole
+// file sent.
+static int parse_ranges(const char* header, size_t size, byte_range_t* ranges)
+{
+    if (strncmp(header, "bytes=", 6) != 0)
+        return -1;
+
+    int count = 0;
+    const char* p = header + 6;
+    while (*p)
+    {
+        while (*p == ' ' || *p == ',')
+            p++;
+        if (*p == 0)
+            break;
+
+        char* end;
+        byte_range_t r;
+        if (*p == '-')
+        {
+            unsigned long long suffix = strtoull(p + 1, &end, 10);
+            if (end == p + 1)
+                return -1;
+            p = end;
+            if (suffix == 0 || size == 0)
+                continue;
+            r.first = suffix >= size ? 0 : size - suffix;
+            r.last = size - 1;
+        }
+        else
+        {
+            unsigned long long first = strtoull(p, &end, 10);
+            if (end == p || *end != '-')
+                return -1;
+            p = end + 1;
+            unsigned long long last = size > 0 ? size - 1 : 0;
+            if (*p >= '0' && *p <= '9')
+            {
+                last = strtoull(p, &end, 10);
+                p = end;
+                if (last < first)
+                    return -1;
+                if (last >= size)
+                    last = size - 1;
+            }
+            if (first >= size)
+                continue;
+            r.first = first;
+            r.last = last;
+        }
+
+        while (*p == ' ')
+            p++;
+        if (*p != ',' && *p != 0)
+            return -1;
+        if (count == FILE_STREAM_MAX_RANGES)
+            return -1;
+        ranges[count++] = r;
+    }
+    return count;
+}
+
+static esp_err_t send_head(httpd_req_t* req, const char* status, const char* content_type, size_t length,
+                           const char* content_range, const file_stream_info_t* info, const validator_t* v)
+{
+    char head[640];
+    int n = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %u\r\nAccept-Ranges: bytes\r\n",
+                     status, content_type, (unsigned)length);
+    if (content_range && n < (int)sizeof(head))
+        n += snprintf(head + n, sizeof(head) - n, "Content-Range: %s\r\n", content_range);
+    if (v->etag[0] && n < (int)sizeof(head))
+        n += snprintf(head + n, sizeof(head) - n, "ETag: %s\r\nLast-Modified: %s\r\n", v->etag, v->last_modified);
+    if (info->content_encoding && n < (int)sizeof(head))
+        n += snprintf(head + n, sizeof(head) - n, "Content-Encoding: %s\r\n", info->content_encoding);
+    if (info->vary && n < (int)sizeof(head))
+        n += snprintf(head + n, sizeof(head) - n, "Vary: Accept-Encoding\r\n");
+    if (info->disposition && n < (int)sizeof(head))
+        n += snprintf(head + n, sizeof(head) - n, "Content-Disposition: %s\r\n", info->disposition);
+    if (n < (int)sizeof(head))
+        n += snprintf(head + n, sizeof(head) - n, "\r\n");
+    if (n >= (int)sizeof(head))
+    {
+        ESP_LOGE(TAG, "Response head too long for %s", req->uri);
+        return ESP_FAIL;
+    }
+    return send_all(req, head, n);
+}
+
+static int part_head(char* buf, size_t size, const char* boundary, const char* content_type, const byte_range_t* r, size_t file_size)
+{
+    return snprintf(buf, size, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %u-%u/%u\r\n\r\n",
+                    boundary, content_type, (unsigned)r->first, (unsigned)r->last, (unsigned)file_size);
+}
+
+static esp_err_t send_multipart(httpd_req_t* req, FILE* file, size_t size, const file_stream_info_t* info,
+                                const validator_t* v, const byte_range_t* ranges, int count)
+{
+    static const char* boundary = "SERVICEWEB_BYTERANGES";
+    char buf[160];
+
+    size_t length = snprintf(buf, sizeof(buf), "\r\n--%s--\r\n", boundary);
+    for (int i = 0; i < count; i++)
+        length += part_head(buf, sizeof(buf), boundary, info->content_type, &ranges[i], size) + ranges[i].last - ranges[i].first + 1;
+
+    char content_type[64];
+    snprintf(content_type, sizeof(content_type), "multipart/byteranges; boundary=%s", boundary);
+    esp_err_t err = send_head(req, "206 Partial Content", content_type, length, NULL, info, v);
+
+    for (int i = 0; i < count && err == ESP_OK; i++)
+    {
+        int n = part_head(buf, sizeof(buf), boundary, info->content_type, &ranges[i], size);
+        err = send_all(req, buf, n);
+        if (err == ESP_OK)
+            err = send_body(req, file, ranges[i].first, ranges[i].last - ranges[i].first + 1);
+    }
+    if (err == ESP_OK)
+    {
+        int n = snprintf(buf, sizeof(buf), "\r\n--%s--\r\n", boundary);
+        err = send_all(req, buf, n);
+    }
+    return err;
+}
+
+esp_err_t file_stream_respond(httpd_req_t* req, FILE* file, size_t size, const file_stream_info_t* info)
+{
+    byte_range_t ranges[FILE_STREAM_MAX_RANGES];
+    int count = -1;
+    validator_t v;
+    make_validator(file, size, &v);
+
+    // A Range header too long for the buffer is ignored like a malformed one.
+    char header[FILE_STREAM_HEADER_MAX];
+    size_t len = httpd_req_get_hdr_value_len(req, "Range");
+    if (len > 0 && len < sizeof(header) && httpd_req_get_hdr_value_str(req, "Range", header, sizeof(header)) == ESP_OK &&
+        if_range_matches(req, &v))
+        count = parse_ranges(header, size, ranges);
+
+    if (count == 0)
+    {
+        char content_range[32];
+        snprintf(content_range, sizeof(content_range), "bytes */%u", (unsigned)size);
+        httpd_resp_set_status(req, "416 Range Not Satisfiable");
+        httpd_resp_set_hdr(req, "Content-Range", content_range);
+        return httpd_resp_send(req, NULL, 0);
+    }
+
+    esp_err_t err;
+    if (count < 0)
+    {
+        err = send_head(req, HTTPD_200, info->content_type, size, NULL, info, &v);
+        if (err == ESP_OK)
+            err = send_body(req, file, 0, size);
+    }
+    else if (count == 1)
+    {
+        char content_range[48];
+        snprintf(content_range, sizeof(content_range), "bytes %u-%u/%u", (unsigned)ranges[0].first, (unsigned)ranges[0].last, (unsigned)size);
+        size_t length = ranges[0].last - ranges[0].first + 1;
+        err = send_head(req, "206 Partial Content", info->content_type, length, content_range, info, &v);
+        if (err == ESP_OK)
+            err = send_body(req, file, ranges[0].first, length);
+    }
+    else
+        err = send_multipart(req, file, size, info, &v, ranges, count);
+
+    return err;
+}
+
+static esp_err_t file_job_run(httpd_req_t* req, void* arg)
+{
+    file_job_t* job = (file_job_t*)arg;
+
+    FILE* file = fopen(job->path, "rb");
+    if (file == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to open %s", job->path);
+        web_slot_unhold();
+        return httpd_resp_send_404(req);
+    }
+
+    esp_err_t err = ESP_FAIL;
+    if (fseek(file, 0, SEEK_END) == 0)
+    {
+        long size = ftell(file);
+        if (size >= 0 && fseek(file, 0, SEEK_SET) == 0)
+            err = file_stream_respond(req, file, size, &job->info);
+    }
+    if (err != ESP_OK)
+        ESP_LOGE(TAG, "Error sending %s: %s", job->path, esp_err_to_name(err));
+    fclose(file);
+    web_slot_unhold();
+    return err;
+}
+
+static const char* copy_field(char* dst, size_t size, const char* src)
+{
+    if (src == NULL)
+        return NULL;
+    snprintf(dst, size, "%s", src);
+    return dst;
+}
+
+esp_err_t file_stream_respond_async(httpd_req_t* req, const char* path, const file_stream_info_t* info, worker_priority_t priority)
+{
+    // While the web slot switches, the caller sends on the httpd task instead.
+    if (!web_slot_hold())
+        return ESP_ERR_INVALID_STATE;
+    file_job_t* job = (file_job_t*)malloc(sizeof(file_job_t));
+    if (job == NULL)
+    {
+        web_slot_unhold();
+        return ESP_ERR_NO_MEM;
+    }
+
+    job->info.content_type = copy_field(job->content_type, sizeof(job->content_type), info->content_type);
+    job->info.content_encoding = copy_field(job->content_encoding, sizeof(job->content_encoding), info->content_encoding);
+    job->info.disposition = copy_field(job->disposition, sizeof(job->disposition), info->disposition);
+    job->info.vary = info->vary;
+    snprintf(job->path, sizeof(job->path), "%s", path);
+
+    esp_err_t err = worker_pool_submit(req, file_job_run, job, priority);
+    if (err == ESP_OK)
+        return ESP_OK;
+    free(job);
+    web_slot_unhold();
+
+    if (err == ESP_ERR_INVALID_STATE)
+    {
+        ESP_LOGW(TAG, "Worker pool busy, rejecting %s", req->uri);
+        return _send_busy(req);
+    }
+    return err;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "esp_http_server.h"
+#include "worker_pool.hpp"
+
+#define FILE_STREAM_BUFFERS 3
+#define FILE_STREAM_BUFSIZE 4096 // One flash sector / LittleFS block
+#define FILE_STREAM_MIN_CHUNK 1460
+#define FILE_STREAM_MAX_RANGES 8
+#define FILE_STREAM_HEADER_MAX 256 // Longer Range and If-Range headers are ignored
+#define FILE_STREAM_ASYNC_MIN (64 * 1024) // Larger files are sent from the worker pool
+
+// Response headers for a file. The head is written by file_stream_respond
+// itself, so these replace httpd_resp_set_type/httpd_resp_set_hdr.
+typedef struct
+{
+    const char* content_type;
+    const char* content_encoding; // NULL for identity
+    const char* disposition;      // Content-Disposition, NULL for none
+    bool vary;                    // Send Vary: Accept-Encoding
+} file_stream_info_t;
+
+// Respond with size bytes of file and a Content-Length. A Range request header
+// is answered with 206 Partial Content, multipart/byteranges for several
+// ranges, or 416 when no range is satisfiable. An ETag from the size and
+// mtime and a Last-Modified are sent when the file system keeps mtimes. With
+// an If-Range that matches neither, the whole file is sent. Bodies larger than one buffer
+// are read ahead by a reader task while the previous buffer is sent, with the
+// chunk size following the socket throughput.
+esp_err_t file_stream_respond(httpd_req_t* req, FILE* file, size_t size, const file_stream_info_t* info);
+
+// Send the file at path from a worker task so the httpd task is free for other
+// requests meanwhile. info is copied. Returns ESP_OK when the request was
+// queued, or answered with 503 because the pool is busy. Any other error means
+// nothing was sent and the caller should respond itself.
+esp_err_t file_stream_respond_async(httpd_req_t* req, const char* path, const file_stream_info_t* info, worker_priority_t priority);
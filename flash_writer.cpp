@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "flash_writer.hpp"
+
+static const char* TAG = "FLASH_WRITER";
+
+typedef struct
+{
+    int index; // Buffer index, -1 stops the writer
+    size_t len;
+} writer_block_t;
+
+struct flash_writer
+{
+    flash_write_fn_t fn;
+    void* ctx;
+    volatile esp_err_t err;
+    size_t written; // Stats, read unlocked by other tasks
+    int64_t busy_us;
+
+    TaskHandle_t owner;
+    QueueHandle_t free_q;
+    QueueHandle_t full_q;
+    uint8_t* buf[FLASH_WRITER_BUFFERS];
+    int cur; // Buffer being filled, -1 when none is held
+    size_t fill;
+};
+
+static void writer_task(void* arg)
+{
+    flash_writer_t* w = (flash_writer_t*)arg;
+    writer_block_t block;
+
+    while (xQueueReceive(w->full_q, &block, portMAX_DELAY) == pdTRUE && block.index >= 0)
+    {
+        if (w->err == ESP_OK)
+        {
+            int64_t start = esp_timer_get_time();
+            esp_err_t err = w->fn(w->ctx, w->buf[block.index], block.len);
+            w->busy_us += esp_timer_get_time() - start;
+            if (err == ESP_OK)
+                w->written += block.len;
+            else
+                w->err = err;
+        }
+        xQueueSend(w->free_q, &block.index, portMAX_DELAY);
+    }
+
+    // The notification is the last thing touching the writer, it may be freed after it.
+    xTaskNotifyGive(w->owner);
+    vTaskDelete(NULL);
+}
+
+static void writer_free(flash_writer_t* w)
+{
+    if (w->free_q)
+        vQueueDelete(w->free_q);
+    if (w->full_q)
+        vQueueDelete(w->full_q);
+    free(w);
+}
+
+flash_writer_t* flash_writer_start(const char* name, flash_write_fn_t fn, void* ctx)
+{
+    flash_writer_t* w = (flash_writer_t*)calloc(1, sizeof(flash_writer_t) + FLASH_WRITER_BUFFERS * FLASH_WRITER_BUFSIZE);
+    if (w == NULL)
+        return NULL;
+
+    w->fn = fn;
+    w->ctx = ctx;
+    w->err = ESP_OK;
+    w->cur = -1;
+    w->owner = xTaskGetCurrentTaskHandle();
+    w->free_q = xQueueCreate(FLASH_WRITER_BUFFERS, sizeof(int));
+    w->full_q = xQueueCreate(FLASH_WRITER_BUFFERS + 1, sizeof(writer_block_t));
+    if (w->free_q == NULL || w->full_q == NULL)
+    {
+        writer_free(w);
+        return NULL;
+    }
+
+    for (int i = 0; i < FLASH_WRITER_BUFFERS; i++)
+    {
+        w->buf[i] = (uint8_t*)(w + 1) + i * FLASH_WRITER_BUFSIZE;
+        xQueueSend(w->free_q, &i, 0);
+    }
+
+    if (xTaskCreate(writer_task, name, FLASH_WRITER_STACK, w, uxTaskPriorityGet(NULL), NULL) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to create writer task");
+        writer_free(w);
+        return NULL;
+    }
+    return w;
+}
+
+esp_err_t flash_writer_write(flash_writer_t* w, const void* data, size_t len)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    while (len > 0 && w->err == ESP_OK)
+    {
+        if (w->cur < 0)
+        {
+            xQueueReceive(w->free_q, &w->cur, portMAX_DELAY);
+            w->fill = 0;
+        }
+
+        size_t n = FLASH_WRITER_BUFSIZE - w->fill;
+        if (n > len)
+            n = len;
+        memcpy(w->buf[w->cur] + w->fill, p, n);
+        w->fill += n;
+        p += n;
+        len -= n;
+
+        if (w->fill == FLASH_WRITER_BUFSIZE)
+        {
+            writer_block_t block = {w->cur, w->fill};
+            xQueueSend(w->full_q, &block, portMAX_DELAY);
+            w->cur = -1;
+        }
+    }
+    return w->err;
+}
+
+esp_err_t flash_writer_finish(flash_writer_t* w)
+{
+    if (w->cur >= 0 && w->fill > 0)
+    {
+        writer_block_t block = {w->cur, w->fill};
+        xQueueSend(w->full_q, &block, portMAX_DELAY);
+    }
+
+    // May be called from another task than flash_writer_start, e.g. a later request.
+    w->owner = xTaskGetCurrentTaskHandle();
+    writer_block_t stop = {-1, 0};
+    xQueueSend(w->full_q, &stop, portMAX_DELAY);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    esp_err_t err = w->err;
+    writer_free(w);
+    return err;
+}
+
+size_t flash_writer_written(const flash_writer_t* w)
+{
+    return w->written;
+}
+
+int64_t flash_writer_busy_us(const flash_writer_t* w)
+{
+    return w->busy_us;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#define FLASH_WRITER_BUFFERS 2
+#define FLASH_WRITER_BUFSIZE 4096 // One flash sector
+#define FLASH_WRITER_STACK 4096
+
+// Called on the writer task with one full buffer, or the last partial one.
+typedef esp_err_t (*flash_write_fn_t)(void* ctx, const uint8_t* data, size_t len);
+
+typedef struct flash_writer flash_writer_t;
+
+// Double buffered write pipeline. flash_writer_write copies into one buffer
+// while a writer task passes the other to fn, so receiving from the network
+// overlaps with flash erase and write. The writer runs at the caller's priority.
+flash_writer_t* flash_writer_start(const char* name, flash_write_fn_t fn, void* ctx);
+// Blocks only while both buffers are in use. Returns the first error from fn,
+// later data is dropped once fn failed.
+esp_err_t flash_writer_write(flash_writer_t* w, const void* data, size_t len);
+// Flush the last buffer, wait for the writer and free everything.
+esp_err_t flash_writer_finish(flash_writer_t* w);
+
+// Readable from any task while the pipeline runs.
+size_t flash_writer_written(const flash_writer_t* w);
+int64_t flash_writer_busy_us(const flash_writer_t* w); // Time spent in fn
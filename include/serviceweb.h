@@ -5,13 +5,36 @@ extern "C"
 {
 #endif
 
+typedef enum
+{
+    SERVICEWEB_ENCODING_IDENTITY = 0,
+    SERVICEWEB_ENCODING_GZIP,
+    SERVICEWEB_ENCODING_BR,
+} serviceweb_encoding_t;
+
 void serviceweb_init(pp_evloop_t *evloop, char* txbuf, size_t size, char* rxbuf, size_t rxsize, const char* root);
 void serviceweb_start(void);
 void serviceweb_stop(void);
 void serviceweb_set_nvs_namespace(const char *name);
 bool serviceweb_register_memory_file(const char* path, const uint8_t *start, const uint8_t *end, bool gzip);
+bool serviceweb_register_memory_variant(const char* path, const uint8_t *start, const uint8_t *end, serviceweb_encoding_t encoding);
 void serviceweb_register_files(const char *basePath, const char *path);
 void serviceweb_set_debug(bool enable);
+// Gzip dynamic responses larger than min_size for clients that accept it.
+// level 1..9, 0 disables. memory_budget bounds the compressor state per response.
+void serviceweb_set_compression(int level, size_t memory_budget, size_t min_size);
+// Require firmware images to carry a manifest signature made with the matching
+// private key. pem must stay valid, NULL turns the check off.
+void serviceweb_set_ota_public_key(const char *pem);
+// Label of the LittleFS partition to mount at the web root at boot, "web", or
+// "web_b" when a web update switched to the second slot.
+const char *serviceweb_web_partition(void);
+// Keep the /api/list index current for a file the application wrote or
+// removed itself. Files written through the file api are tracked already.
+void serviceweb_file_changed(const char *path);
+// Drop the cached NVS snapshot of namespace ns, of all namespaces for NULL,
+// after the application wrote to it. Writes through /api/nvs drop it already.
+void serviceweb_nvs_changed(const char *ns);
 
 
 #ifdef __cplusplus
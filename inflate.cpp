@@ -0,0 +1,250 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "rom/miniz.h"
+#include "inflate.hpp"
+
+#define GZIP_FHCRC 0x02
+#define GZIP_FEXTRA 0x04
+#define GZIP_FNAME 0x08
+#define GZIP_FCOMMENT 0x10
+#define GZIP_TRAILER 8
+
+static const char* TAG = "INFLATE";
+
+typedef enum
+{
+    GZ_HEADER,    // Fixed 10 byte header
+    GZ_EXTRA_LEN, // FEXTRA length, 2 bytes
+    GZ_EXTRA,
+    GZ_NAME,
+    GZ_COMMENT,
+    GZ_HCRC,
+    GZ_DATA,
+    GZ_DONE, // Deflate stream ended, only the trailer follows
+} gz_state_t;
+
+struct inflate_stream
+{
+    inflate_output_t output;
+    void* ctx;
+    esp_err_t err;
+
+    gz_state_t state;
+    uint8_t header[10];
+    size_t count; // Bytes of the current header field seen
+    size_t extra_len;
+
+    // tinfl may read a few bytes past the end of the deflate data, so the
+    // trailer is taken from the last bytes of the input instead.
+    uint8_t tail[GZIP_TRAILER];
+    uint32_t crc;
+    size_t total_in;
+    size_t total_out;
+    size_t dict_ofs;
+
+    tinfl_decompressor tinfl;
+    uint8_t dict[TINFL_LZ_DICT_SIZE];
+};
+
+bool inflate_is_gzip(const uint8_t* data, size_t len)
+{
+    return len >= INFLATE_GZIP_ID_LEN && data[0] == INFLATE_GZIP_MAGIC0 && data[1] == INFLATE_GZIP_MAGIC1 &&
+           data[2] == INFLATE_GZIP_DEFLATE;
+}
+
+inflate_stream_t* inflate_create(inflate_output_t output, void* ctx)
+{
+    inflate_stream_t* s = (inflate_stream_t*)malloc(sizeof(inflate_stream_t));
+    if (s == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to allocate %u bytes", (unsigned)sizeof(inflate_stream_t));
+        return NULL;
+    }
+    memset(s, 0, offsetof(inflate_stream_t, tinfl));
+    s->output = output;
+    s->ctx = ctx;
+    s->state = GZ_HEADER;
+    tinfl_init(&s->tinfl);
+    return s;
+}
+
+static void keep_tail(inflate_stream_t* s, const uint8_t* p, size_t len)
+{
+    if (len >= GZIP_TRAILER)
+        memcpy(s->tail, p + len - GZIP_TRAILER, GZIP_TRAILER);
+    else
+    {
+        memmove(s->tail, s->tail + len, GZIP_TRAILER - len);
+        memcpy(s->tail + GZIP_TRAILER - len, p, len);
+    }
+}
+
+static gz_state_t next_field(const inflate_stream_t* s, gz_state_t after)
+{
+    uint8_t flags = s->header[3];
+    switch (after)
+    {
+    case GZ_HEADER:
+        if (flags & GZIP_FEXTRA)
+            return GZ_EXTRA_LEN;
+        // fall through
+    case GZ_EXTRA:
+        if (flags & GZIP_FNAME)
+            return GZ_NAME;
+        // fall through
+    case GZ_NAME:
+        if (flags & GZIP_FCOMMENT)
+            return GZ_COMMENT;
+        // fall through
+    case GZ_COMMENT:
+        if (flags & GZIP_FHCRC)
+            return GZ_HCRC;
+        // fall through
+    default:
+        return GZ_DATA;
+    }
+}
+
+// Consume header bytes, returns the number used.
+static size_t parse_header(inflate_stream_t* s, const uint8_t* p, size_t len)
+{
+    size_t i = 0;
+    while (i < len && s->state != GZ_DATA && s->err == ESP_OK)
+    {
+        uint8_t c = p[i++];
+        switch (s->state)
+        {
+        case GZ_HEADER:
+            s->header[s->count++] = c;
+            if (s->count < sizeof(s->header))
+                break;
+            if (!inflate_is_gzip(s->header, sizeof(s->header)))
+            {
+                ESP_LOGE(TAG, "Not a gzip deflate stream");
+                s->err = ESP_ERR_INVALID_ARG;
+                break;
+            }
+            s->count = 0;
+            s->state = next_field(s, GZ_HEADER);
+            break;
+        case GZ_EXTRA_LEN:
+            s->extra_len |= c << (8 * s->count++);
+            if (s->count == 2)
+            {
+                s->count = 0;
+                s->state = s->extra_len ? GZ_EXTRA : next_field(s, GZ_EXTRA);
+            }
+            break;
+        case GZ_EXTRA:
+            if (++s->count == s->extra_len)
+            {
+                s->count = 0;
+                s->state = next_field(s, GZ_EXTRA);
+            }
+            break;
+        case GZ_NAME:
+        case GZ_COMMENT:
+            if (c == 0)
+                s->state = next_field(s, s->state);
+            break;
+        case GZ_HCRC:
+            if (++s->count == 2)
+                s->state = GZ_DATA;
+            break;
+        default:
+            break;
+        }
+    }
+    return i;
+}
+
+static void decompress(inflate_stream_t* s, const uint8_t* p, size_t len)
+{
+    while (s->state == GZ_DATA && s->err == ESP_OK)
+    {
+        size_t in_bytes = len;
+        size_t out_bytes = TINFL_LZ_DICT_SIZE - s->dict_ofs;
+        tinfl_status status = tinfl_decompress(&s->tinfl, p, &in_bytes, s->dict, s->dict + s->dict_ofs, &out_bytes,
+                                               TINFL_FLAG_HAS_MORE_INPUT);
+        p += in_bytes;
+        len -= in_bytes;
+
+        if (out_bytes > 0)
+        {
+            const uint8_t* out = s->dict + s->dict_ofs;
+            s->crc = esp_rom_crc32_le(s->crc, out, out_bytes);
+            s->total_out += out_bytes;
+            s->err = s->output(s->ctx, out, out_bytes);
+            s->dict_ofs = (s->dict_ofs + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+        }
+
+        if (status < TINFL_STATUS_DONE)
+        {
+            ESP_LOGE(TAG, "Corrupt deflate data at %u: %d", (unsigned)s->total_in, status);
+            s->err = ESP_ERR_INVALID_RESPONSE;
+        }
+        else if (status == TINFL_STATUS_DONE)
+            s->state = GZ_DONE;
+        else if (status == TINFL_STATUS_NEEDS_MORE_INPUT && len == 0)
+            break;
+    }
+}
+
+esp_err_t inflate_write(inflate_stream_t* s, const void* data, size_t len)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    if (s->err != ESP_OK)
+        return s->err;
+
+    s->total_in += len;
+    keep_tail(s, p, len);
+
+    if (s->state < GZ_DATA)
+    {
+        size_t used = parse_header(s, p, len);
+        p += used;
+        len -= used;
+    }
+    if (len > 0)
+        decompress(s, p, len);
+    return s->err;
+}
+
+esp_err_t inflate_finish(inflate_stream_t* s)
+{
+    if (s->err != ESP_OK)
+        return s->err;
+    if (s->state != GZ_DONE)
+    {
+        ESP_LOGE(TAG, "Stream truncated after %u bytes", (unsigned)s->total_in);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    uint32_t crc = s->tail[0] | s->tail[1] << 8 | s->tail[2] << 16 | (uint32_t)s->tail[3] << 24;
+    uint32_t isize = s->tail[4] | s->tail[5] << 8 | s->tail[6] << 16 | (uint32_t)s->tail[7] << 24;
+    if (crc != s->crc || isize != (uint32_t)s->total_out)
+    {
+        ESP_LOGE(TAG, "Trailer mismatch, crc %08lx != %08lx or size %lu != %u", (unsigned long)crc,
+                 (unsigned long)s->crc, (unsigned long)isize, (unsigned)s->total_out);
+        return ESP_ERR_INVALID_CRC;
+    }
+    return ESP_OK;
+}
+
+void inflate_free(inflate_stream_t* s)
+{
+    free(s);
+}
+
+size_t inflate_total_in(const inflate_stream_t* s)
+{
+    return s->total_in;
+}
+
+size_t inflate_total_out(const inflate_stream_t* s)
+{
+    return s->total_out;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+// Streaming gzip decompressor on top of the ROM tinfl. The 32 KB history
+// window doubles as the output buffer, so memory use is fixed at about 43 KB
+// whatever the size of the image.
+
+#define INFLATE_GZIP_MAGIC0 0x1f
+#define INFLATE_GZIP_MAGIC1 0x8b
+#define INFLATE_GZIP_DEFLATE 8 // The only compression method gzip defines
+#define INFLATE_GZIP_ID_LEN 3  // Magic and method, enough to tell gzip from anything else
+
+// Called with decompressed output as it is produced.
+typedef esp_err_t (*inflate_output_t)(void* ctx, const uint8_t* data, size_t len);
+
+typedef struct inflate_stream inflate_stream_t;
+
+// True when data starts with the gzip magic and the deflate method. Needs at
+// least INFLATE_GZIP_ID_LEN bytes.
+bool inflate_is_gzip(const uint8_t* data, size_t len);
+inflate_stream_t* inflate_create(inflate_output_t output, void* ctx);
+// Feed gzip input in pieces of any size.
+esp_err_t inflate_write(inflate_stream_t* s, const void* data, size_t len);
+// Check that the stream ended and the CRC-32 and size in the gzip trailer
+// match the output.
+esp_err_t inflate_finish(inflate_stream_t* s);
+void inflate_free(inflate_stream_t* s);
+size_t inflate_total_in(const inflate_stream_t* s);
+size_t inflate_total_out(const inflate_stream_t* s);
@@ -0,0 +1,314 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "esp_log.h"
+#include "multipart.hpp"
+
+static const char* TAG = "MULTIPART";
+
+typedef enum
+{
+    MP_PREAMBLE,   // Before the first boundary, discarded
+    MP_DELIM_TAIL, // After a boundary, "--" or the end of the line follows
+    MP_DELIM_DASH, // One '-' of the closing "--" seen
+    MP_HEADERS,
+    MP_BODY,
+    MP_DONE,
+} mp_state_t;
+
+struct multipart
+{
+    multipart_callbacks_t cb;
+    void* ctx;
+    mp_state_t state;
+
+    char delim[MULTIPART_DELIM_MAX + 1]; // "\r\n--boundary"
+    uint8_t fail[MULTIPART_DELIM_MAX + 1];
+    size_t delim_len;
+    size_t match; // Bytes of delim matched by the end of the input so far
+
+    char line[MULTIPART_LINE_MAX];
+    size_t line_len;
+    multipart_part_t part;
+};
+
+// Knuth-Morris-Pratt failure links, fail[j] is the longest proper prefix of
+// delim that is also a suffix of its first j bytes.
+static void build_fail(multipart_t* mp)
+{
+    mp->fail[0] = 0;
+    mp->fail[1] = 0;
+    size_t k = 0;
+    for (size_t j = 1; j < mp->delim_len; j++)
+    {
+        while (k > 0 && mp->delim[j] != mp->delim[k])
+            k = mp->fail[k];
+        if (mp->delim[j] == mp->delim[k])
+            k++;
+        mp->fail[j + 1] = k;
+    }
+}
+
+multipart_t* multipart_create(const char* boundary, const multipart_callbacks_t* cb, void* ctx)
+{
+    size_t len = strlen(boundary);
+    if (len == 0 || len + 2 > MULTIPART_DELIM_MAX)
+    {
+        ESP_LOGE(TAG, "Invalid boundary length %u", (unsigned)len);
+        return NULL;
+    }
+
+    multipart_t* mp = (multipart_t*)calloc(1, sizeof(multipart_t));
+    if (mp == NULL)
+        return NULL;
+
+    mp->cb = *cb;
+    mp->ctx = ctx;
+    mp->delim_len = len + 2;
+    snprintf(mp->delim, sizeof(mp->delim), "\r\n%s", boundary);
+    build_fail(mp);
+
+    // The first boundary may start the body without a CRLF in front of it.
+    mp->state = MP_PREAMBLE;
+    mp->match = 2;
+    mp->part.index = -1;
+    return mp;
+}
+
+void multipart_free(multipart_t* mp)
+{
+    free(mp);
+}
+
+bool multipart_done(const multipart_t* mp)
+{
+    return mp->state == MP_DONE;
+}
+
+// Copy the value of key="value" or key=value from a header line.
+static void header_param(const char* line, const char* key, char* dst, size_t size)
+{
+    size_t key_len = strlen(key);
+    for (const char* p = line; (p = strcasestr(p, key)) != NULL; p += key_len)
+    {
+        // Whole parameter name only, "name" must not match inside "filename".
+        if (p != line && p[-1] != ' ' && p[-1] != ';' && p[-1] != '\t')
+            continue;
+        const char* v = p + key_len;
+        if (*v != '=')
+            continue;
+        v++;
+
+        size_t n = 0;
+        if (*v == '"')
+        {
+            v++;
+            while (v[n] != '\0' && v[n] != '"')
+                n++;
+        }
+        else
+        {
+            while (v[n] != '\0' && v[n] != ';' && v[n] != ' ')
+                n++;
+        }
+        if (n >= size)
+            n = size - 1;
+        memcpy(dst, v, n);
+        dst[n] = '\0';
+        return;
+    }
+}
+
+static void header_line(multipart_t* mp)
+{
+    mp->line[mp->line_len] = '\0';
+    if (strncasecmp(mp->line, "Content-Disposition:", 20) == 0)
+    {
+        header_param(mp->line + 20, "name", mp->part.name, sizeof(mp->part.name));
+        header_param(mp->line + 20, "filename", mp->part.filename, sizeof(mp->part.filename));
+    }
+    else if (strncasecmp(mp->line, "Content-Type:", 13) == 0)
+    {
+        const char* v = mp->line + 13;
+        while (*v == ' ' || *v == '\t')
+            v++;
+        snprintf(mp->part.content_type, sizeof(mp->part.content_type), "%s", v);
+    }
+}
+
+static esp_err_t emit(multipart_t* mp, const uint8_t* data, size_t len)
+{
+    if (len == 0 || mp->cb.data == NULL)
+        return ESP_OK;
+    return mp->cb.data(mp->ctx, &mp->part, data, len);
+}
+
+// Body bytes are emitted straight from the input. Bytes of a partial match
+// carried over from the previous feed are a prefix of delim, so they are
+// emitted from there once the match turns out to be data.
+static esp_err_t emit_body(multipart_t* mp, size_t carry, const uint8_t* data, size_t len)
+{
+    esp_err_t err = emit(mp, (const uint8_t*)mp->delim, carry);
+    if (err == ESP_OK)
+        err = emit(mp, data, len);
+    return err;
+}
+
+// Scan for delim. Returns the number of bytes consumed, *found is set when
+// the input up to that point ended with delim.
+static size_t scan(multipart_t* mp, const uint8_t* data, size_t len, bool body, bool* found, esp_err_t* err)
+{
+    const char* delim = mp->delim;
+    size_t match = mp->match;
+    size_t carry = match;
+    size_t i = 0;
+    *found = false;
+
+    while (i < len)
+    {
+        if (match == 0)
+        {
+            // Nothing pending, skip ahead to the next possible boundary start.
+            const uint8_t* cr = (const uint8_t*)memchr(data + i, '\r', len - i);
+            if (cr == NULL)
+            {
+                i = len;
+                break;
+            }
+            i = cr - data;
+        }
+
+        uint8_t c = data[i++];
+        while (match > 0 && (uint8_t)delim[match] != c)
+            match = mp->fail[match];
+        if ((uint8_t)delim[match] == c)
+            match++;
+
+        if (match == mp->delim_len)
+        {
+            if (body)
+            {
+                // Pending bytes are the carry and data[0..i), all but delim are body.
+                size_t body_len = carry + i - mp->delim_len;
+                size_t from_carry = body_len < carry ? body_len : carry;
+                *err = emit_body(mp, from_carry, data, body_len - from_carry);
+            }
+            mp->match = 0;
+            *found = true;
+            return i;
+        }
+    }
+
+    if (body)
+    {
+        // Everything except the bytes of a possible boundary is body.
+        size_t body_len = carry + len - match;
+        size_t from_carry = body_len < carry ? body_len : carry;
+        *err = emit_body(mp, from_carry, data, body_len - from_carry);
+    }
+    mp->match = match;
+    return len;
+}
+
+esp_err_t multipart_feed(multipart_t* mp, const uint8_t* data, size_t len)
+{
+    esp_err_t err = ESP_OK;
+    size_t i = 0;
+
+    while (i < len && err == ESP_OK)
+    {
+        switch (mp->state)
+        {
+        case MP_PREAMBLE:
+        case MP_BODY:
+        {
+            bool body = mp->state == MP_BODY;
+            bool found;
+            i += scan(mp, data + i, len - i, body, &found, &err);
+            if (found && err == ESP_OK)
+            {
+                if (body && mp->cb.part_end)
+                    err = mp->cb.part_end(mp->ctx, &mp->part);
+                mp->state = MP_DELIM_TAIL;
+            }
+            break;
+        }
+
+        case MP_DELIM_TAIL:
+        {
+            char c = data[i++];
+            if (c == '-')
+                mp->state = MP_DELIM_DASH;
+            else if (c == '\n')
+            {
+                int index = mp->part.index + 1;
+                memset(&mp->part, 0, sizeof(mp->part));
+                mp->part.index = index;
+                mp->line_len = 0;
+                mp->state = MP_HEADERS;
+            }
+            // CR and transport padding are skipped
+            break;
+        }
+
+        case MP_DELIM_DASH:
+            if (data[i++] != '-')
+            {
+                ESP_LOGE(TAG, "Malformed boundary");
+                return ESP_FAIL;
+            }
+            mp->state = MP_DONE;
+            break;
+
+        case MP_HEADERS:
+        {
+            char c = data[i++];
+            if (c != '\n')
+            {
+                if (c != '\r' && mp->line_len < MULTIPART_LINE_MAX - 1)
+                    mp->line[mp->line_len++] = c;
+                break;
+            }
+            if (mp->line_len > 0)
+            {
+                header_line(mp);
+                mp->line_len = 0;
+                break;
+            }
+            // Empty line, the body follows
+            mp->state = MP_BODY;
+            mp->match = 0;
+            if (mp->cb.part_begin)
+                err = mp->cb.part_begin(mp->ctx, &mp->part);
+            break;
+        }
+
+        case MP_DONE:
+            return ESP_OK; // Epilogue is ignored
+        }
+    }
+    return err;
+}
+
+esp_err_t multipart_receive(httpd_req_t* req, multipart_t* mp, char* buf, size_t size)
+{
+    while (!multipart_done(mp))
+    {
+        int received = _recv(req, buf, size);
+        if (received < 0)
+        {
+            ESP_LOGE(TAG, "Reception failed: %d", received);
+            return ESP_FAIL;
+        }
+        if (received == 0)
+        {
+            ESP_LOGE(TAG, "Body ended before the closing boundary");
+            return ESP_ERR_INVALID_SIZE;
+        }
+
+        esp_err_t err = multipart_feed(mp, (const uint8_t*)buf, received);
+        if (err != ESP_OK)
+            return err;
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_http_server.h"
+#include "api_priv.hpp"
+
+#define MULTIPART_DELIM_MAX (BOUNDARY_MAX_LEN + 2) // "\r\n" + "--boundary"
+#define MULTIPART_LINE_MAX 256                      // Longer header lines are truncated
+
+// Streaming multipart/form-data parser. Input can be split anywhere, including
+// inside a boundary, and part bodies may hold any bytes. Each input byte is
+// looked at once, a partial boundary match is carried to the next feed.
+
+typedef struct
+{
+    char name[32];
+    char filename[64];
+    char content_type[64];
+    int index; // 0 for the first part
+} multipart_part_t;
+
+// Any callback may be NULL. An error returned from a callback stops parsing
+// and is returned from multipart_feed.
+typedef struct
+{
+    esp_err_t (*part_begin)(void* ctx, const multipart_part_t* part);
+    esp_err_t (*data)(void* ctx, const multipart_part_t* part, const uint8_t* data, size_t len);
+    esp_err_t (*part_end)(void* ctx, const multipart_part_t* part);
+} multipart_callbacks_t;
+
+typedef struct multipart multipart_t;
+
+// boundary is the dash-boundary as returned by _get_boundary, "--" included.
+multipart_t* multipart_create(const char* boundary, const multipart_callbacks_t* cb, void* ctx);
+void multipart_free(multipart_t* mp);
+esp_err_t multipart_feed(multipart_t* mp, const uint8_t* data, size_t len);
+// The closing boundary has been seen.
+bool multipart_done(const multipart_t* mp);
+
+// Receive the request body into buf and feed it to the parser until the body
+// or the multipart message ends. ESP_ERR_INVALID_SIZE when the body ended
+// before the closing boundary. Does not send a response.
+esp_err_t multipart_receive(httpd_req_t* req, multipart_t* mp, char* buf, size_t size);
@@ -0,0 +1,226 @@
+#include <string.h>
+#include <sys/param.h>
+#include <map>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "serviceweb.h"
+#include "nvs_cache.hpp"
+
+static const char* TAG = "NVS_CACHE";
+
+static const nvs_type_info_t nvs_types[] = {
+    {NVS_TYPE_U8, "u8", 1, false},   {NVS_TYPE_I8, "i8", 1, true},    {NVS_TYPE_U16, "u16", 2, false},
+    {NVS_TYPE_I16, "i16", 2, true},  {NVS_TYPE_U32, "u32", 4, false}, {NVS_TYPE_I32, "i32", 4, true},
+    {NVS_TYPE_U64, "u64", 8, false}, {NVS_TYPE_I64, "i64", 8, true},  {NVS_TYPE_STR, "str", 0, false},
+    {NVS_TYPE_BLOB, "blob", 0, false},
+};
+
+static std::map<std::string, nvs_snapshot_ptr_t> snapshots;
+static SemaphoreHandle_t lock = NULL;
+
+const nvs_type_info_t* nvs_type_info(nvs_type_t type)
+{
+    for (auto& t : nvs_types)
+    {
+        if (t.type == type)
+            return &t;
+    }
+    return NULL;
+}
+
+const nvs_type_info_t* nvs_type_by_name(const char* name)
+{
+    for (auto& t : nvs_types)
+    {
+        if (strcmp(t.name, name) == 0)
+            return &t;
+    }
+    return NULL;
+}
+
+uint64_t nvs_int_value(const nvs_type_info_t* t, const std::string& value)
+{
+    uint64_t v = 0;
+    for (size_t i = MIN(t->size, value.size()); i-- > 0;)
+        v = v << 8 | (uint8_t)value[i];
+    // Sign extend
+    if (t->is_signed && t->size < 8 && (v >> (8 * t->size - 1) & 1))
+        v |= ~0ULL << 8 * t->size;
+    return v;
+}
+
+std::string nvs_int_bytes(const nvs_type_info_t* t, uint64_t v)
+{
+    std::string out(t->size, 0);
+    for (size_t i = 0; i < t->size; i++, v >>= 8)
+        out[i] = (char)(v & 0xff);
+    return out;
+}
+
+template <typename T>
+static esp_err_t get_int(esp_err_t (*get)(nvs_handle_t, const char*, T*), nvs_handle_t h, const char* key, uint64_t* v)
+{
+    T x;
+    esp_err_t err = get(h, key, &x);
+    *v = (uint64_t)x;
+    return err;
+}
+
+static esp_err_t read_value(nvs_handle_t h, const char* key, nvs_type_t type, std::string& out)
+{
+    esp_err_t err;
+    uint64_t v = 0;
+    switch (type)
+    {
+    case NVS_TYPE_U8:
+        err = get_int(nvs_get_u8, h, key, &v);
+        break;
+    case NVS_TYPE_I8:
+        err = get_int(nvs_get_i8, h, key, &v);
+        break;
+    case NVS_TYPE_U16:
+        err = get_int(nvs_get_u16, h, key, &v);
+        break;
+    case NVS_TYPE_I16:
+        err = get_int(nvs_get_i16, h, key, &v);
+        break;
+    case NVS_TYPE_U32:
+        err = get_int(nvs_get_u32, h, key, &v);
+        break;
+    case NVS_TYPE_I32:
+        err = get_int(nvs_get_i32, h, key, &v);
+        break;
+    case NVS_TYPE_U64:
+        err = get_int(nvs_get_u64, h, key, &v);
+        break;
+    case NVS_TYPE_I64:
+        err = get_int(nvs_get_i64, h, key, &v);
+        break;
+    case NVS_TYPE_STR:
+    case NVS_TYPE_BLOB:
+    {
+        size_t len = 0;
+        err = type == NVS_TYPE_STR ? nvs_get_str(h, key, NULL, &len) : nvs_get_blob(h, key, NULL, &len);
+        if (err != ESP_OK)
+            return err;
+        out.resize(len);
+        err = type == NVS_TYPE_STR ? nvs_get_str(h, key, &out[0], &len) : nvs_get_blob(h, key, &out[0], &len);
+        if (type == NVS_TYPE_STR && len > 0)
+            len--; // The NUL
+        out.resize(len);
+        return err;
+    }
+    default:
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if (err == ESP_OK)
+        out = nvs_int_bytes(nvs_type_info(type), v);
+    return err;
+}
+
+// Keys are counted first, so the snapshot is allocated at its final size.
+static esp_err_t load(const char* ns, nvs_snapshot_t* s)
+{
+    nvs_handle_t h;
+    esp_err_t err = nvs_open(ns, NVS_READONLY, &h);
+    if (err == ESP_ERR_NVS_NOT_FOUND)
+        return ESP_OK;
+    if (err != ESP_OK)
+        return err;
+
+    size_t count = 0;
+    nvs_iterator_t it = NULL;
+    esp_err_t found = nvs_entry_find(NVS_DEFAULT_PART_NAME, ns, NVS_TYPE_ANY, &it);
+    for (; found == ESP_OK; found = nvs_entry_next(&it))
+        count++;
+    nvs_release_iterator(it);
+    s->items.reserve(count);
+
+    it = NULL;
+    found = nvs_entry_find(NVS_DEFAULT_PART_NAME, ns, NVS_TYPE_ANY, &it);
+    while (found == ESP_OK && err == ESP_OK)
+    {
+        nvs_entry_info_t info;
+        nvs_entry_info(it, &info);
+        if (nvs_type_info(info.type))
+        {
+            s->items.push_back({info.key, info.type, std::string()});
+            err = read_value(h, info.key, info.type, s->items.back().value);
+            s->bytes += s->items.back().value.size();
+        }
+        found = nvs_entry_next(&it);
+    }
+    nvs_release_iterator(it);
+    nvs_close(h);
+    return err;
+}
+
+void nvs_cache_init(void)
+{
+    if (lock == NULL)
+        lock = xSemaphoreCreateMutex();
+}
+
+nvs_snapshot_ptr_t nvs_cache_get(const char* ns)
+{
+    if (lock == NULL)
+        return NULL;
+
+    int64_t now = esp_timer_get_time();
+    xSemaphoreTake(lock, portMAX_DELAY);
+    auto it = snapshots.find(ns);
+    if (it != snapshots.end() && now - it->second->loaded_us < NVS_CACHE_MAX_AGE_US)
+    {
+        nvs_snapshot_ptr_t s = it->second;
+        xSemaphoreGive(lock);
+        return s;
+    }
+
+    // Loaded under the lock, so concurrent readers of a cold namespace read flash once.
+    std::shared_ptr<nvs_snapshot_t> s = std::make_shared<nvs_snapshot_t>();
+    s->bytes = 0;
+    s->loaded_us = now;
+    esp_err_t err = load(ns, s.get());
+    if (err == ESP_OK)
+        snapshots[ns] = s;
+    else
+        snapshots.erase(ns);
+    xSemaphoreGive(lock);
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to read namespace %s: %s", ns, esp_err_to_name(err));
+        return NULL;
+    }
+    ESP_LOGD(TAG, "Loaded %u keys, %u bytes of %s", (unsigned)s->items.size(), (unsigned)s->bytes, ns);
+    return s;
+}
+
+const nvs_item_t* nvs_cache_find(const nvs_snapshot_t* snapshot, const char* key)
+{
+    for (auto& item : snapshot->items)
+    {
+        if (item.key == key)
+            return &item;
+    }
+    return NULL;
+}
+
+void nvs_cache_invalidate(const char* ns)
+{
+    if (lock == NULL)
+        return;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (ns == NULL)
+        snapshots.clear();
+    else
+        snapshots.erase(ns);
+    xSemaphoreGive(lock);
+}
+
+void serviceweb_nvs_changed(const char* ns)
+{
+    nvs_cache_invalidate(ns);
+}
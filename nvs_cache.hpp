@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "nvs.h"
+
+// Typed snapshot of an NVS namespace, read in one pass and shared by the
+// sysmon pages and /api/nvs. Writes through serviceweb drop it, the
+// application reports its own with serviceweb_nvs_changed. A snapshot older
+// than NVS_CACHE_MAX_AGE_US is read again, in case a write went unreported.
+// Safe to call from any task, a snapshot stays valid while it is held.
+
+#define NVS_CACHE_MAX_AGE_US (30 * 1000000LL)
+
+typedef struct
+{
+    nvs_type_t type;
+    const char* name; // "u8" ... "i64", "str", "blob"
+    uint8_t size;     // 0 for str and blob
+    bool is_signed;
+} nvs_type_info_t;
+
+// Integers are little endian in their own width, strings go without the NUL.
+typedef struct
+{
+    std::string key;
+    nvs_type_t type;
+    std::string value;
+} nvs_item_t;
+
+typedef struct
+{
+    std::vector<nvs_item_t> items; // In NVS iteration order
+    size_t bytes;                  // Sum of the value sizes
+    int64_t loaded_us;
+} nvs_snapshot_t;
+
+typedef std::shared_ptr<const nvs_snapshot_t> nvs_snapshot_ptr_t;
+
+void nvs_cache_init(void);
+// NULL when the namespace can't be read, empty when it was never written.
+nvs_snapshot_ptr_t nvs_cache_get(const char* ns);
+const nvs_item_t* nvs_cache_find(const nvs_snapshot_t* snapshot, const char* key);
+// Drop the snapshot of ns, every snapshot for NULL.
+void nvs_cache_invalidate(const char* ns);
+
+const nvs_type_info_t* nvs_type_info(nvs_type_t type);
+const nvs_type_info_t* nvs_type_by_name(const char* name);
+// Sign extended for signed types.
+uint64_t nvs_int_value(const nvs_type_info_t* t, const std::string& value);
+std::string nvs_int_bytes(const nvs_type_info_t* t, uint64_t v);
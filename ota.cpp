@@ -2,191 +2,1120 @@
 #include "esp_ota_ops.h"
 #include "esp_app_desc.h"
 #include "esp_log.h"
+#include "esp_littlefs.h"
+#include "nvs.h"
 #include <string.h>
+#include <stdlib.h>
+#include <sys/param.h>
 #include "api_priv.hpp"
+#include "web_index.hpp"
+#include "web_slot.hpp"
+#include "multipart.hpp"
+#include "flash_writer.hpp"
+#include "inflate.hpp"
+#include "worker_pool.hpp"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "httpss.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/base64.h"
+#include "cJSON.h"
+#include "serviceweb.h"
 
 #define TAG "OTA_UPDATE"
-#define BOUNDARY_MAX_LEN 100
 #define BUFFSIZE 2048
+#define OTA_SESSION_TIMEOUT_US (10 * 60 * 1000000LL) // An idle session may be replaced by a new update
+#define OTA_MANIFEST_MAX 1024
+#define OTA_SIGNATURE_MAX 512 // RSA-4096
+#define WEB_ERASE_SECTOR 4096
+#define WEB_ERASE_BLOCK (64 * 1024)
 
-static char boundary[BOUNDARY_MAX_LEN];
+// Progress of the current or last firmware update, read by /update/status.
+typedef struct
+{
+    const char *state;  // "idle", "receiving", "done" or "failed"
+    const char *format; // "raw" or "gzip"
+    size_t total;       // Image size when known, otherwise the request body length
+    size_t received;    // Image bytes received, compressed for gzip
+    size_t written;     // Image bytes in flash
+    int64_t start_us;
+    int64_t end_us;
+    int64_t write_busy_us;
+} ota_status_t;
 
-esp_err_t ota_post_handler(httpd_req_t *req)
+// Expected hash and signature of the image as written to flash, that is after
+// decompression. Sent as a "manifest" form part or as the commit body:
+//   {"sha256": "<hex>", "signature": "<base64>"}
+typedef struct
+{
+    bool has_sha;
+    uint8_t sha256[SHA256_SIZE];
+    uint8_t signature[OTA_SIGNATURE_MAX];
+    size_t signature_len;
+} ota_manifest_t;
+
+// One firmware image being written. Lives across requests so an upload in
+// chunks can continue on a new connection after the old one dropped.
+typedef struct
+{
+    uint32_t id;
+    size_t size; // Expected image size, 0 when unknown
+    size_t offset; // Image bytes consumed, where the next chunk starts
+    const esp_partition_t *partition;
+    esp_ota_handle_t handle;
+    flash_writer_t *writer;
+    inflate_stream_t *inflate; // Set for a gzip image
+    // The first bytes, held until there are enough to tell the format
+    uint8_t head[INFLATE_GZIP_ID_LEN];
+    size_t head_len;
+    bool format_known;
+    mbedtls_sha256_context sha;       // Over the image as uploaded
+    mbedtls_sha256_context image_sha; // Over the bytes passed to esp_ota_write, on the writer task
+    bool verify;
+    uint8_t expected[SHA256_SIZE];
+    ota_manifest_t manifest;
+    int64_t last_used;
+    // Runs once the image checked out, right before the boot partition is
+    // switched. An error keeps the running firmware.
+    esp_err_t (*before_boot)(void *ctx, const esp_partition_t *app);
+    void *before_boot_ctx;
+} ota_session_t;
+
+static ota_status_t ota_status = {"idle", "raw"};
+static ota_session_t *ota_session = NULL; // Chunked update in progress
+static volatile bool ota_busy = false;    // Single request update in progress
+static const char *ota_public_key = NULL; // PEM, images must be signed when set
+
+void serviceweb_set_ota_public_key(const char *pem)
+{
+    ota_public_key = pem;
+}
+
+// The image hash is computed here, on the writer task, so it overlaps with
+// receiving and costs no extra pass over the partition.
+static esp_err_t ota_flash_write(void *ctx, const uint8_t *data, size_t len)
+{
+    ota_session_t *s = (ota_session_t *)ctx;
+    mbedtls_sha256_update(&s->image_sha, data, len);
+    esp_err_t err = esp_ota_write(s->handle, data, len);
+    if (err != ESP_OK)
+        ESP_LOGE(TAG, "Failed to write OTA data: %s", esp_err_to_name(err));
+    return err;
+}
+
+static esp_err_t ota_inflated(void *ctx, const uint8_t *data, size_t len)
+{
+    return flash_writer_write((flash_writer_t *)ctx, data, len);
+}
+
+static void ota_session_free(ota_session_t *s)
+{
+    mbedtls_sha256_free(&s->sha);
+    mbedtls_sha256_free(&s->image_sha);
+    free(s);
+}
+
+static ota_session_t *ota_session_begin(size_t size, const uint8_t *expected)
+{
+    ota_session_t *s = (ota_session_t *)calloc(1, sizeof(ota_session_t));
+    if (s == NULL)
+        return NULL;
+
+    s->size = size;
+    s->last_used = esp_timer_get_time();
+    if (expected)
+    {
+        s->verify = true;
+        memcpy(s->expected, expected, SHA256_SIZE);
+    }
+    mbedtls_sha256_init(&s->sha);
+    mbedtls_sha256_starts(&s->sha, 0);
+    mbedtls_sha256_init(&s->image_sha);
+    mbedtls_sha256_starts(&s->image_sha, 0);
+
+    s->partition = esp_ota_get_next_update_partition(NULL);
+    if (s->partition == NULL)
+    {
+        ESP_LOGE(TAG, "No OTA partition");
+        ota_session_free(s);
+        return NULL;
+    }
+    ESP_LOGI(TAG, "OTA Update partition: %s", s->partition->label);
+
+    // Sectors are erased by esp_ota_write as the image reaches them, on the
+    // writer task, instead of the whole partition up front.
+    esp_err_t err = esp_ota_begin(s->partition, OTA_WITH_SEQUENTIAL_WRITES, &s->handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to start OTA: %s", esp_err_to_name(err));
+        ota_session_free(s);
+        return NULL;
+    }
+
+    // The socket is read while the previous buffer goes to flash.
+    s->writer = flash_writer_start("ota_writer", ota_flash_write, s);
+    if (s->writer == NULL)
+    {
+        esp_ota_abort(s->handle);
+        ota_session_free(s);
+        return NULL;
+    }
+
+    ota_status = {"receiving", "raw", size, 0, 0, esp_timer_get_time(), 0, 0};
+    return s;
+}
+
+static esp_err_t ota_session_output(ota_session_t *s, const uint8_t *data, size_t len)
+{
+    return s->inflate ? inflate_write(s->inflate, data, len) : flash_writer_write(s->writer, data, len);
+}
+
+// App images start with 0xE9, a gzip header is inflated on the way to flash.
+// Passes on the held back first bytes.
+static esp_err_t ota_session_detect(ota_session_t *s)
+{
+    s->format_known = true;
+    if (inflate_is_gzip(s->head, s->head_len))
+    {
+        if ((s->inflate = inflate_create(ota_inflated, s->writer)) == NULL)
+            return ESP_ERR_NO_MEM;
+        ota_status.format = "gzip";
+    }
+    return s->head_len ? ota_session_output(s, s->head, s->head_len) : ESP_OK;
+}
+
+static esp_err_t ota_session_write(ota_session_t *s, const uint8_t *data, size_t len)
+{
+    if (s->size && len > s->size - s->offset)
+    {
+        ESP_LOGE(TAG, "Image larger than %u bytes", (unsigned)s->size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    mbedtls_sha256_update(&s->sha, data, len);
+    esp_err_t err = ESP_OK;
+    if (!s->format_known)
+    {
+        // The multipart parser may hand over the first bytes one or two at a time.
+        size_t n = MIN(len, sizeof(s->head) - s->head_len);
+        memcpy(s->head + s->head_len, data, n);
+        s->head_len += n;
+        if (s->head_len == sizeof(s->head))
+            err = ota_session_detect(s);
+        if (err == ESP_OK && len > n)
+            err = ota_session_output(s, data + n, len - n);
+    }
+    else
+        err = ota_session_output(s, data, len);
+    s->offset += len;
+    s->last_used = esp_timer_get_time();
+    ota_status.received = s->offset;
+    ota_status.written = flash_writer_written(s->writer);
+    ota_status.write_busy_us = flash_writer_busy_us(s->writer);
+    return err;
+}
+
+// Drain the pipeline and release everything except the OTA handle.
+static esp_err_t ota_session_close(ota_session_t *s, esp_err_t err)
+{
+    // An image shorter than the format check still goes out, and fails its checks.
+    if (!s->format_known && err == ESP_OK)
+        err = ota_session_detect(s);
+    if (s->inflate)
+    {
+        // Checks the gzip CRC-32 and size of the inflated image.
+        if (err == ESP_OK)
+            err = inflate_finish(s->inflate);
+        inflate_free(s->inflate);
+        s->inflate = NULL;
+    }
+    ota_status.written = flash_writer_written(s->writer);
+    ota_status.write_busy_us = flash_writer_busy_us(s->writer);
+    esp_err_t werr = flash_writer_finish(s->writer);
+    s->writer = NULL;
+    return err == ESP_OK ? werr : err;
+}
+
+static void ota_session_done(ota_session_t *s, esp_err_t err)
+{
+    ota_status.end_us = esp_timer_get_time();
+    ota_status.state = err == ESP_OK ? "done" : "failed";
+    int64_t us = ota_status.end_us - ota_status.start_us;
+    ESP_LOGI(TAG, "OTA %s: %u bytes in %lld ms, flash busy %lld ms", ota_status.state, (unsigned)ota_status.written,
+             (long long)us / 1000, (long long)ota_status.write_busy_us / 1000);
+    ota_session_free(s);
+}
+
+static void ota_session_abort(ota_session_t *s)
+{
+    ota_session_close(s, ESP_FAIL);
+    esp_ota_abort(s->handle);
+    ota_session_done(s, ESP_FAIL);
+}
+
+static esp_err_t ota_manifest_from_json(const cJSON *obj, ota_manifest_t *m)
+{
+    esp_err_t err = ESP_OK;
+    memset(m, 0, sizeof(*m));
+    const cJSON *sha = cJSON_GetObjectItem(obj, "sha256");
+    if (cJSON_IsString(sha))
+    {
+        m->has_sha = _parse_sha256(sha->valuestring, m->sha256);
+        if (!m->has_sha)
+            err = ESP_ERR_INVALID_ARG;
+    }
+    const cJSON *sig = cJSON_GetObjectItem(obj, "signature");
+    if (cJSON_IsString(sig) &&
+        mbedtls_base64_decode(m->signature, sizeof(m->signature), &m->signature_len,
+                              (const unsigned char *)sig->valuestring, strlen(sig->valuestring)) != 0)
+        err = ESP_ERR_INVALID_ARG;
+
+    if (err != ESP_OK)
+        ESP_LOGE(TAG, "Invalid sha256 or signature in manifest");
+    return err;
+}
+
+static esp_err_t ota_parse_manifest(const char *json, size_t len, ota_manifest_t *m)
+{
+    cJSON *root = cJSON_ParseWithLength(json, len);
+    if (root == NULL)
+    {
+        ESP_LOGE(TAG, "Invalid manifest");
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_err_t err = ota_manifest_from_json(root, m);
+    cJSON_Delete(root);
+    return err;
+}
+
+static esp_err_t ota_verify_manifest(const ota_manifest_t *m, const uint8_t digest[SHA256_SIZE])
+{
+    if (m->has_sha && memcmp(m->sha256, digest, SHA256_SIZE) != 0)
+    {
+        ESP_LOGE(TAG, "Image SHA-256 does not match the manifest");
+        return ESP_ERR_INVALID_CRC;
+    }
+    if (ota_public_key == NULL)
+        return ESP_OK;
+
+    if (m->signature_len == 0)
+    {
+        ESP_LOGE(TAG, "Unsigned image rejected");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    mbedtls_pk_context pk;
+    mbedtls_pk_init(&pk);
+    int ret = mbedtls_pk_parse_public_key(&pk, (const unsigned char *)ota_public_key, strlen(ota_public_key) + 1);
+    if (ret == 0)
+        ret = mbedtls_pk_verify(&pk, MBEDTLS_MD_SHA256, digest, SHA256_SIZE, m->signature, m->signature_len);
+    mbedtls_pk_free(&pk);
+    if (ret != 0)
+    {
+        ESP_LOGE(TAG, "Image signature invalid: -0x%04x", -ret);
+        return ESP_ERR_INVALID_CRC;
+    }
+    ESP_LOGI(TAG, "Image signature verified");
+    return ESP_OK;
+}
+
+// Validate the complete image and make it the boot partition. The session is
+// freed in any case.
+static esp_err_t ota_session_end(ota_session_t *s)
+{
+    esp_err_t err = ota_session_close(s, ESP_OK);
+    if (err == ESP_OK && s->size && s->offset != s->size)
+    {
+        ESP_LOGE(TAG, "Image incomplete, %u of %u bytes", (unsigned)s->offset, (unsigned)s->size);
+        err = ESP_ERR_INVALID_SIZE;
+    }
+
+    uint8_t digest[SHA256_SIZE];
+    mbedtls_sha256_finish(&s->sha, digest);
+    if (err == ESP_OK && s->verify && memcmp(digest, s->expected, SHA256_SIZE) != 0)
+    {
+        ESP_LOGE(TAG, "Image SHA-256 mismatch");
+        err = ESP_ERR_INVALID_CRC;
+    }
+
+    // The writer has finished, image_sha covers every byte in flash.
+    mbedtls_sha256_finish(&s->image_sha, digest);
+    if (err == ESP_OK)
+        err = ota_verify_manifest(&s->manifest, digest);
+
+    if (err != ESP_OK)
+        esp_ota_abort(s->handle);
+    else if ((err = esp_ota_end(s->handle)) != ESP_OK)
+        ESP_LOGE(TAG, "esp_ota_end failed: %s", esp_err_to_name(err));
+    else if (s->before_boot && (err = s->before_boot(s->before_boot_ctx, s->partition)) != ESP_OK)
+        ESP_LOGE(TAG, "Update stopped before the boot switch: %s", esp_err_to_name(err));
+    else if ((err = esp_ota_set_boot_partition(s->partition)) != ESP_OK)
+        ESP_LOGE(TAG, "esp_ota_set_boot_partition failed: %s", esp_err_to_name(err));
+
+    if (err == ESP_OK)
+        ESP_LOGI(TAG, "Update succeeded!");
+    ota_session_done(s, err);
+    return err;
+}
+
+// Only one update at a time. A chunked session nobody has touched for a while
+// is given up in favour of a new update.
+static bool ota_claim(httpd_req_t *req)
+{
+    if (ota_session && esp_timer_get_time() - ota_session->last_used > OTA_SESSION_TIMEOUT_US)
+    {
+        ESP_LOGW(TAG, "Dropping idle OTA session %08lx", (unsigned long)ota_session->id);
+        ota_session_abort(ota_session);
+        ota_session = NULL;
+    }
+    if (ota_busy || ota_session)
+    {
+        httpd_resp_set_status(req, "409 Conflict");
+        httpd_resp_sendstr(req, "Update in progress");
+        return false;
+    }
+    return true;
+}
+
+//-- Single request update ------------------------------------------------------
+
+typedef enum
+{
+    OTA_PART_IGNORE,
+    OTA_PART_IMAGE,
+    OTA_PART_MANIFEST,
+} ota_part_t;
+
+typedef struct
+{
+    ota_session_t *session;
+    ota_part_t current;
+    bool have_image;
+    char manifest[OTA_MANIFEST_MAX];
+    size_t manifest_len;
+} ota_form_t;
+
+// A part named "manifest" is the manifest, the first other part is the image.
+// Later parts are ignored.
+static esp_err_t ota_part_begin(void *arg, const multipart_part_t *part)
+{
+    ota_form_t *form = (ota_form_t *)arg;
+    if (strcmp(part->name, "manifest") == 0)
+        form->current = OTA_PART_MANIFEST;
+    else if (!form->have_image)
+    {
+        form->current = OTA_PART_IMAGE;
+        form->have_image = true;
+    }
+    else
+        form->current = OTA_PART_IGNORE;
+    return ESP_OK;
+}
+
+static esp_err_t ota_data(void *arg, const multipart_part_t *part, const uint8_t *data, size_t len)
+{
+    ota_form_t *form = (ota_form_t *)arg;
+    if (form->current == OTA_PART_IMAGE)
+        return ota_session_write(form->session, data, len);
+    if (form->current == OTA_PART_MANIFEST)
+    {
+        if (len > sizeof(form->manifest) - form->manifest_len)
+        {
+            ESP_LOGE(TAG, "Manifest larger than %d bytes", OTA_MANIFEST_MAX);
+            return ESP_ERR_INVALID_SIZE;
+        }
+        memcpy(form->manifest + form->manifest_len, data, len);
+        form->manifest_len += len;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t ota_part_end(void *arg, const multipart_part_t *part)
 {
-    char buf[BUFFSIZE];
-    int received = 0;
+    ota_form_t *form = (ota_form_t *)arg;
+    if (form->current != OTA_PART_MANIFEST)
+        return ESP_OK;
+    return ota_parse_manifest(form->manifest, form->manifest_len, &form->session->manifest);
+}
+
+static esp_err_t ota_run(httpd_req_t *req, void *arg)
+{
+    char boundary[BOUNDARY_MAX_LEN];
+    esp_err_t err = ESP_FAIL;
+    ota_session_t *s = NULL;
+    char *buf = (char *)malloc(BUFFSIZE);
 
     if (!_get_boundary(req, boundary, sizeof(boundary)))
+        goto done;
+    if (buf == NULL || (s = ota_session_begin(0, NULL)) == NULL)
+    {
+        httpd_resp_send_500(req);
+        goto done;
+    }
+    ota_status.total = req->content_len;
+
+    {
+        ota_form_t *form = (ota_form_t *)calloc(1, sizeof(ota_form_t));
+        const multipart_callbacks_t cb = {ota_part_begin, ota_data, ota_part_end};
+        multipart_t *mp = NULL;
+        if (form)
+        {
+            form->session = s;
+            mp = multipart_create(boundary, &cb, form);
+        }
+        err = mp ? multipart_receive(req, mp, buf, BUFFSIZE) : ESP_ERR_NO_MEM;
+        if (err == ESP_OK && !form->have_image)
+            err = ESP_ERR_NOT_FOUND;
+        multipart_free(mp);
+        free(form);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "OTA reception failed: %s", esp_err_to_name(err));
+        ota_session_abort(s);
+        httpd_resp_send_500(req);
+        goto done;
+    }
+
+    if ((err = ota_session_end(s)) != ESP_OK)
+    {
+        httpd_resp_send_500(req);
+        goto done;
+    }
+    httpd_resp_sendstr(req, "Update succeeded!");
+
+done:
+    free(buf);
+    ota_busy = false;
+    return err == ESP_OK ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t ota_post_handler(httpd_req_t *req)
+{
+    if (!ota_claim(req))
+        return ESP_OK;
+    ota_busy = true;
+
+    // Run on a task of its own so the server answers /update/status during the
+    // update, and the pool workers stay free for files.
+    if (worker_pool_spawn(req, ota_run, NULL, "sw_ota") == ESP_OK)
+        return ESP_OK;
+    return ota_run(req, NULL);
+}
+
+esp_err_t ota_get_status(httpd_req_t *req)
+{
+    ota_status_t s = ota_status;
+    int64_t now = s.end_us ? s.end_us : esp_timer_get_time();
+    int64_t elapsed_ms = s.start_us ? (now - s.start_us) / 1000 : 0;
+
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             "{\"state\": \"%s\", \"format\": \"%s\", \"total\": %u, \"received\": %u, \"written\": %u, \"elapsed_ms\": %lld, "
+             "\"receive_kbps\": %lld, \"write_kbps\": %lld}",
+             s.state, s.format, (unsigned)s.total, (unsigned)s.received, (unsigned)s.written, (long long)elapsed_ms,
+             elapsed_ms ? (long long)s.received * 1000 / 1024 / elapsed_ms : 0LL,
+             s.write_busy_us ? (long long)s.written * 1000000 / 1024 / s.write_busy_us : 0LL);
+    httpd_resp_set_type(req, "application/json");
+    return httpd_resp_sendstr(req, buf);
+}
+
+//-- Resumable update -----------------------------------------------------------
+//
+//   POST /update/firmware/start?size=<bytes>[&sha256=<hex>]  -> session status
+//   POST /update/firmware/chunk?id=<id>&offset=<n>           raw body -> session status
+//   GET  /update/firmware/session?id=<id>                    -> session status
+//   POST /update/firmware/commit?id=<id>                    optional manifest body
+//   POST /update/firmware/abort?id=<id>
+//
+// Chunks are written in order. status.offset is the next byte the device
+// expects, a chunk starting before it has its known bytes skipped, so a
+// client resends from there after a dropped connection. Starting again with
+// the same size and hash resumes the session. Commit checks the size and the
+// SHA-256 of the uploaded image before the boot partition is switched.
+
+static esp_err_t ota_send_session(httpd_req_t *req, const ota_session_t *s)
+{
+    char buf[128];
+    snprintf(buf, sizeof(buf), "{\"id\": \"%08lx\", \"size\": %u, \"offset\": %u}", (unsigned long)s->id,
+             (unsigned)s->size, (unsigned)s->offset);
+    httpd_resp_set_type(req, "application/json");
+    return httpd_resp_sendstr(req, buf);
+}
+
+static ota_session_t *ota_find_session(httpd_req_t *req)
+{
+    char value[16];
+    if (!get_value_from_query(req, "id", value, sizeof(value)))
+        return NULL;
+    if (ota_session == NULL || strtoul(value, NULL, 16) != ota_session->id)
+    {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Unknown OTA session");
+        return NULL;
+    }
+    ota_session->last_used = esp_timer_get_time();
+    return ota_session;
+}
+
+static esp_err_t ota_start_handler(httpd_req_t *req)
+{
+    char value[2 * SHA256_SIZE + 1];
+    if (!get_value_from_query(req, "size", value, sizeof(value)))
+        return ESP_FAIL;
+    size_t size = strtoul(value, NULL, 10);
+    if (size == 0)
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid size");
         return ESP_FAIL;
+    }
 
-    esp_ota_handle_t ota_handle;
-    const esp_partition_t *update_partition = esp_ota_get_next_update_partition(NULL);
+    uint8_t expected[SHA256_SIZE];
+    bool verify = get_optional_value_from_query(req, "sha256", value, sizeof(value));
+    if (verify && !_parse_sha256(value, expected))
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid sha256");
+        return ESP_FAIL;
+    }
 
-    ESP_LOGI(TAG, "OTA Update partition: %s", update_partition->label);
+    if (ota_session && !ota_busy && ota_session->size == size && ota_session->verify == verify &&
+        (!verify || memcmp(ota_session->expected, expected, SHA256_SIZE) == 0))
+    {
+        ESP_LOGI(TAG, "Resuming OTA session %08lx at %u", (unsigned long)ota_session->id, (unsigned)ota_session->offset);
+        ota_session->last_used = esp_timer_get_time();
+        return ota_send_session(req, ota_session);
+    }
+    if (!ota_claim(req))
+        return ESP_OK;
 
-    esp_err_t err = esp_ota_begin(update_partition, OTA_SIZE_UNKNOWN, &ota_handle);
-    if (err != ESP_OK)
+    ota_session = ota_session_begin(size, verify ? expected : NULL);
+    if (ota_session == NULL)
     {
-        ESP_LOGE(TAG, "Failed to start OTA");
         httpd_resp_send_500(req);
         return ESP_FAIL;
     }
+    ota_session->id = esp_random() | 1;
+    return ota_send_session(req, ota_session);
+}
 
-    bool is_header = true;
+static esp_err_t ota_chunk_handler(httpd_req_t *req)
+{
+    char value[16];
+    ota_session_t *s = ota_find_session(req);
+    if (s == NULL || !get_value_from_query(req, "offset", value, sizeof(value)))
+        return ESP_FAIL;
 
-    while ((received = httpd_req_recv(req, buf, BUFFSIZE)) > 0)
+    size_t offset = strtoul(value, NULL, 10);
+    if (offset > s->offset)
     {
-        char *data_start = NULL;
-        char *data_end = NULL;
+        // A gap can not be written, tell the client where to continue.
+        httpd_resp_set_status(req, "409 Conflict");
+        return ota_send_session(req, s);
+    }
+
+    char *buf = (char *)malloc(BUFFSIZE);
+    if (buf == NULL)
+    {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
 
-        // If we're at the header (first multipart segment)
-        if (is_header)
+    size_t remaining = req->content_len;
+    esp_err_t err = ESP_OK;
+    while (remaining > 0 && err == ESP_OK)
+    {
+        int received = _recv(req, buf, MIN(remaining, BUFFSIZE));
+        if (received <= 0)
         {
-            data_start = strstr(buf, boundary);
-            if (data_start)
-            {
-                data_start += strlen(boundary);
-                data_start = strstr(data_start, "\r\n\r\n");
-                if (data_start)
-                {
-                    data_start += 4;   // Move past the "\r\n\r\n" to the binary data start
-                    is_header = false; // subsequent segments are data
-
-                    // Check if end boundary is also in the buffer
-                    data_end = strstr(data_start, boundary);
-                    if (data_end)
-                    {
-                        received = data_end - data_start;
-                    }
-                    else
-                    {
-                        received -= (data_start - buf);
-                    }
-                }
-            }
+            // Everything consumed so far stays, the client resumes from s->offset.
+            ESP_LOGW(TAG, "Chunk reception stopped at %u: %d", (unsigned)s->offset, received);
+            free(buf);
+            return ESP_FAIL;
         }
-        else
+        remaining -= received;
+
+        // Skip bytes of a resent chunk the session already has.
+        size_t skip = MIN((size_t)received, s->offset - offset);
+        offset += skip;
+        if ((size_t)received > skip)
         {
-            // Check for end boundary in buffer
-            data_end = strstr(buf, boundary);
-            if (data_end)
-            {
-                received = data_end - buf;
-                is_header = true; // reset for next file (if multi file upload)
-            }
-            data_start = buf;
+            err = ota_session_write(s, (const uint8_t *)buf + skip, received - skip);
+            offset += received - skip;
         }
+    }
+    free(buf);
+
+    if (err != ESP_OK)
+    {
+        // The image can not be completed, the session is gone.
+        ota_session_abort(s);
+        ota_session = NULL;
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Write failed");
+        return ESP_FAIL;
+    }
+    return ota_send_session(req, s);
+}
+
+static esp_err_t ota_session_handler(httpd_req_t *req)
+{
+    ota_session_t *s = ota_find_session(req);
+    if (s == NULL)
+        return ESP_FAIL;
+    return ota_send_session(req, s);
+}
+
+static esp_err_t ota_commit_handler(httpd_req_t *req)
+{
+    ota_session_t *s = ota_find_session(req);
+    if (s == NULL)
+        return ESP_FAIL;
+    if (s->offset != s->size)
+    {
+        httpd_resp_set_status(req, "409 Conflict");
+        return ota_send_session(req, s);
+    }
 
-        if (data_start && received > 0)
+    // The body, if any, is the manifest.
+    if (req->content_len > 0)
+    {
+        char *manifest = (char *)malloc(OTA_MANIFEST_MAX);
+        size_t len = 0;
+        if (manifest && req->content_len <= OTA_MANIFEST_MAX)
         {
-            err = esp_ota_write(ota_handle, data_start, received);
-            if (err != ESP_OK)
-            {
-                ESP_LOGE(TAG, "Failed to write OTA data: %s", esp_err_to_name(err));
-                httpd_resp_send_500(req);
-                return ESP_FAIL;
-            }
+            int received;
+            while (len < req->content_len && (received = _recv(req, manifest + len, req->content_len - len)) > 0)
+                len += received;
+        }
+        esp_err_t err = (len > 0 && len == req->content_len)
+                            ? ota_parse_manifest(manifest, len, &s->manifest)
+                            : ESP_ERR_INVALID_SIZE;
+        free(manifest);
+        if (err != ESP_OK)
+        {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid manifest");
+            return ESP_FAIL;
         }
     }
 
-    if (esp_ota_end(ota_handle) != ESP_OK)
+    ota_session = NULL;
+    if (ota_session_end(s) != ESP_OK)
     {
-        ESP_LOGE(TAG, "esp_ota_end failed: %s", esp_err_to_name(err));
-        httpd_resp_send_500(req);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Image validation failed");
         return ESP_FAIL;
     }
+    httpd_resp_sendstr(req, "Update succeeded!");
+    return ESP_OK;
+}
 
-    if (esp_ota_set_boot_partition(update_partition) != ESP_OK)
-    {
-        ESP_LOGE(TAG, "esp_ota_set_boot_partition failed: %s", esp_err_to_name(err));
-        httpd_resp_send_500(req);
+static esp_err_t ota_abort_handler(httpd_req_t *req)
+{
+    ota_session_t *s = ota_find_session(req);
+    if (s == NULL)
         return ESP_FAIL;
+
+    ota_session = NULL;
+    ota_session_abort(s);
+    httpd_resp_sendstr(req, "Update aborted");
+    return ESP_OK;
+}
+
+void ota_session_register(void)
+{
+    httpss_register_url("/update/firmware/start", false, ota_start_handler, HTTP_POST, NULL);
+    httpss_register_url("/update/firmware/chunk", false, ota_chunk_handler, HTTP_POST, NULL);
+    httpss_register_url("/update/firmware/session", false, ota_session_handler, HTTP_GET, NULL);
+    httpss_register_url("/update/firmware/commit", false, ota_commit_handler, HTTP_POST, NULL);
+    httpss_register_url("/update/firmware/abort", false, ota_abort_handler, HTTP_POST, NULL);
+}
+
+// Mount the freshly written image and rebuild the static file index and its
+// manifest from it, so the new files are served without a reboot.
+static void web_partition_remount(const esp_partition_t *part)
+{
+    const char *root = web_index_root();
+    if (root == NULL)
+        return;
+
+    esp_vfs_littlefs_unregister(part->label);
+
+    esp_vfs_littlefs_conf_t conf = {};
+    conf.base_path = root;
+    conf.partition_label = part->label;
+    esp_err_t err = esp_vfs_littlefs_register(&conf);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to mount %s at %s: %s", part->label, root, esp_err_to_name(err));
+        web_index_clear_disk();
+        return;
     }
+    web_index_rebuild();
+}
 
-    ESP_LOGI(TAG, "Update succeeded!");
-    httpd_resp_sendstr(req, "Update succeeded!");
+typedef struct
+{
+    const esp_partition_t *partition;
+    size_t written;
+    size_t erased; // Sectors below this offset are erased
+    int64_t erase_us;
+    mbedtls_sha256_context *sha; // Optional, over the bytes written
+} web_image_t;
+
+// Erase just ahead of the write offset, in 64 KB blocks where aligned. Runs on
+// the writer task, so erasing overlaps with receiving the next buffer and
+// sectors past the end of the image are left alone.
+static esp_err_t web_flash_write(void *ctx, const uint8_t *data, size_t len)
+{
+    web_image_t *image = (web_image_t *)ctx;
+    const esp_partition_t *part = image->partition;
+    if (image->written + len > part->size)
+    {
+        ESP_LOGE(TAG, "Image larger than partition %s", part->label);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    esp_err_t err = ESP_OK;
+    int64_t start = esp_timer_get_time();
+    while (image->erased < image->written + len && err == ESP_OK)
+    {
+        size_t size = WEB_ERASE_SECTOR;
+        if (image->erased % WEB_ERASE_BLOCK == 0 && image->erased + WEB_ERASE_BLOCK <= part->size)
+            size = WEB_ERASE_BLOCK;
+        err = esp_partition_erase_range(part, image->erased, size);
+        image->erased += size;
+    }
+    image->erase_us += esp_timer_get_time() - start;
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Erase failed at %u: %s", (unsigned)image->erased, esp_err_to_name(err));
+        return err;
+    }
 
+    err = esp_partition_write(part, image->written, data, len);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Write failed at %u", (unsigned)image->written);
+        return err;
+    }
+    if (image->sha)
+        mbedtls_sha256_update(image->sha, data, len);
+    image->written += len;
     return ESP_OK;
 }
 
+static esp_err_t web_data(void *arg, const multipart_part_t *part, const uint8_t *data, size_t len)
+{
+    if (part->index != 0)
+        return ESP_OK;
+    return flash_writer_write((flash_writer_t *)arg, data, len);
+}
+
+// With two slots the image goes to the one not serving and is switched to in
+// the background. With one, it is written in place and remounted.
 esp_err_t web_post_handler(httpd_req_t *req)
 {
-    const esp_partition_t *web_partition = esp_partition_find_first(
-        ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_LITTLEFS, "web");
+    char boundary[BOUNDARY_MAX_LEN];
+    if (!_get_boundary(req, boundary, sizeof(boundary)))
+        return ESP_FAIL;
+
+    const esp_partition_t *web_partition = web_slot_inactive();
+    bool in_place = web_partition == NULL;
+    if (in_place)
+        web_partition = web_slot_active();
     if (!web_partition) {
         httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Web partition not found");
         return ESP_FAIL;
     }
+    if (!web_slot_claim()) {
+        httpd_resp_set_status(req, "409 Conflict");
+        httpd_resp_sendstr(req, "Web update in progress");
+        return ESP_OK;
+    }
 
-    ESP_LOGI(TAG, "Web partition found: size=%ld, content_len=%d", web_partition->size, req->content_len);
+    ESP_LOGI(TAG, "Writing web partition %s: size=%ld, content_len=%d", web_partition->label, web_partition->size, req->content_len);
 
-    // Erase partition
-    esp_err_t err = esp_partition_erase_range(web_partition, 0, web_partition->size);
+    int64_t start = esp_timer_get_time();
+    char buf[1024];
+    web_image_t image = {web_partition, 0, 0, 0, NULL};
+    flash_writer_t *writer = flash_writer_start("web_writer", web_flash_write, &image);
+    const multipart_callbacks_t cb = {NULL, web_data, NULL};
+    multipart_t *mp = writer ? multipart_create(boundary, &cb, writer) : NULL;
+    esp_err_t err = mp ? multipart_receive(req, mp, buf, sizeof(buf)) : ESP_ERR_NO_MEM;
+    multipart_free(mp);
+    if (writer)
+    {
+        esp_err_t werr = flash_writer_finish(writer);
+        if (err == ESP_OK)
+            err = werr;
+    }
     if (err != ESP_OK) {
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Erase failed");
+        web_slot_release();
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Write failed");
         return err;
     }
 
-    // Buffers
-    char buf[1024];
-    size_t total_written = 0;
-    size_t max_file_size = web_partition->size;
-
-    // === STEP 1: Skip headers manually ===
-    bool found_file_start = false;
-    int received;
-    while (!found_file_start && (received = httpd_req_recv(req, buf, sizeof(buf))) > 0) {
-        for (int i = 0; i < received - 4; ++i) {
-            // Look for two newlines that mark the end of the headers
-            if ((buf[i] == '\r' && buf[i+1] == '\n' && buf[i+2] == '\r' && buf[i+3] == '\n') ||
-                (buf[i] == '\n' && buf[i+1] == '\n')) {
-                int header_end = i + ((buf[i] == '\r') ? 4 : 2);
-                int body_len = received - header_end;
-                if (body_len > 0) {
-                    err = esp_partition_write(web_partition, total_written, buf + header_end, body_len);
-                    if (err != ESP_OK) goto write_fail;
-                    total_written += body_len;
-                }
-                found_file_start = true;
-                break;
-            }
+    ESP_LOGI(TAG, "Upload complete: %u bytes in %lld ms, %u bytes erased in %lld ms", (unsigned)image.written,
+             (long long)(esp_timer_get_time() - start) / 1000, (unsigned)image.erased, (long long)image.erase_us / 1000);
+    if (in_place)
+    {
+        // The partition holds the new image either way, so it is remounted even
+        // when its size could not be recorded.
+        err = web_slot_commit(web_partition, image.written);
+        web_partition_remount(web_partition);
+        web_slot_release();
+        if (err != ESP_OK)
+        {
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to record web image");
+            return err;
         }
+        httpd_resp_sendstr(req, "Upload complete");
+        return ESP_OK;
     }
 
-    if (!found_file_start) {
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to find multipart body");
+    if (web_slot_switch(req, web_partition, image.written) != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Image does not mount");
         return ESP_FAIL;
     }
+    httpd_resp_sendstr(req, "Upload complete, switching web slot");
+    return ESP_OK;
+}
 
-    // === STEP 2: Continue receiving and writing until max_file_size ===
-    while (total_written < max_file_size) {
-        received = httpd_req_recv(req, buf, sizeof(buf));
-        if (received <= 0) break;
-
-        // Avoid writing more than file size
-        int bytes_to_write = received;
-        if (total_written + bytes_to_write > max_file_size)
-            bytes_to_write = max_file_size - total_written;
+//-- Bundle update ----------------------------------------------------------------
+//
+//   POST /update/bundle   multipart/form-data, parts "firmware", "web" and "manifest"
+//
+// The manifest, in any position, covers both images:
+//   {"firmware": {"sha256": "<hex>", "signature": "<base64>"}, "web": {...}}
+// Each image streams to its own writer as its part arrives. Both are verified
+// before either is committed. With both images, the web slot is staged for the
+// new firmware first, then the boot partition switch commits the two at once:
+// a power loss before it boots the old firmware with the old web slot, after
+// it the new firmware with the new slot. Both take effect at the next restart.
+// The upload runs on a task of its own, not on one of the pool workers.
 
-        err = esp_partition_write(web_partition, total_written, buf, bytes_to_write);
-        if (err != ESP_OK) goto write_fail;
+typedef enum
+{
+    BUNDLE_PART_IGNORE,
+    BUNDLE_PART_MANIFEST,
+    BUNDLE_PART_FIRMWARE,
+    BUNDLE_PART_WEB,
+} bundle_part_t;
 
-        ESP_LOGI(TAG, "Wrote %d bytes to partition at offset %d", bytes_to_write, total_written);
+typedef struct
+{
+    bundle_part_t current;
+    ota_session_t *firmware;
+    ota_manifest_t firmware_manifest;
+    flash_writer_t *web_writer;
+    web_image_t web;
+    mbedtls_sha256_context web_sha;
+    ota_manifest_t web_manifest;
+    char manifest[OTA_MANIFEST_MAX];
+    size_t manifest_len;
+} bundle_t;
 
-        total_written += bytes_to_write;
-        if (bytes_to_write < received) break;  // probably just hit multipart trailer
+static esp_err_t bundle_parse_manifest(bundle_t *b)
+{
+    cJSON *root = cJSON_ParseWithLength(b->manifest, b->manifest_len);
+    if (root == NULL)
+    {
+        ESP_LOGE(TAG, "Invalid bundle manifest");
+        return ESP_ERR_INVALID_ARG;
     }
+    esp_err_t err = ESP_OK;
+    const cJSON *firmware = cJSON_GetObjectItem(root, "firmware");
+    if (cJSON_IsObject(firmware))
+        err = ota_manifest_from_json(firmware, &b->firmware_manifest);
+    const cJSON *web = cJSON_GetObjectItem(root, "web");
+    if (err == ESP_OK && cJSON_IsObject(web))
+        err = ota_manifest_from_json(web, &b->web_manifest);
+    cJSON_Delete(root);
+    return err;
+}
 
-    ESP_LOGI(TAG, "Upload complete: %d bytes", total_written);
-    httpd_resp_sendstr(req, "Upload complete");
+// Each image may appear once. Its writer starts with the part, so flash work
+// for one image never waits for the other to arrive.
+static esp_err_t bundle_part_begin(void *arg, const multipart_part_t *part)
+{
+    bundle_t *b = (bundle_t *)arg;
+    b->current = BUNDLE_PART_IGNORE;
+    if (strcmp(part->name, "manifest") == 0)
+        b->current = BUNDLE_PART_MANIFEST;
+    else if (strcmp(part->name, "firmware") == 0)
+    {
+        if (b->firmware)
+            return ESP_ERR_INVALID_ARG;
+        if ((b->firmware = ota_session_begin(0, NULL)) == NULL)
+            return ESP_ERR_NO_MEM;
+        b->current = BUNDLE_PART_FIRMWARE;
+    }
+    else if (strcmp(part->name, "web") == 0)
+    {
+        if (b->web_writer)
+            return ESP_ERR_INVALID_ARG;
+        if (b->web.partition == NULL)
+        {
+            ESP_LOGE(TAG, "A bundle needs a second web slot, %s", WEB_SLOT_B);
+            return ESP_ERR_NOT_SUPPORTED;
+        }
+        if ((b->web_writer = flash_writer_start("web_writer", web_flash_write, &b->web)) == NULL)
+            return ESP_ERR_NO_MEM;
+        b->current = BUNDLE_PART_WEB;
+    }
     return ESP_OK;
+}
+
+static esp_err_t bundle_data(void *arg, const multipart_part_t *part, const uint8_t *data, size_t len)
+{
+    bundle_t *b = (bundle_t *)arg;
+    switch (b->current)
+    {
+    case BUNDLE_PART_FIRMWARE:
+        return ota_session_write(b->firmware, data, len);
+    case BUNDLE_PART_WEB:
+        return flash_writer_write(b->web_writer, data, len);
+    case BUNDLE_PART_MANIFEST:
+        if (len > sizeof(b->manifest) - b->manifest_len)
+        {
+            ESP_LOGE(TAG, "Manifest larger than %d bytes", OTA_MANIFEST_MAX);
+            return ESP_ERR_INVALID_SIZE;
+        }
+        memcpy(b->manifest + b->manifest_len, data, len);
+        b->manifest_len += len;
+        return ESP_OK;
+    default:
+        return ESP_OK;
+    }
+}
 
-write_fail:
-    ESP_LOGE(TAG, "Write failed at %d", total_written);
-    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Write failed");
+static esp_err_t bundle_part_end(void *arg, const multipart_part_t *part)
+{
+    bundle_t *b = (bundle_t *)arg;
+    if (b->current != BUNDLE_PART_MANIFEST)
+        return ESP_OK;
+    return bundle_parse_manifest(b);
+}
+
+// Drain the web writer and check the image, it must match the manifest and
+// mount. The slot is not switched yet.
+static esp_err_t bundle_web_end(bundle_t *b, esp_err_t err)
+{
+    esp_err_t werr = flash_writer_finish(b->web_writer);
+    b->web_writer = NULL;
+    if (err != ESP_OK)
+        return err;
+    if (werr != ESP_OK)
+        return werr;
+
+    uint8_t digest[SHA256_SIZE];
+    mbedtls_sha256_finish(&b->web_sha, digest);
+    err = ota_verify_manifest(&b->web_manifest, digest);
+    if (err == ESP_OK)
+        err = web_slot_check(b->web.partition);
+    return err;
+}
+
+static esp_err_t bundle_stage_web(void *ctx, const esp_partition_t *app)
+{
+    bundle_t *b = (bundle_t *)ctx;
+    esp_err_t err = web_slot_stage(b->web.partition, b->web.written, app);
+    if (err != ESP_OK)
+        ESP_LOGE(TAG, "Failed to stage web slot %s: %s", b->web.partition->label, esp_err_to_name(err));
     return err;
 }
 
+static esp_err_t bundle_run(httpd_req_t *req, void *arg)
+{
+    char boundary[BOUNDARY_MAX_LEN];
+    char *buf = (char *)malloc(BUFFSIZE);
+    bundle_t *b = (bundle_t *)calloc(1, sizeof(bundle_t));
+    const multipart_callbacks_t cb = {bundle_part_begin, bundle_data, bundle_part_end};
+    multipart_t *mp = NULL;
+    esp_err_t err = ESP_FAIL;
+    bool web_committed = false;
+
+    if (!_get_boundary(req, boundary, sizeof(boundary)))
+        goto done;
+    if (buf == NULL || b == NULL || (mp = multipart_create(boundary, &cb, b)) == NULL)
+    {
+        httpd_resp_send_500(req);
+        goto done;
+    }
+    b->web.partition = web_slot_inactive();
+    b->web.sha = &b->web_sha;
+    mbedtls_sha256_init(&b->web_sha);
+    mbedtls_sha256_starts(&b->web_sha, 0);
+
+    {
+        int64_t start = esp_timer_get_time();
+        err = multipart_receive(req, mp, buf, BUFFSIZE);
+        if (err == ESP_OK && b->firmware == NULL && b->web_writer == NULL)
+            err = ESP_ERR_NOT_FOUND;
+        if (b->web_writer)
+            err = bundle_web_end(b, err);
+        ESP_LOGI(TAG, "Bundle received in %lld ms: %s", (long long)(esp_timer_get_time() - start) / 1000, esp_err_to_name(err));
+    }
+
+    // The web image is checked first, so a bad one leaves the boot partition alone.
+    if (b->firmware)
+    {
+        if (err != ESP_OK)
+            ota_session_abort(b->firmware);
+        else
+        {
+            b->firmware->manifest = b->firmware_manifest;
+            if (b->web.written > 0)
+            {
+                b->firmware->before_boot = bundle_stage_web;
+                b->firmware->before_boot_ctx = b;
+            }
+            err = ota_session_end(b->firmware);
+            web_committed = err == ESP_OK && b->web.written > 0;
+        }
+        b->firmware = NULL;
+    }
+    else if (err == ESP_OK && b->web.written > 0)
+    {
+        err = web_slot_commit(b->web.partition, b->web.written);
+        web_committed = err == ESP_OK;
+    }
+
+    if (err != ESP_OK)
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Bundle update failed");
+    else
+        httpd_resp_sendstr(req, "Update succeeded, restart to apply");
+
+done:
+    multipart_free(mp);
+    if (b)
+        mbedtls_sha256_free(&b->web_sha);
+    free(b);
+    free(buf);
+    ota_busy = false;
+    // The slot committed for the next boot is the mounted one's sibling, no
+    // other web update may touch it until the restart.
+    if (!web_committed)
+        web_slot_release();
+    return err == ESP_OK ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t ota_bundle_handler(httpd_req_t *req)
+{
+    if (!ota_claim(req))
+        return ESP_OK;
+    if (!web_slot_claim())
+    {
+        httpd_resp_set_status(req, "409 Conflict");
+        httpd_resp_sendstr(req, "Web update in progress");
+        return ESP_OK;
+    }
+    ota_busy = true;
+
+    // A bundle upload takes minutes, it must not hold one of the pool workers.
+    if (worker_pool_spawn(req, bundle_run, NULL, "sw_bundle") == ESP_OK)
+        return ESP_OK;
+    return bundle_run(req, NULL);
+}
+
 // esp_err_t web_post_handler(httpd_req_t *req)
 // {
 //     char buf[BUFFSIZE];
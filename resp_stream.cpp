@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "serviceweb.h"
+#include "api_priv.hpp"
+#include "web_index.hpp"
+#include "resp_stream.hpp"
+
+static const char* TAG = "RESP_STREAM";
+
+static int compression_level = 3;
+static size_t compression_memory = 16 * 1024;
+static size_t compression_min_size = 1024;
+
+void serviceweb_set_compression(int level, size_t memory_budget, size_t min_size)
+{
+    compression_level = level;
+    compression_memory = memory_budget;
+    compression_min_size = min_size;
+}
+
+deflate_stream_t* resp_stream_create_deflate(deflate_output_t output, void* ctx)
+{
+    return deflate_create(compression_level > 0 ? compression_level : 1, compression_memory, output, ctx);
+}
+
+static esp_err_t send_compressed(void* ctx, const uint8_t* data, size_t len)
+{
+    resp_stream_t* s = (resp_stream_t*)ctx;
+    return httpd_resp_send_chunk(s->req, (const char*)data, len);
+}
+
+void resp_stream_begin(resp_stream_t* s, httpd_req_t* req)
+{
+    memset(s, 0, sizeof(resp_stream_t));
+    s->req = req;
+    if (compression_level <= 0)
+        return;
+
+    // The body depends on Accept-Encoding whether or not this one is compressed.
+    httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+    if (_negotiate_encoding(req, WEB_VARIANT_IDENTITY | WEB_VARIANT_GZIP) != SERVICEWEB_ENCODING_GZIP)
+        return;
+
+    s->pending = (char*)malloc(compression_min_size);
+    if (s->pending == NULL && compression_min_size > 0)
+        return;
+    s->pending_size = compression_min_size;
+    s->gzip = true;
+}
+
+static void flush_pending(resp_stream_t* s)
+{
+    if (s->pending_len > 0)
+        s->err = httpd_resp_send_chunk(s->req, s->pending, s->pending_len);
+    s->pending_len = 0;
+}
+
+static void start_gzip(resp_stream_t* s)
+{
+    s->deflate = deflate_create(compression_level, compression_memory, send_compressed, s);
+    if (s->deflate == NULL)
+    {
+        ESP_LOGW(TAG, "No memory for compression, sending %s uncompressed", s->req->uri);
+        s->gzip = false;
+        flush_pending(s);
+        return;
+    }
+
+    httpd_resp_set_hdr(s->req, "Content-Encoding", "gzip");
+    if (s->pending_len > 0)
+        s->err = deflate_write(s->deflate, s->pending, s->pending_len);
+    s->pending_len = 0;
+}
+
+esp_err_t resp_stream_send(resp_stream_t* s, const char* buf, ssize_t len)
+{
+    if (s->err != ESP_OK)
+        return s->err;
+    if (len == HTTPD_RESP_USE_STRLEN)
+        len = strlen(buf);
+
+    if (s->gzip && s->deflate == NULL)
+    {
+        if (s->pending_len + len <= s->pending_size)
+        {
+            memcpy(s->pending + s->pending_len, buf, len);
+            s->pending_len += len;
+            return ESP_OK;
+        }
+        start_gzip(s);
+        if (s->err != ESP_OK)
+            return s->err;
+    }
+
+    if (s->deflate)
+        s->err = deflate_write(s->deflate, buf, len);
+    else
+        s->err = httpd_resp_send_chunk(s->req, buf, len);
+    return s->err;
+}
+
+esp_err_t resp_stream_end(resp_stream_t* s)
+{
+    if (s->deflate)
+    {
+        if (s->err == ESP_OK)
+            s->err = deflate_finish(s->deflate);
+        ESP_LOGD(TAG, "%s: %u -> %u bytes", s->req->uri, (unsigned)deflate_total_in(s->deflate), (unsigned)deflate_total_out(s->deflate));
+        deflate_free(s->deflate);
+        s->deflate = NULL;
+        if (s->err == ESP_OK)
+            s->err = httpd_resp_send_chunk(s->req, NULL, 0);
+    }
+    else if (s->gzip)
+    {
+        // Never reached the minimum size, send as is with a Content-Length.
+        if (s->err == ESP_OK)
+            s->err = httpd_resp_send(s->req, s->pending, s->pending_len);
+    }
+    else if (s->err == ESP_OK)
+        s->err = httpd_resp_send_chunk(s->req, NULL, 0);
+
+    free(s->pending);
+    s->pending = NULL;
+    return s->err;
+}
+
+esp_err_t resp_stream_sendstr(httpd_req_t* req, const char* str)
+{
+    resp_stream_t s;
+    resp_stream_begin(&s, req);
+    resp_stream_send(&s, str, HTTPD_RESP_USE_STRLEN);
+    return resp_stream_end(&s);
+}
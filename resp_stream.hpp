@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_http_server.h"
+#include "deflate.hpp"
+
+// Chunked response writer that gzips the body on the fly when the client
+// accepts gzip and the body grows past the configured minimum size. Smaller
+// bodies are sent uncompressed in one piece with a Content-Length.
+typedef struct
+{
+    httpd_req_t* req;
+    deflate_stream_t* deflate;
+    bool gzip;       // Compression enabled and accepted by the client
+    esp_err_t err;
+    char* pending;   // Body held back until it reaches the minimum size
+    size_t pending_len;
+    size_t pending_size;
+} resp_stream_t;
+
+void resp_stream_begin(resp_stream_t* s, httpd_req_t* req);
+// len may be HTTPD_RESP_USE_STRLEN
+esp_err_t resp_stream_send(resp_stream_t* s, const char* buf, ssize_t len);
+esp_err_t resp_stream_end(resp_stream_t* s);
+// Whole body in one call, for JSON replies built up front.
+esp_err_t resp_stream_sendstr(httpd_req_t* req, const char* str);
+
+// gzip stream with the configured level and memory budget, for bodies that are
+// gzip files themselves. Level 1 when compression is turned off.
+deflate_stream_t* resp_stream_create_deflate(deflate_output_t output, void* ctx);
@@ -11,12 +11,16 @@
 #include "serviceweb.h"
 #include "httpss.h"
 #include "api_priv.hpp"
+#include "web_index.hpp"
+#include "file_stream.hpp"
+#include "nvs_cache.hpp"
 
 #include "cJSON.h"
 #include "pp.h"
 
 #define MAX_FLOAT_BYTES 80
 #define SEND_TIMOEOUT_MS 100
+#define ACCEPT_ENCODING_MAX 512
 
 // #define DEBUG_PARAMETER 1
 
@@ -32,16 +36,13 @@ enum
     CMD_WS_HANDLER,
 };
 
-typedef struct
-{
-    const uint8_t* html_start;
-    const uint8_t* html_end;
-    bool gzip;
-} file_get_t;
-
 extern esp_err_t ota_post_handler(httpd_req_t* req);
 extern esp_err_t web_post_handler(httpd_req_t* req);
+extern esp_err_t ota_bundle_handler(httpd_req_t* req);
+extern esp_err_t ota_get_status(httpd_req_t* req);
+extern void ota_session_register(void);
 extern esp_err_t sysmon_get_handler(httpd_req_t* req);
+extern esp_err_t sysmon_get_openmetrics(httpd_req_t* req);
 extern esp_err_t sysmon_get_info(httpd_req_t* req);
 extern esp_err_t sysmon_get_partition(httpd_req_t* req);
 extern void start_api_server(void);
@@ -64,61 +65,65 @@ static size_t json_buf_size = 0;
 static char* rx_buf = 0;
 static size_t rx_buf_size = 0;
 static pp_evloop_t* evloop;
-static std::map<std::string, file_get_t> file_get_map;
 static const char* web_root = NULL;
 
 static void evloop_newstate(void* handler_arg, esp_event_base_t base, int32_t id, void* context);
 
-void serviceweb_set_content_type(httpd_req_t* req, const char* filename)
+const char* serviceweb_content_type(const char* filename)
 {
     // Find the file ending
     char* file_ending = strrchr(filename, '.');
     if (file_ending)
     {
         if (strcmp(file_ending, ".html") == 0)
-            httpd_resp_set_type(req, "text/html");
+            return "text/html";
         else if (strcmp(file_ending, ".js") == 0)
-            httpd_resp_set_type(req, "application/javascript");
+            return "application/javascript";
         else if (strcmp(file_ending, ".css") == 0)
-            httpd_resp_set_type(req, "text/css");
+            return "text/css";
         else if (strcmp(file_ending, ".svg") == 0)
-            httpd_resp_set_type(req, "image/svg+xml");
+            return "image/svg+xml";
         else if (strcmp(file_ending, ".json") == 0)
-            httpd_resp_set_type(req, "application/json");
+            return "application/json";
         else if (strcmp(file_ending, ".jpg") == 0)
-            httpd_resp_set_type(req, "image/jpeg");
+            return "image/jpeg";
         else if (strcmp(file_ending, ".png") == 0)
-            httpd_resp_set_type(req, "image/png");
+            return "image/png";
         else if (strcmp(file_ending, ".gif") == 0)
-            httpd_resp_set_type(req, "image/gif");
+            return "image/gif";
         else if (strcmp(file_ending, ".xml") == 0)
-            httpd_resp_set_type(req, "application/xml");
+            return "application/xml";
         else if (strcmp(file_ending, ".zip") == 0)
-            httpd_resp_set_type(req, "application/zip");
+            return "application/zip";
         else if (strcmp(file_ending, ".gz") == 0)
-            httpd_resp_set_type(req, "application/gzip");
+            return "application/gzip";
         else if (strcmp(file_ending, ".tar") == 0)
-            httpd_resp_set_type(req, "application/x-tar");
+            return "application/x-tar";
         else if (strcmp(file_ending, ".txt") == 0)
-            httpd_resp_set_type(req, "text/plain");
+            return "text/plain";
         else if (strcmp(file_ending, ".csv") == 0)
-            httpd_resp_set_type(req, "text/csv");
+            return "text/csv";
         else if (strcmp(file_ending, ".glb") == 0)
-            httpd_resp_set_type(req, "model/gltf-binary");
+            return "model/gltf-binary";
         else if (strcmp(file_ending, ".gltf") == 0)
-            httpd_resp_set_type(req, "model/gltf+json");
+            return "model/gltf+json";
         else if (strcmp(file_ending, ".stl") == 0)
-            httpd_resp_set_type(req, "model/stl");
+            return "model/stl";
         else if (strcmp(file_ending, ".obj") == 0)
-            httpd_resp_set_type(req, "model/obj");
-        else
-            httpd_resp_set_type(req, "application/octet-stream");
-    }
-    else
-    {
-        httpd_resp_set_type(req, "application/octet-stream");
+            return "model/obj";
+        else if (strcmp(file_ending, ".mp4") == 0)
+            return "video/mp4";
+        else if (strcmp(file_ending, ".webm") == 0)
+            return "video/webm";
+        else if (strcmp(file_ending, ".mp3") == 0)
+            return "audio/mpeg";
     }
+    return "application/octet-stream";
+}
 
+void serviceweb_set_content_type(httpd_req_t* req, const char* filename)
+{
+    httpd_resp_set_type(req, serviceweb_content_type(filename));
     //    httpd_resp_set_hdr(req, "Cache-Control", "public, max-age=31536000"); // One year cache      
 }
 
@@ -139,6 +144,109 @@ esp_err_t _set_gz_support(httpd_req_t* req, bool& gzip_supported)
     }
     return err;
 }
+// Parse a q-value into thousandths, "q=0.8" -> 800.
+static int parse_qvalue(const char* p)
+{
+    int q = (*p == '1') ? 1000 : 0;
+    if (*p != '0' && *p != '1')
+        return 1000;
+    if (*++p != '.')
+        return q;
+    int scale = 100;
+    while (*++p >= '0' && *p <= '9' && scale > 0)
+    {
+        q += (*p - '0') * scale;
+        scale /= 10;
+    }
+    return q > 1000 ? 1000 : q;
+}
+
+// Choose among the available variants (WEB_VARIANT_* flags) by the q-values in
+// Accept-Encoding, ties broken in the order br, gzip, identity. Returns -1 when
+// the client accepts none of them.
+int _negotiate_encoding(httpd_req_t* req, uint8_t variants)
+{
+    // Identity is acceptable unless refused explicitly, other codings only when listed.
+    int q[WEB_ENCODING_COUNT] = {1000, 0, 0};
+    // A header longer than the buffer is ignored like a missing one.
+    char header[ACCEPT_ENCODING_MAX];
+    size_t len = httpd_req_get_hdr_value_len(req, "Accept-Encoding");
+    if (len > 0 && len < sizeof(header) &&
+        httpd_req_get_hdr_value_str(req, "Accept-Encoding", header, sizeof(header)) == ESP_OK)
+    {
+        int star = -1;
+        bool listed[WEB_ENCODING_COUNT] = {};
+        char* save = NULL;
+        for (char* token = strtok_r(header, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save))
+        {
+            while (*token == ' ' || *token == '\t')
+                token++;
+            char* params = strchr(token, ';');
+            size_t name_len = params ? (size_t)(params - token) : strlen(token);
+            while (name_len > 0 && (token[name_len - 1] == ' ' || token[name_len - 1] == '\t'))
+                name_len--;
+
+            int qvalue = 1000;
+            if (params)
+            {
+                char* qs = strstr(params, "q=");
+                if (qs)
+                    qvalue = parse_qvalue(qs + 2);
+            }
+
+            if (name_len == 1 && token[0] == '*')
+                star = qvalue;
+            else if (name_len == 8 && strncasecmp(token, "identity", 8) == 0)
+                q[SERVICEWEB_ENCODING_IDENTITY] = qvalue, listed[SERVICEWEB_ENCODING_IDENTITY] = true;
+            else if ((name_len == 4 && strncasecmp(token, "gzip", 4) == 0) || (name_len == 6 && strncasecmp(token, "x-gzip", 6) == 0))
+                q[SERVICEWEB_ENCODING_GZIP] = qvalue, listed[SERVICEWEB_ENCODING_GZIP] = true;
+            else if (name_len == 2 && strncasecmp(token, "br", 2) == 0)
+                q[SERVICEWEB_ENCODING_BR] = qvalue, listed[SERVICEWEB_ENCODING_BR] = true;
+        }
+
+        if (star >= 0)
+        {
+            for (int i = 0; i < WEB_ENCODING_COUNT; i++)
+                if (!listed[i])
+                    q[i] = star;
+        }
+    }
+
+    static const int preference[WEB_ENCODING_COUNT] = {SERVICEWEB_ENCODING_BR, SERVICEWEB_ENCODING_GZIP, SERVICEWEB_ENCODING_IDENTITY};
+    int best = -1;
+    int best_q = 0;
+    for (int i = 0; i < WEB_ENCODING_COUNT; i++)
+    {
+        int encoding = preference[i];
+        if ((variants & WEB_VARIANT(encoding)) && q[encoding] > best_q)
+        {
+            best = encoding;
+            best_q = q[encoding];
+        }
+    }
+    return best;
+}
+
+// Negotiate the variant to send.
+static int select_variant(httpd_req_t* req, uint8_t variants)
+{
+    int encoding = _negotiate_encoding(req, variants);
+    if (encoding < 0)
+    {
+        // Nothing acceptable, prefer identity, otherwise send what there is.
+        encoding = SERVICEWEB_ENCODING_IDENTITY;
+        while (!(variants & WEB_VARIANT(encoding)) && encoding < WEB_ENCODING_COUNT - 1)
+            encoding++;
+    }
+    return encoding;
+}
+
+// More than one variant, the response depends on Accept-Encoding.
+static bool has_variants(uint8_t variants)
+{
+    return (variants & (variants - 1)) != 0;
+}
+
 esp_err_t _set_keepalive_support(httpd_req_t* req, bool& keep_alive)
 {
     esp_err_t err = ESP_OK;
@@ -165,38 +273,19 @@ void remove_query_parameters(char* buf)
         *p = 0;
 }
 
-static esp_err_t resp_memory_file(httpd_req_t* req)
+static esp_err_t resp_memory_file(httpd_req_t* req, const web_route_t* route)
 {
-    printf("resp_memory_file, uri: %s\n", req->uri);
-
-    const int bufsize = sizeof(req->uri);
-    char* buf = (char*)calloc(bufsize, 1);
-    if (buf == NULL)
-    {
-        ESP_LOGE(TAG, "Error allocating memory for buffer when serving memory file %s", req->uri);
-        return ESP_FAIL;
-    }
-
-    snprintf(buf, bufsize, "%s", req->uri);
-    remove_query_parameters(buf);
-    serviceweb_set_content_type(req, buf);
+    bool keep_alive;
 
-    if (!file_get_map.contains(buf))
-    {
-        ESP_LOGE(TAG, "File %s not found as memory file", req->uri);
-        free(buf);
-        return httpd_resp_send_404(req);
-    }
+    int encoding = select_variant(req, route->memory_variants);
+    const web_blob_t* blob = &route->memory[encoding];
+    if (encoding != SERVICEWEB_ENCODING_IDENTITY)
+        httpd_resp_set_hdr(req, "Content-Encoding", web_encoding_name(encoding));
+    if (has_variants(route->memory_variants))
+        httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
 
-    bool gzip_supported, keep_alive;
-    file_get_t file = file_get_map[buf];
-
-    _set_gz_support(req, gzip_supported);
     _set_keepalive_support(req, keep_alive);
-    httpd_resp_send_chunk(req, (char*)file.html_start, file.html_end - file.html_start);
-    esp_err_t ret = httpd_resp_send_chunk(req, buf, 0);
-    free(buf);
-    return ret;
+    return httpd_resp_send(req, (const char*)blob->start, blob->end - blob->start);
 }
 
 static size_t get_file_size(FILE* file)
@@ -207,57 +296,31 @@ static size_t get_file_size(FILE* file)
     return size;
 }
 
-static esp_err_t resp_disk_file(httpd_req_t* req)
+static esp_err_t resp_disk_file(httpd_req_t* req, const char* url, const web_route_t* route)
 {
-    esp_err_t err;
-    int read = 0;
-    const int bufsize = 1460;               // Default buffer size.
-    char* buf = (char*)calloc(bufsize, 1); // Allocate memory for the buffer.
+    const int bufsize = FILE_PATH_MAX;
+    char* buf = (char*)calloc(bufsize, 1);
     if (buf == NULL)
     {
         ESP_LOGE(TAG, "Error allocating memory for buffer when serving file %s", req->uri);
         return ESP_FAIL;
     }
 
-    bool gzip_supported = false;
-
-    if (ESP_OK != _set_gz_support(req, gzip_supported))
-    {
-        ESP_LOGE(TAG, "Error setting gzip support for file %s", req->uri);
-        free(buf);
-        return ESP_FAIL;
-    }
-
-    // Construct the file path.
-    snprintf(buf, bufsize, "%s/%s", web_root, req->uri);
-
-    remove_query_parameters(buf);
-    serviceweb_set_content_type(req, buf);
+    // The index knows which variants exist, so only a file that is there is opened.
+    int encoding = select_variant(req, route->disk_variants);
+    file_stream_info_t info = {};
+    info.content_type = serviceweb_content_type(url);
+    info.content_encoding = web_encoding_name(encoding);
+    info.vary = has_variants(route->disk_variants);
 
-    printf("resp_disk_file, uri: %s\n", buf);
-
-    // Check for gzip file existence before trying it.
-    FILE* file = NULL;
-    if (gzip_supported)
-    {
-        // Attempt to open .gz file.
-        strncat(buf, ".gz", bufsize - strlen(buf) - 1);
-        file = fopen(buf, "rb");
-    }
+    snprintf(buf, bufsize, "%s%s%s", web_root, url, web_encoding_suffix(encoding));
 
+    FILE* file = fopen(buf, "rb");
     if (file == NULL)
     {
-        // Retry with the original file if .gz was not found.
-        ESP_LOGE(TAG, "File %s does not exist, going for non .gz file...", buf);
-        gzip_supported = false;
-
-        file = fopen(buf, "rb");
-        if (file == NULL)
-        {
-            ESP_LOGE(TAG, "File %s does not exist!", buf);
-            free(buf);
-            return ESP_FAIL;
-        }
+        ESP_LOGE(TAG, "File %s does not exist!", buf);
+        free(buf);
+        return httpd_resp_send_404(req);
     }
 
     size_t file_size = get_file_size(file);
@@ -269,32 +332,43 @@ static esp_err_t resp_disk_file(httpd_req_t* req)
         return ESP_FAIL;
     }
 
-    if (file_size < bufsize)
-    {
-        if ((read = fread(buf, 1, bufsize, file)) > 0)
-            httpd_resp_send(req, buf, file_size);
-    }
-    else
+    // Large assets are sent from a worker, ahead of bulk downloads.
+    esp_err_t err = ESP_FAIL;
+    if (file_size >= FILE_STREAM_ASYNC_MIN)
+        err = file_stream_respond_async(req, buf, &info, WORKER_PRIORITY_HIGH);
+    if (err != ESP_OK)
     {
-        // Send the file in chunks
-        while ((read = fread(buf, 1, bufsize, file)) > 0)
-        {
-            err = httpd_resp_send_chunk(req, buf, read);
-            if (err != ESP_OK)
-            {
-                ESP_LOGE(TAG, "Error sending chunk for file %s: %s", req->uri, esp_err_to_name(err));
-                break;
-            }
-        }
-        err = httpd_resp_send_chunk(req, buf, 0); // End of chunked transfer.
+        err = file_stream_respond(req, file, file_size, &info);
         if (err != ESP_OK)
-            ESP_LOGE(TAG, "Error sending last chunk for file %s: %s", req->uri, esp_err_to_name(err));
+            ESP_LOGE(TAG, "Error sending file %s: %s", buf, esp_err_to_name(err));
     }
 
     fclose(file);
     free(buf);
 
-    return ESP_OK;
+    return err;
+}
+
+// Catch-all GET handler for every static file, disk or memory.
+static esp_err_t resp_static_file(httpd_req_t* req)
+{
+    char url[sizeof(req->uri)];
+    snprintf(url, sizeof(url), "%s", req->uri);
+    remove_query_parameters(url);
+
+    const web_route_t* route = web_index_find(url);
+    if (route == NULL)
+    {
+        ESP_LOGW(TAG, "No static file for %s", url);
+        return httpd_resp_send_404(req);
+    }
+
+    if (route->memory_variants != 0)
+    {
+        serviceweb_set_content_type(req, url);
+        return resp_memory_file(req, route);
+    }
+    return resp_disk_file(req, url, route);
 }
 
 //-- Parameter handling --------------------------------------------------------
@@ -894,61 +968,21 @@ exit:
 
 void serviceweb_register_files(const char* basePath, const char* path)
 {
-    struct dirent* entry;
-    struct stat statbuf;
-    char* fullPath = (char*)malloc(10000);
-
-    DIR* dp = opendir(path);
-    if (dp == NULL)
-    {
-        printf("Unable to open directory %s: %s", path, strerror(errno));
-        free(fullPath);
-        return;
-    }
-
-    while ((entry = readdir(dp)) != NULL)
-    {
-        if (strcmp(".", entry->d_name) == 0 || strcmp("..", entry->d_name) == 0)
-        {
-            continue;
-        }
-
-        snprintf(fullPath, 10000, "%s/%s", path, entry->d_name);
-
-        // Use stat to fill in the statbuf structure with information about the file/directory
-        if (stat(fullPath, &statbuf) == -1)
-        {
-            perror("Failed to get file status");
-            continue;
-        }
-
-        // If the entry is a directory, recurse into it
-        if (S_ISDIR(statbuf.st_mode))
-        {
-            serviceweb_register_files(basePath, fullPath);
-        }
-        else
-        {
-            // Register URL for files, adjusting the path as before
-            httpss_register_url(fullPath + strlen(basePath), false, resp_disk_file, HTTP_GET, NULL);
-
-            // If the url ends with .gz, register the url without the .gz
-            if (strstr(fullPath, ".gz") != NULL)
-            {
-                char* dot = strrchr(fullPath, '.');
-                *dot = '\0';
-                httpss_register_url(fullPath + strlen(basePath), false, resp_disk_file, HTTP_GET, NULL);
-            }
-        }
-    }
-    free(fullPath);
-    closedir(dp);
+    web_index_scan(basePath, path);
+    ESP_LOGI(TAG, "%u static files indexed", (unsigned)web_index_size());
 }
 
 bool serviceweb_register_memory_file(const char* path, const uint8_t* start, const uint8_t* end, bool gzip)
 {
-    file_get_map[path] = { start, end, gzip };
-    return httpss_register_url(path, false, resp_memory_file, HTTP_GET, NULL);
+    return serviceweb_register_memory_variant(path, start, end, gzip ? SERVICEWEB_ENCODING_GZIP : SERVICEWEB_ENCODING_IDENTITY);
+}
+
+bool serviceweb_register_memory_variant(const char* path, const uint8_t* start, const uint8_t* end, serviceweb_encoding_t encoding)
+{
+    if (encoding < SERVICEWEB_ENCODING_IDENTITY || encoding >= WEB_ENCODING_COUNT)
+        return false;
+    web_index_add_memory_file(path, start, end, encoding);
+    return true;
 }
 
 void serviceweb_init(pp_evloop_t* evloop, char* buffer, size_t size, char* rxbuf, size_t rxsize, const char* root)
@@ -965,15 +999,25 @@ void serviceweb_init(pp_evloop_t* evloop, char* buffer, size_t size, char* rxbuf
 
 void serviceweb_start(void)
 {
+    worker_pool_start();
+    nvs_cache_init();
+
     httpss_register_url("/ws", true, ws_handler, HTTP_GET, NULL);
     httpss_register_url("/update/web", false, web_post_handler, HTTP_POST, NULL);
     httpss_register_url("/update/firmware", false, ota_post_handler, HTTP_POST, NULL);
+    httpss_register_url("/update/bundle", false, ota_bundle_handler, HTTP_POST, NULL);
+    httpss_register_url("/update/status", false, ota_get_status, HTTP_GET, NULL);
+    ota_session_register();
     httpss_register_url("/metrics", false, sysmon_get_handler, HTTP_GET, NULL);
+    httpss_register_url("/metrics/openmetrics", false, sysmon_get_openmetrics, HTTP_GET, NULL);
     httpss_register_url("/info", false, sysmon_get_info, HTTP_GET, NULL);
     httpss_register_url("/partition", false, sysmon_get_partition, HTTP_GET, NULL);
 
     start_api_server();
 
+    // Registered last so that every other GET route is matched before it.
+    httpss_register_url("/*", false, resp_static_file, HTTP_GET, NULL);
+
     ESP_ERROR_CHECK(esp_event_handler_instance_register(ESP_HTTP_SERVER_EVENT, HTTP_SERVER_EVENT_ON_CONNECTED, &evloop_http_event, NULL, NULL));
     ESP_ERROR_CHECK(esp_event_handler_instance_register(ESP_HTTP_SERVER_EVENT, HTTP_SERVER_EVENT_DISCONNECTED, &evloop_http_event, NULL, NULL));
     ESP_ERROR_CHECK(esp_event_handler_instance_register_with(evloop->loop_handle, evloop->base, CMD_SOCKET_CLOSED, &evloop_http_event, NULL, NULL));
@@ -1,15 +1,25 @@
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
 #include <memory>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
 #include <esp_log.h>
 #include <esp_app_desc.h>
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
 #include "esp_http_server.h"
 #include "nvs.h"
 #include "pp.h"
 #include "ethernet.h"
 #include "serviceweb.h"
+#include "resp_stream.hpp"
+#include "nvs_cache.hpp"
+#include "worker_pool.hpp"
+#include "web_index.hpp"
 
 static const char *nvs_namespace = "";
 static const char *TAG = "SYSMON";
@@ -48,130 +58,114 @@ static const char *HTML_DOC_BODY_TO_END = "<script type=\"text/javascript\">\
     for(var i = 0; i < el.length; i++)\
         el[i].innerHTML = JSON.stringify(JSON.parse(el[i].innerHTML), undefined, 4);\
 </script></body></html>";
+
+typedef struct
+{
+    const char *name;
+    const char *label; // For /metrics/openmetrics, NULL to leave out
+    uint32_t caps;
+} heap_caps_entry_t;
+
+static const heap_caps_entry_t heap_caps_table[] = {
+    {"Executable", "exec", MALLOC_CAP_EXEC},
+    {"32 Bit", "32bit", MALLOC_CAP_32BIT},
+    {"8 Bit", "8bit", MALLOC_CAP_8BIT},
+    {"DMA", "dma", MALLOC_CAP_DMA},
+    {"SPIRAM", "spiram", MALLOC_CAP_SPIRAM},
+    {"Internal", "internal", MALLOC_CAP_INTERNAL},
+    {"Default", "default", MALLOC_CAP_DEFAULT},
+    {"IRAM 8 Bit", "iram_8bit", MALLOC_CAP_IRAM_8BIT},
+    {"Retention", "retention", MALLOC_CAP_RETENTION},
+    {"RTCRAM", "rtcram", MALLOC_CAP_RTCRAM},
+    {"Invalid", NULL, 0},
+};
+#define HEAP_CAPS_COUNT (sizeof(heap_caps_table) / sizeof(heap_caps_table[0]))
+
 // static pp_t pp_wsdata;
 // static httpd_handle_t server = NULL;
 // static int open_sockets = 0;
 
-static bool nvs_open_storage(nvs_open_mode_t open_mode, nvs_handle_t *h)
-{
-    esp_err_t err = nvs_open(nvs_namespace, open_mode, h);
-    if (ESP_OK == err)
-        return true;
-    ESP_LOGE(TAG, "%s: %s - (%s)", __func__, nvs_namespace, esp_err_to_name(err));
-    return false;
-}
+// Size of a string in nvs_namespace including the NUL, 0 when not stored.
 static size_t nvs_get_size(const char *mem_name)
 {
-    size_t required_size = 0;
     if (mem_name == NULL)
     {
         ESP_LOGE(TAG, "%s: Pointer to name is NULL", __func__);
         return 0;
     }
 
-    nvs_handle_t h;
-    if (nvs_open_storage(NVS_READONLY, &h))
-        nvs_get_str(h, mem_name, NULL, &required_size);
-    return required_size;
+    nvs_snapshot_ptr_t snapshot = nvs_cache_get(nvs_namespace);
+    const nvs_item_t *item = snapshot ? nvs_cache_find(snapshot.get(), mem_name) : NULL;
+    if (item == NULL || item->type != NVS_TYPE_STR)
+        return 0;
+    return item->value.size() + 1;
 }
 
-static void print_buttons(httpd_req_t *req, char *buf, size_t bufsize)
+static void print_buttons(resp_stream_t *out, char *buf, size_t bufsize)
 {
     const char *p = ethernet_get_ip();
 
     snprintf(buf, bufsize, HTML_BUTTON, p, "nvs=true", "Configuration");
-    httpd_resp_send_chunk(req, buf, HTTPD_RESP_USE_STRLEN);
+    resp_stream_send(out, buf, HTTPD_RESP_USE_STRLEN);
     snprintf(buf, bufsize, HTML_BUTTON, p, "public=true", "Public Parameters");
-    httpd_resp_send_chunk(req, buf, HTTPD_RESP_USE_STRLEN);
+    resp_stream_send(out, buf, HTTPD_RESP_USE_STRLEN);
     // snprintf(buf, bufsize, HTML_BUTTON, p, "web_clients=true", "Web Clients");
-    // httpd_resp_send_chunk(req, buf, HTTPD_RESP_USE_STRLEN);
+    // resp_stream_send(out, buf, HTTPD_RESP_USE_STRLEN);
     snprintf(buf, bufsize, HTML_BUTTON, p, "tasks=1", "Tasks");
-    httpd_resp_send_chunk(req, buf, HTTPD_RESP_USE_STRLEN);
+    resp_stream_send(out, buf, HTTPD_RESP_USE_STRLEN);
     snprintf(buf, bufsize, HTML_BUTTON, p, "memory=1", "Memory");
-    httpd_resp_send_chunk(req, buf, HTTPD_RESP_USE_STRLEN);
+    resp_stream_send(out, buf, HTTPD_RESP_USE_STRLEN);
     // snprintf(buf, bufsize, HTML_BUTTON, p, "discovery=1", "Discovery");
-    // httpd_resp_send_chunk(req, buf, HTTPD_RESP_USE_STRLEN);
+    // resp_stream_send(out, buf, HTTPD_RESP_USE_STRLEN);
 }
 
-static void print_nvs_configuration(httpd_req_t *req, char *buf, size_t bufsize)
+static void print_nvs_configuration(resp_stream_t *out, char *buf, size_t bufsize)
 {
     const char *nvs_header = "<tr><th>Namespace</th><th>Name</th><th>Type</th><th>Value</th></tr>";
-    httpd_resp_send_chunk(req, hdr_nvs_var_begin, HTTPD_RESP_USE_STRLEN);
-    httpd_resp_send_chunk(req, nvs_header, HTTPD_RESP_USE_STRLEN);
-    nvs_handle_t h;
+    resp_stream_send(out, hdr_nvs_var_begin, HTTPD_RESP_USE_STRLEN);
+    resp_stream_send(out, nvs_header, HTTPD_RESP_USE_STRLEN);
 
-    // TODO: get the namespace names from the nvsstorage.h file
-    if (ESP_OK == nvs_open(nvs_namespace, NVS_READONLY, &h))
+    nvs_snapshot_ptr_t snapshot = nvs_cache_get(nvs_namespace);
+    for (size_t i = 0; snapshot && i < snapshot->items.size(); i++)
     {
-        nvs_iterator_t it;
-        esp_err_t err = nvs_entry_find("nvs", NULL, NVS_TYPE_ANY, &it);
-        while (err == ESP_OK)
+        const nvs_item_t &item = snapshot->items[i];
+        const nvs_type_info_t *t = nvs_type_info(item.type);
+        if (item.type == NVS_TYPE_STR)
         {
-            nvs_entry_info_t info;
-            nvs_entry_info(it, &info);
-            err = nvs_entry_next(&it);
+            // Sent as it is, a string can be longer than buf.
+            snprintf(buf, bufsize, "<tr><td>%s</td><td>%s</td><td>String</td><td><pre class=\"json\">", nvs_namespace, item.key.c_str());
+            resp_stream_send(out, buf, HTTPD_RESP_USE_STRLEN);
+            resp_stream_send(out, item.value.data(), item.value.size());
+            resp_stream_send(out, "</pre></td></tr>", HTTPD_RESP_USE_STRLEN);
+            continue;
+        }
 
-            if (info.type == NVS_TYPE_STR)
-            {
-                char s[bufsize - 100];
-                size_t len = bufsize;
-                nvs_get_str(h, info.key, s, &len);
-                snprintf(buf, bufsize, "<tr><td>%s</td><td>%s</td><td>String</td><td><pre class=\"json\">%s</pre></td></tr>", info.namespace_name, info.key, s);
-            }
-            else if (info.type == NVS_TYPE_U8)
-            {
-                uint8_t i = 0;
-                nvs_get_u8(h, info.key, &i);
-                snprintf(buf, bufsize, "<tr><td>%s</td><td>%s</td><td>int8_t</td><td>%d</td></tr>", info.namespace_name, info.key, i);
-            }
-            else if (info.type == NVS_TYPE_U16)
-            {
-                uint16_t i = 0;
-                nvs_get_u16(h, info.key, &i);
-                snprintf(buf, bufsize, "<tr><td>%s</td><td>%s</td><td>int32_t</td><td>%d</td></tr>", info.namespace_name, info.key, i);
-            }
-            else if (info.type == NVS_TYPE_U32)
-            {
-                uint32_t i = 0;
-                nvs_get_u32(h, info.key, &i);
-                snprintf(buf, bufsize, "<tr><td>%s</td><td>%s</td><td>int32_t</td><td>%lu</td></tr>", info.namespace_name, info.key, i);
-            }
-            else if (info.type == NVS_TYPE_BLOB)
-            {
-                float f = 0;
-                size_t size = sizeof(float);
-                nvs_get_blob(h, info.key, &f, &size);
-                snprintf(buf, bufsize, "<tr><td>%s</td><td>%s</td><td>Float</td><td>%f</td></tr>", info.namespace_name, info.key, f);
-            }
-            else if (info.type == NVS_TYPE_I32)
-            {
-                int32_t i = 0;
-                nvs_get_i32(h, info.key, &i);
-                snprintf(buf, bufsize, "<tr><td>%s</td><td>%s</td><td>int32_t</td><td>%ld</td></tr>", info.namespace_name, info.key, i);
-            }
-            else if (info.type == NVS_TYPE_I64)
-            {
-                int64_t i = 0;
-                nvs_get_i64(h, info.key, &i);
-                snprintf(buf, bufsize, "<tr><td>%s</td><td>%s</td><td>int32_t</td><td>%lld</td></tr>", info.namespace_name, info.key, i);
-            }
-            else
-            {
-                snprintf(buf, bufsize, "<tr><td>%s</td><td>%s</td><td>int32_t</td><td>Unknown</td></tr>", info.namespace_name, info.key);
-            }
-            httpd_resp_send_chunk(req, buf, HTTPD_RESP_USE_STRLEN);
-        };
-        nvs_close(h);
+        if (item.type == NVS_TYPE_BLOB && item.value.size() == sizeof(float))
+        {
+            // Floats are stored as 4 byte blobs
+            float f;
+            memcpy(&f, item.value.data(), sizeof(f));
+            snprintf(buf, bufsize, "<tr><td>%s</td><td>%s</td><td>Float</td><td>%f</td></tr>", nvs_namespace, item.key.c_str(), f);
+        }
+        else if (item.type == NVS_TYPE_BLOB)
+            snprintf(buf, bufsize, "<tr><td>%s</td><td>%s</td><td>Blob</td><td>%u bytes</td></tr>", nvs_namespace, item.key.c_str(), (unsigned)item.value.size());
+        else if (t->is_signed)
+            snprintf(buf, bufsize, "<tr><td>%s</td><td>%s</td><td>int%d_t</td><td>%lld</td></tr>", nvs_namespace, item.key.c_str(), 8 * t->size,
+                     (long long)nvs_int_value(t, item.value));
+        else
+            snprintf(buf, bufsize, "<tr><td>%s</td><td>%s</td><td>uint%d_t</td><td>%llu</td></tr>", nvs_namespace, item.key.c_str(), 8 * t->size,
+                     (unsigned long long)nvs_int_value(t, item.value));
+        resp_stream_send(out, buf, HTTPD_RESP_USE_STRLEN);
     }
 
-    httpd_resp_send_chunk(req, hdr_table_end, HTTPD_RESP_USE_STRLEN);
+    resp_stream_send(out, hdr_table_end, HTTPD_RESP_USE_STRLEN);
 }
 
-static void print_public_parameters(httpd_req_t *req, char *buf, size_t bufsize)
+static void print_public_parameters(resp_stream_t *out, char *buf, size_t bufsize)
 {
     const char *pp_header = "<tr><th>Nr.</th><th>Type</th><th>Name</th><th>Owner</th><th>Subscriptions</th><th>Value</th></tr>";
-    httpd_resp_send_chunk(req, hdr_public_var_begin, HTTPD_RESP_USE_STRLEN);
-    httpd_resp_send_chunk(req, pp_header, HTTPD_RESP_USE_STRLEN);
+    resp_stream_send(out, hdr_public_var_begin, HTTPD_RESP_USE_STRLEN);
+    resp_stream_send(out, pp_header, HTTPD_RESP_USE_STRLEN);
     pp_info_t info;
     int index = 0;
     size_t strBufLen = 1024;
@@ -224,14 +218,14 @@ static void print_public_parameters(httpd_req_t *req, char *buf, size_t bufsize)
                      index, info.name, info.owner ? info.owner->base : noBaseStr);
             break;
         }
-        httpd_resp_send_chunk(req, buf, HTTPD_RESP_USE_STRLEN);
+        resp_stream_send(out, buf, HTTPD_RESP_USE_STRLEN);
         index++;
         index = pp_get_info(index, &info);
     }
-    httpd_resp_send_chunk(req, hdr_table_end, HTTPD_RESP_USE_STRLEN);
+    resp_stream_send(out, hdr_table_end, HTTPD_RESP_USE_STRLEN);
 }
 
-static void print_tasks(httpd_req_t *req, char *buf, size_t bufsize, const char *param)
+static void print_tasks(resp_stream_t *out, char *buf, size_t bufsize, const char *param)
 {
     TaskStatus_t *pxTaskStatusArray;
     UBaseType_t uxArraySize, x;
@@ -255,10 +249,10 @@ static void print_tasks(httpd_req_t *req, char *buf, size_t bufsize, const char
         {
             const char *task_state[6] = {"Running", "Ready", "Blocked", "Suspended", "Deleted", "Invalid"};
             const char *tasks_header = "<tr><th>Name</th><th>Nr.</th><th>State</th><th>Current Priority</th><th>Base Priority</th><th>Run Time (%)</th><th>Stack High</th><th>Core</th></tr>";
-            httpd_resp_send_chunk(req, hdr_tasks_begin, HTTPD_RESP_USE_STRLEN);
+            resp_stream_send(out, hdr_tasks_begin, HTTPD_RESP_USE_STRLEN);
             snprintf(buf, bufsize, "<p>Free Heap Size: %d</p>", xPortGetFreeHeapSize());
-            httpd_resp_send_chunk(req, buf, HTTPD_RESP_USE_STRLEN);
-            httpd_resp_send_chunk(req, tasks_header, HTTPD_RESP_USE_STRLEN);
+            resp_stream_send(out, buf, HTTPD_RESP_USE_STRLEN);
+            resp_stream_send(out, tasks_header, HTTPD_RESP_USE_STRLEN);
             for (x = 0; x < uxArraySize; x++)
             {
                 TaskStatus_t *pxTaskStatus = &pxTaskStatusArray[x];
@@ -277,10 +271,10 @@ static void print_tasks(httpd_req_t *req, char *buf, size_t bufsize, const char
                          ulStatsAsPercentage,
                          pxTaskStatus->usStackHighWaterMark/*,
                          pxTaskStatus->xCoreID*/);
-                httpd_resp_send_chunk(req, buf, HTTPD_RESP_USE_STRLEN);
+                resp_stream_send(out, buf, HTTPD_RESP_USE_STRLEN);
                 buf += strlen((char *)buf);
             }
-            httpd_resp_send_chunk(req, hdr_table_end, HTTPD_RESP_USE_STRLEN);
+            resp_stream_send(out, hdr_table_end, HTTPD_RESP_USE_STRLEN);
         }
         else
             ESP_LOGE(TAG, "No runtime info, Set CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS to 1 in sdkconfig");
@@ -291,49 +285,292 @@ static void print_tasks(httpd_req_t *req, char *buf, size_t bufsize, const char
         ESP_LOGE(TAG, "Error allocating memory for pxTaskStatusArray");
 }
 
-// static void print_web_clients(httpd_req_t *req, char *buf, size_t bufsize)
+// static void print_web_clients(resp_stream_t *out, char *buf, size_t bufsize)
 // {
-//     httpd_resp_send_chunk(req, "<h3>System Monitor - Web Subscriptions</h3><table>", HTTPD_RESP_USE_STRLEN);
+//     resp_stream_send(out, "<h3>System Monitor - Web Subscriptions</h3><table>", HTTPD_RESP_USE_STRLEN);
 //     snprintf(buf, bufsize, "<tr><th>Web subscriptions</th><td>%d</td></tr>", pp_get_nr_web_subscribers());
-//     httpd_resp_send_chunk(req, buf, HTTPD_RESP_USE_STRLEN);
+//     resp_stream_send(out, buf, HTTPD_RESP_USE_STRLEN);
 //     snprintf(buf, bufsize, "<tr><th>Open Sockets</th><td>%d</td></tr>", open_sockets);
-//     httpd_resp_send_chunk(req, buf, HTTPD_RESP_USE_STRLEN);
-//     httpd_resp_send_chunk(req, hdr_table_end, HTTPD_RESP_USE_STRLEN);
+//     resp_stream_send(out, buf, HTTPD_RESP_USE_STRLEN);
+//     resp_stream_send(out, hdr_table_end, HTTPD_RESP_USE_STRLEN);
 // }
 
-static void print_memory(httpd_req_t *req, char *buf, size_t bufsize)
+static void print_memory(resp_stream_t *out, char *buf, size_t bufsize)
 {
-    const char *mem_name[11] = {"Executable", "32 Bit", "8 Bit", "DMA", "SPIRAM", "Internal", "Default", "IRAM 8 Bit", "Retention", "RTCRAM", "Invalid"};
-    uint32_t caps[11] = {MALLOC_CAP_EXEC, MALLOC_CAP_32BIT, MALLOC_CAP_8BIT, MALLOC_CAP_DMA, MALLOC_CAP_SPIRAM, MALLOC_CAP_INTERNAL, MALLOC_CAP_DEFAULT, MALLOC_CAP_IRAM_8BIT, MALLOC_CAP_RETENTION, MALLOC_CAP_RTCRAM, 0};
-    httpd_resp_send_chunk(req, hdr_memory_begin, HTTPD_RESP_USE_STRLEN);
+    resp_stream_send(out, hdr_memory_begin, HTTPD_RESP_USE_STRLEN);
     snprintf(buf, bufsize, "<tr> <th>Memory Name</th> <th>Total Free Bytes</th> <th>Total Allocated Bytes</th> <th>Largest Free Block</th> <th>Minimum Free Bytes</th><th>Allocated Blocks</th> <th>Free Blocks</th> <th>Total Blocks</th> </tr>");
-    httpd_resp_send_chunk(req, buf, HTTPD_RESP_USE_STRLEN);
-    for (int i = 0; i < 11; i++)
+    resp_stream_send(out, buf, HTTPD_RESP_USE_STRLEN);
+    for (auto &mem : heap_caps_table)
     {
         multi_heap_info_t info;
-        heap_caps_get_info(&info, caps[i]);
+        heap_caps_get_info(&info, mem.caps);
         snprintf(buf, bufsize, "<tr><th>%s</th><td>%d</td><td>%d</td><td>%d</td><td>%d</td><td>%d</td><td>%d</td><td>%d</td></tr>",
-                 mem_name[i], info.total_free_bytes, info.total_allocated_bytes, info.largest_free_block, info.minimum_free_bytes, info.allocated_blocks, info.free_blocks, info.total_blocks);
-        httpd_resp_send_chunk(req, buf, HTTPD_RESP_USE_STRLEN);
+                 mem.name, info.total_free_bytes, info.total_allocated_bytes, info.largest_free_block, info.minimum_free_bytes, info.allocated_blocks, info.free_blocks, info.total_blocks);
+        resp_stream_send(out, buf, HTTPD_RESP_USE_STRLEN);
+    }
+    resp_stream_send(out, hdr_table_end, HTTPD_RESP_USE_STRLEN);
+
+    resp_stream_send(out, "<p><b>Total Free Bytes:</b> Total free bytes in the heap.", HTTPD_RESP_USE_STRLEN);
+    resp_stream_send(out, "<p><b>Total Allocated Bytes:</b> Total bytes allocated to data in the heap.", HTTPD_RESP_USE_STRLEN);
+    resp_stream_send(out, "<p><b>Largest Free Block:</b> Size of largest free block in the heap. This is the largest malloc-able size.", HTTPD_RESP_USE_STRLEN);
+    resp_stream_send(out, "<p><b>Minimum Free Bytes:</b> Lifetime minimum free heap size.", HTTPD_RESP_USE_STRLEN);
+    resp_stream_send(out, "<p><b>Allocated Blocks:</b> Number of (variable size) blocks allocated in the heap.", HTTPD_RESP_USE_STRLEN);
+    resp_stream_send(out, "<p><b>Free Blocks:</b> Number of (variable size) free blocks in the heap.", HTTPD_RESP_USE_STRLEN);
+    resp_stream_send(out, "<p><b>Total Blocks:</b> Total number of (variable size) blocks in the heap.", HTTPD_RESP_USE_STRLEN);
+}
+
+//-- OpenMetrics -------------------------------------------------------------------
+//
+// GET /metrics/openmetrics, or /metrics with "Accept: application/openmetrics-text",
+// returns the same figures as the pages above in OpenMetrics text format for
+// Prometheus. The body is written line by line into a buffer on the stack and
+// sent in chunks, nothing is allocated while scraping.
+
+#define METRICS_BUF 1024
+#define METRICS_MAX_TASKS 40 // More tasks and the task metrics are left out
+#define METRICS_CONTENT_TYPE "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+typedef struct
+{
+    httpd_req_t *req;
+    esp_err_t err;
+    size_t len;
+    char buf[METRICS_BUF];
+} metrics_out_t;
+
+// Only used from the httpd task, which runs one handler at a time.
+static TaskStatus_t metrics_tasks[METRICS_MAX_TASKS];
+
+static void metrics_flush(metrics_out_t *m)
+{
+    if (m->err == ESP_OK && m->len > 0)
+        m->err = httpd_resp_send_chunk(m->req, m->buf, m->len);
+    m->len = 0;
+}
+
+static void metrics_printf(metrics_out_t *m, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void metrics_printf(metrics_out_t *m, const char *fmt, ...)
+{
+    for (int attempt = 0; attempt < 2 && m->err == ESP_OK; attempt++)
+    {
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(m->buf + m->len, sizeof(m->buf) - m->len, fmt, args);
+        va_end(args);
+        if (n < 0)
+            return;
+        if (m->len + n < sizeof(m->buf))
+        {
+            m->len += n;
+            return;
+        }
+        // Did not fit, send what is there and write the line again. A line
+        // longer than the whole buffer goes out cut.
+        if (attempt == 0 && m->len > 0)
+            metrics_flush(m);
+        else
+        {
+            m->len = sizeof(m->buf) - 1;
+            return;
+        }
+    }
+}
+
+static void metrics_family(metrics_out_t *m, const char *name, const char *type, const char *help)
+{
+    metrics_printf(m, "# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+// Label values escaped as OpenMetrics wants them, cut to fit.
+static const char *metrics_label(const char *in, char *out, size_t size)
+{
+    size_t n = 0;
+    for (; in && *in && n + 3 < size; in++)
+    {
+        if (*in == '\\' || *in == '"' || *in == '\n')
+        {
+            out[n++] = '\\';
+            out[n++] = *in == '\n' ? 'n' : *in;
+        }
+        else
+            out[n++] = *in;
+    }
+    out[n] = 0;
+    return out;
+}
+
+static void metrics_memory(metrics_out_t *m)
+{
+    static const struct
+    {
+        const char *name;
+        const char *help;
+        size_t offset;
+    } fields[] = {
+        {"esp_heap_free_bytes", "Total free bytes in the heap.", offsetof(multi_heap_info_t, total_free_bytes)},
+        {"esp_heap_allocated_bytes", "Total bytes allocated to data in the heap.", offsetof(multi_heap_info_t, total_allocated_bytes)},
+        {"esp_heap_largest_free_block_bytes", "Size of the largest free block, the largest malloc-able size.", offsetof(multi_heap_info_t, largest_free_block)},
+        {"esp_heap_minimum_free_bytes", "Lifetime minimum free heap size.", offsetof(multi_heap_info_t, minimum_free_bytes)},
+        {"esp_heap_allocated_blocks", "Number of blocks allocated in the heap.", offsetof(multi_heap_info_t, allocated_blocks)},
+        {"esp_heap_free_blocks", "Number of free blocks in the heap.", offsetof(multi_heap_info_t, free_blocks)},
+        {"esp_heap_blocks", "Total number of blocks in the heap.", offsetof(multi_heap_info_t, total_blocks)},
+    };
+
+    // Read every capability once, the samples of a family have to be together.
+    multi_heap_info_t info[HEAP_CAPS_COUNT];
+    for (size_t i = 0; i < HEAP_CAPS_COUNT; i++)
+    {
+        if (heap_caps_table[i].label)
+            heap_caps_get_info(&info[i], heap_caps_table[i].caps);
+    }
+    for (auto &field : fields)
+    {
+        metrics_family(m, field.name, "gauge", field.help);
+        for (size_t i = 0; i < HEAP_CAPS_COUNT; i++)
+        {
+            if (heap_caps_table[i].label)
+                metrics_printf(m, "%s{caps=\"%s\"} %u\n", field.name, heap_caps_table[i].label,
+                               (unsigned)*(const size_t *)((const char *)&info[i] + field.offset));
+        }
+    }
+}
+
+static void metrics_tasks_state(metrics_out_t *m)
+{
+    uint32_t total_runtime = 0;
+    UBaseType_t count = uxTaskGetNumberOfTasks();
+    metrics_family(m, "freertos_tasks", "gauge", "Number of tasks.");
+    metrics_printf(m, "freertos_tasks %u\n", (unsigned)count);
+    if (count > METRICS_MAX_TASKS)
+    {
+        ESP_LOGW(TAG, "%u tasks, only %d fit for metrics", (unsigned)count, METRICS_MAX_TASKS);
+        return;
+    }
+    count = uxTaskGetSystemState(metrics_tasks, METRICS_MAX_TASKS, &total_runtime);
+
+    char name[2 * configMAX_TASK_NAME_LEN + 1];
+    metrics_family(m, "freertos_runtime", "counter", "Run time clock, microseconds with the default esp_timer clock. Wraps at 2^32.");
+    metrics_printf(m, "freertos_runtime_total %lu\n", (unsigned long)total_runtime);
+    metrics_family(m, "freertos_task_runtime", "counter", "Run time of the task in ticks of the run time clock. Wraps at 2^32.");
+    for (UBaseType_t i = 0; i < count; i++)
+        metrics_printf(m, "freertos_task_runtime_total{task=\"%s\",id=\"%u\"} %lu\n", metrics_label(metrics_tasks[i].pcTaskName, name, sizeof(name)),
+                       (unsigned)metrics_tasks[i].xTaskNumber, (unsigned long)metrics_tasks[i].ulRunTimeCounter);
+    metrics_family(m, "freertos_task_stack_high_water_mark_bytes", "gauge", "Least free stack the task has had.");
+    for (UBaseType_t i = 0; i < count; i++)
+        metrics_printf(m, "freertos_task_stack_high_water_mark_bytes{task=\"%s\",id=\"%u\"} %lu\n", metrics_label(metrics_tasks[i].pcTaskName, name, sizeof(name)),
+                       (unsigned)metrics_tasks[i].xTaskNumber, (unsigned long)metrics_tasks[i].usStackHighWaterMark);
+    metrics_family(m, "freertos_task_priority", "gauge", "Current priority of the task.");
+    for (UBaseType_t i = 0; i < count; i++)
+        metrics_printf(m, "freertos_task_priority{task=\"%s\",id=\"%u\"} %u\n", metrics_label(metrics_tasks[i].pcTaskName, name, sizeof(name)),
+                       (unsigned)metrics_tasks[i].xTaskNumber, (unsigned)metrics_tasks[i].uxCurrentPriority);
+}
+
+// Numbers and booleans only, other types have no single value.
+static void metrics_public_parameters(metrics_out_t *m)
+{
+    char name[96];
+    char owner[64];
+    pp_info_t info;
+    metrics_family(m, "serviceweb_parameter", "gauge", "Value of a public parameter, booleans as 0 and 1.");
+    for (int index = pp_get_info(0, &info); index != -1; index = pp_get_info(index + 1, &info))
+    {
+        if (info.valueptr == NULL)
+            continue;
+        const char *fmt = "serviceweb_parameter{name=\"%s\",owner=\"%s\"} ";
+        metrics_label(info.name, name, sizeof(name));
+        metrics_label(info.owner ? info.owner->base : "", owner, sizeof(owner));
+        switch (info.type)
+        {
+        case TYPE_INT32:
+            metrics_printf(m, fmt, name, owner);
+            metrics_printf(m, "%ld\n", (long)*(int32_t *)info.valueptr);
+            break;
+        case TYPE_INT64:
+            metrics_printf(m, fmt, name, owner);
+            metrics_printf(m, "%lld\n", (long long)*(int64_t *)info.valueptr);
+            break;
+        case TYPE_BOOL:
+            metrics_printf(m, fmt, name, owner);
+            metrics_printf(m, "%d\n", *(bool *)info.valueptr ? 1 : 0);
+            break;
+        case TYPE_FLOAT:
+        {
+            float f = *(float *)info.valueptr;
+            metrics_printf(m, fmt, name, owner);
+            if (isnan(f))
+                metrics_printf(m, "NaN\n");
+            else if (isinf(f))
+                metrics_printf(m, "%s\n", f > 0 ? "+Inf" : "-Inf");
+            else
+                metrics_printf(m, "%.9g\n", f);
+            break;
+        }
+        default:
+            break;
+        }
     }
-    httpd_resp_send_chunk(req, hdr_table_end, HTTPD_RESP_USE_STRLEN);
-
-    httpd_resp_send_chunk(req, "<p><b>Total Free Bytes:</b> Total free bytes in the heap.", HTTPD_RESP_USE_STRLEN);
-    httpd_resp_send_chunk(req, "<p><b>Total Allocated Bytes:</b> Total bytes allocated to data in the heap.", HTTPD_RESP_USE_STRLEN);
-    httpd_resp_send_chunk(req, "<p><b>Largest Free Block:</b> Size of largest free block in the heap. This is the largest malloc-able size.", HTTPD_RESP_USE_STRLEN);
-    httpd_resp_send_chunk(req, "<p><b>Minimum Free Bytes:</b> Lifetime minimum free heap size.", HTTPD_RESP_USE_STRLEN);
-    httpd_resp_send_chunk(req, "<p><b>Allocated Blocks:</b> Number of (variable size) blocks allocated in the heap.", HTTPD_RESP_USE_STRLEN);
-    httpd_resp_send_chunk(req, "<p><b>Free Blocks:</b> Number of (variable size) free blocks in the heap.", HTTPD_RESP_USE_STRLEN);
-    httpd_resp_send_chunk(req, "<p><b>Total Blocks:</b> Total number of (variable size) blocks in the heap.", HTTPD_RESP_USE_STRLEN);
+}
+
+static void metrics_serviceweb(metrics_out_t *m)
+{
+    worker_pool_stats_t stats;
+    worker_pool_get_stats(&stats);
+    metrics_family(m, "serviceweb_worker_jobs", "counter", "Requests run on a worker task.");
+    metrics_printf(m, "serviceweb_worker_jobs_total %lu\n", (unsigned long)stats.done);
+    metrics_family(m, "serviceweb_worker_failed", "counter", "Worker requests that ended with an error.");
+    metrics_printf(m, "serviceweb_worker_failed_total %lu\n", (unsigned long)stats.failed);
+    metrics_family(m, "serviceweb_worker_rejected", "counter", "Requests refused because the worker queue was full.");
+    metrics_printf(m, "serviceweb_worker_rejected_total %lu\n", (unsigned long)stats.rejected);
+    metrics_family(m, "serviceweb_workers_active", "gauge", "Workers running a request.");
+    metrics_printf(m, "serviceweb_workers_active %d\n", stats.active);
+    metrics_family(m, "serviceweb_worker_queued", "gauge", "Requests waiting for a worker.");
+    metrics_printf(m, "serviceweb_worker_queued{priority=\"high\"} %d\n", stats.queued[WORKER_PRIORITY_HIGH]);
+    metrics_printf(m, "serviceweb_worker_queued{priority=\"low\"} %d\n", stats.queued[WORKER_PRIORITY_LOW]);
+    metrics_family(m, "serviceweb_static_routes", "gauge", "Files in the static file index.");
+    metrics_printf(m, "serviceweb_static_routes %u\n", (unsigned)web_index_size());
+    metrics_family(m, "esp_uptime_seconds", "gauge", "Time since boot.");
+    metrics_printf(m, "esp_uptime_seconds %.3f\n", esp_timer_get_time() / 1e6);
+}
+
+esp_err_t sysmon_get_openmetrics(httpd_req_t *req)
+{
+    metrics_out_t m;
+    m.req = req;
+    m.err = ESP_OK;
+    m.len = 0;
+    httpd_resp_set_type(req, METRICS_CONTENT_TYPE);
+    metrics_memory(&m);
+    metrics_tasks_state(&m);
+    metrics_public_parameters(&m);
+    metrics_serviceweb(&m);
+    metrics_printf(&m, "# EOF\n");
+    metrics_flush(&m);
+    if (m.err == ESP_OK)
+        m.err = httpd_resp_send_chunk(req, NULL, 0);
+    return m.err;
+}
+
+static bool accepts_openmetrics(httpd_req_t *req)
+{
+    char accept[128];
+    if (httpd_req_get_hdr_value_str(req, "Accept", accept, sizeof(accept)) == ESP_ERR_NOT_FOUND)
+        return false;
+    // A truncated header still holds the first types, Prometheus sends this one first.
+    return strstr(accept, "application/openmetrics-text") != NULL;
 }
 
 esp_err_t sysmon_get_handler(httpd_req_t *req)
 {
+    if (accepts_openmetrics(req))
+        return sysmon_get_openmetrics(req);
+
     const int bufsize = 4096;
     char *buf = (char *)calloc(bufsize, sizeof(char));
+    resp_stream_t out;
 
-    httpd_resp_send_chunk(req, HTML_DOC_START_TO_BODY, HTTPD_RESP_USE_STRLEN);
-    print_buttons(req, buf, bufsize);
+    resp_stream_begin(&out, req);
+    resp_stream_send(&out, HTML_DOC_START_TO_BODY, HTTPD_RESP_USE_STRLEN);
+    print_buttons(&out, buf, bufsize);
 
     const int buf_len = httpd_req_get_url_query_len(req) + 1;
     if (buf_len > 1)
@@ -343,21 +580,21 @@ esp_err_t sysmon_get_handler(httpd_req_t *req)
         {
             char param[32];
             if (httpd_query_key_value(buf1, "nvs", param, sizeof(param)) == ESP_OK)
-                print_nvs_configuration(req, buf, bufsize);
+                print_nvs_configuration(&out, buf, bufsize);
             if (httpd_query_key_value(buf1, "public", param, sizeof(param)) == ESP_OK)
-                print_public_parameters(req, buf, bufsize);
+                print_public_parameters(&out, buf, bufsize);
             // if (httpd_query_key_value(buf1, "web_clients", param, sizeof(param)) == ESP_OK)
-            //     print_web_clients(req, buf, bufsize);
+            //     print_web_clients(&out, buf, bufsize);
             if (httpd_query_key_value(buf1, "tasks", param, sizeof(param)) == ESP_OK)
-                print_tasks(req, buf, bufsize, param);
+                print_tasks(&out, buf, bufsize, param);
             if (httpd_query_key_value(buf1, "memory", param, sizeof(param)) == ESP_OK)
-                print_memory(req, buf, bufsize);
+                print_memory(&out, buf, bufsize);
         }
         free(buf1);
     }
 
-    httpd_resp_send_chunk(req, HTML_DOC_BODY_TO_END, HTTPD_RESP_USE_STRLEN);
-    httpd_resp_send_chunk(req, buf, 0);
+    resp_stream_send(&out, HTML_DOC_BODY_TO_END, HTTPD_RESP_USE_STRLEN);
+    resp_stream_end(&out);
 
     free(buf);
 
@@ -382,7 +619,8 @@ esp_err_t sysmon_get_info(httpd_req_t *req)
              app_desc->time,
              app_desc->idf_ver);
 
-    httpd_resp_send(req, buf, HTTPD_RESP_USE_STRLEN);
+    httpd_resp_set_type(req, "application/json");
+    resp_stream_sendstr(req, buf);
     free(buf);
 
     return ESP_OK;
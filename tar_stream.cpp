@@ -0,0 +1,459 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <string>
+#include <new>
+#include "esp_log.h"
+#include "api_priv.hpp"
+#include "tar_stream.hpp"
+
+static const char* TAG = "TAR_STREAM";
+
+typedef struct __attribute__((packed))
+{
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} tar_header_t;
+
+static_assert(sizeof(tar_header_t) == TAR_BLOCK, "ustar header is one block");
+
+typedef struct
+{
+    tar_output_t output;
+    void* ctx;
+    uint8_t* buf;
+    size_t bufsize;
+    tar_stats_t* stats;
+} tar_t;
+
+static esp_err_t emit(tar_t* t, const void* data, size_t len)
+{
+    t->stats->bytes += len;
+    return t->output(t->ctx, (const uint8_t*)data, len);
+}
+
+static esp_err_t emit_zeros(tar_t* t, size_t len)
+{
+    memset(t->buf, 0, MIN(len, t->bufsize));
+    esp_err_t err = ESP_OK;
+    while (len > 0 && err == ESP_OK)
+    {
+        size_t n = MIN(len, t->bufsize);
+        err = emit(t, t->buf, n);
+        len -= n;
+    }
+    return err;
+}
+
+// ustar holds up to 255 characters, split at a '/' into prefix and name.
+static bool set_path(tar_header_t* h, const std::string& path)
+{
+    if (path.size() <= sizeof(h->name))
+    {
+        memcpy(h->name, path.data(), path.size());
+        return true;
+    }
+    size_t slash = path.find('/', path.size() - sizeof(h->name) - 1);
+    if (slash == std::string::npos || slash == 0 || slash > sizeof(h->prefix) || slash + 1 >= path.size() ||
+        path.size() - slash - 1 > sizeof(h->name))
+        return false;
+    memcpy(h->prefix, path.data(), slash);
+    memcpy(h->name, path.data() + slash + 1, path.size() - slash - 1);
+    return true;
+}
+
+static esp_err_t emit_header(tar_t* t, const std::string& path, char type, size_t size, uint32_t mtime, bool* fits)
+{
+    tar_header_t h = {};
+    *fits = set_path(&h, path);
+    if (!*fits)
+    {
+        ESP_LOGW(TAG, "Path too long for tar, skipped: %s", path.c_str());
+        t->stats->skipped++;
+        return ESP_OK;
+    }
+    snprintf(h.mode, sizeof(h.mode), "%07o", type == '5' ? 0755 : 0644);
+    snprintf(h.uid, sizeof(h.uid), "%07o", 0);
+    snprintf(h.gid, sizeof(h.gid), "%07o", 0);
+    snprintf(h.size, sizeof(h.size), "%011lo", (unsigned long)size);
+    snprintf(h.mtime, sizeof(h.mtime), "%011lo", (unsigned long)mtime);
+    h.typeflag = type;
+    memcpy(h.magic, "ustar", 6);
+    memcpy(h.version, "00", 2);
+
+    // The checksum is taken with its own field set to spaces.
+    memset(h.chksum, ' ', sizeof(h.chksum));
+    unsigned sum = 0;
+    for (size_t i = 0; i < sizeof(h); i++)
+        sum += ((const uint8_t*)&h)[i];
+    snprintf(h.chksum, sizeof(h.chksum), "%06o", sum);
+    h.chksum[7] = ' ';
+    return emit(t, &h, sizeof(h));
+}
+
+// The size in the header is the one from stat. A file that changes while it
+// is read is cut or padded to it, the archive stays well formed.
+static esp_err_t emit_file(tar_t* t, const std::string& path, const std::string& name, const struct stat& st)
+{
+    FILE* f = fopen(path.c_str(), "rb");
+    if (f == NULL)
+    {
+        ESP_LOGW(TAG, "Failed to open %s, skipped", path.c_str());
+        t->stats->skipped++;
+        return ESP_OK;
+    }
+
+    bool fits;
+    size_t size = st.st_size;
+    esp_err_t err = emit_header(t, name, '0', size, st.st_mtime, &fits);
+    size_t done = 0;
+    while (fits && err == ESP_OK && done < size)
+    {
+        size_t n = fread(t->buf, 1, MIN(t->bufsize, size - done), f);
+        if (n == 0)
+            break;
+        err = emit(t, t->buf, n);
+        done += n;
+    }
+    fclose(f);
+    if (!fits || err != ESP_OK)
+        return err;
+
+    if (done < size)
+        ESP_LOGW(TAG, "%s shrank while archived, padded", path.c_str());
+    err = emit_zeros(t, size - done + (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+    t->stats->files++;
+    return err;
+}
+
+static esp_err_t emit_tree(tar_t* t, const std::string& path, const std::string& name)
+{
+    DIR* dp = opendir(path.c_str());
+    if (dp == NULL)
+    {
+        ESP_LOGE(TAG, "Unable to open directory %s: %s", path.c_str(), strerror(errno));
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    struct stat st;
+    uint32_t mtime = stat(path.c_str(), &st) == 0 ? st.st_mtime : 0;
+    bool fits;
+    esp_err_t err = emit_header(t, name + "/", '5', 0, mtime, &fits);
+
+    struct dirent* entry;
+    while (err == ESP_OK && (entry = readdir(dp)) != NULL)
+    {
+        if (strcmp(".", entry->d_name) == 0 || strcmp("..", entry->d_name) == 0)
+            continue;
+        size_t len = strlen(entry->d_name);
+        size_t n = strlen(UPLOAD_TMP_SUFFIX);
+        if (len > n && strcmp(entry->d_name + len - n, UPLOAD_TMP_SUFFIX) == 0)
+            continue;
+
+        std::string child = path + "/" + entry->d_name;
+        std::string child_name = name + "/" + entry->d_name;
+        if (stat(child.c_str(), &st) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode))
+        {
+            err = emit_tree(t, child, child_name);
+            if (err == ESP_ERR_NOT_FOUND)
+            {
+                t->stats->skipped++;
+                err = ESP_OK;
+            }
+        }
+        else
+            err = emit_file(t, child, child_name, st);
+    }
+    closedir(dp);
+    return err;
+}
+
+esp_err_t tar_write_tree(const char* dir, tar_output_t output, void* ctx, uint8_t* buf, size_t bufsize, tar_stats_t* stats)
+{
+    tar_t t = {output, ctx, buf, bufsize, stats};
+    memset(stats, 0, sizeof(*stats));
+
+    std::string path(dir);
+    while (path.size() > 1 && path.back() == '/')
+        path.pop_back();
+    size_t slash = path.rfind('/');
+    std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+    if (name.empty())
+        name = "root";
+
+    esp_err_t err = emit_tree(&t, path, name);
+    // Two zero blocks end the archive.
+    if (err == ESP_OK)
+        err = emit_zeros(&t, 2 * TAR_BLOCK);
+    return err;
+}
+
+//-- Reader --------------------------------------------------------------------
+
+typedef enum
+{
+    TR_HEADER,
+    TR_DATA, // File data, passed on
+    TR_META, // GNU long name or pax header, collected
+    TR_SKIP, // Data of a skipped entry, and padding
+    TR_END,  // End marker seen, the rest is record padding
+} tar_read_state_t;
+
+struct tar_reader
+{
+    tar_callbacks_t cb;
+    void* ctx;
+    tar_read_state_t state;
+    uint8_t block[TAR_BLOCK];
+    size_t count;     // Header bytes in block
+    size_t remaining; // Data bytes left in the current entry
+    size_t pad;       // Padding after them
+    char meta_type;
+    std::string meta;
+    std::string long_name; // From a GNU long name or pax header, for the next entry
+    std::string path;
+    tar_entry_t entry;
+};
+
+// Numeric fields are octal, space or NUL terminated. The base-256 form is only
+// needed for files over 8 GB.
+static bool parse_octal(const char* field, size_t len, uint64_t* out)
+{
+    if ((uint8_t)field[0] & 0x80)
+        return false;
+    size_t i = 0;
+    while (i < len && field[i] == ' ')
+        i++;
+    uint64_t value = 0;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+        value = value * 8 + field[i] - '0';
+    if (i < len && field[i] != ' ' && field[i] != 0)
+        return false;
+    *out = value;
+    return true;
+}
+
+static bool is_zero_block(const uint8_t* block)
+{
+    for (size_t i = 0; i < TAR_BLOCK; i++)
+    {
+        if (block[i])
+            return false;
+    }
+    return true;
+}
+
+static void skip_data(tar_reader_t* r)
+{
+    r->remaining += r->pad;
+    r->pad = 0;
+    r->state = r->remaining ? TR_SKIP : TR_HEADER;
+}
+
+static esp_err_t end_entry(tar_reader_t* r)
+{
+    esp_err_t err = r->cb.entry_end ? r->cb.entry_end(r->ctx, &r->entry) : ESP_OK;
+    skip_data(r);
+    return err;
+}
+
+// pax records are "<length> <key>=<value>\n", only the path is used.
+static void apply_meta(tar_reader_t* r)
+{
+    if (r->meta_type == 'L')
+    {
+        r->long_name.assign(r->meta.c_str());
+        return;
+    }
+    size_t pos = 0;
+    while (pos < r->meta.size())
+    {
+        size_t len = strtoul(r->meta.c_str() + pos, NULL, 10);
+        size_t space = r->meta.find(' ', pos);
+        size_t eq = r->meta.find('=', pos);
+        if (len == 0 || pos + len > r->meta.size() || space == std::string::npos || eq == std::string::npos ||
+            eq > pos + len)
+            break;
+        if (r->meta.compare(space + 1, eq - space - 1, "path") == 0)
+            r->long_name = r->meta.substr(eq + 1, pos + len - eq - 2);
+        pos += len;
+    }
+}
+
+static esp_err_t begin_entry(tar_reader_t* r)
+{
+    if (is_zero_block(r->block))
+    {
+        r->state = TR_END;
+        return ESP_OK;
+    }
+
+    const tar_header_t* h = (const tar_header_t*)r->block;
+    uint64_t chksum, size, mtime;
+    unsigned sum = 0;
+    for (size_t i = 0; i < TAR_BLOCK; i++)
+        sum += i >= offsetof(tar_header_t, chksum) && i < offsetof(tar_header_t, typeflag) ? ' ' : r->block[i];
+    if (!parse_octal(h->chksum, sizeof(h->chksum), &chksum) || chksum != sum ||
+        !parse_octal(h->size, sizeof(h->size), &size) || !parse_octal(h->mtime, sizeof(h->mtime), &mtime) ||
+        size > SIZE_MAX - TAR_BLOCK)
+    {
+        ESP_LOGE(TAG, "Invalid tar header");
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    r->remaining = size;
+    r->pad = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+    char type = h->typeflag ? h->typeflag : TAR_TYPE_FILE;
+    if (type == 'L' || type == 'x')
+    {
+        r->meta_type = type;
+        r->meta.clear();
+        r->state = TR_META;
+        if (size > TAR_META_MAX)
+        {
+            ESP_LOGW(TAG, "%u byte extended header skipped", (unsigned)size);
+            skip_data(r);
+        }
+        else if (size == 0)
+            skip_data(r);
+        return ESP_OK;
+    }
+    // '7' is a contiguous file, a regular file everywhere but on some old systems.
+    if (type == '7')
+        type = TAR_TYPE_FILE;
+    if (type != TAR_TYPE_FILE && type != TAR_TYPE_DIR)
+    {
+        if (type != 'g')
+            ESP_LOGW(TAG, "Entry of type '%c' skipped", type);
+        r->long_name.clear();
+        skip_data(r);
+        return ESP_OK;
+    }
+
+    if (!r->long_name.empty())
+        r->path.swap(r->long_name);
+    else
+    {
+        r->path.clear();
+        if (memcmp(h->magic, "ustar", 5) == 0 && h->prefix[0])
+        {
+            r->path.assign(h->prefix, strnlen(h->prefix, sizeof(h->prefix)));
+            r->path += '/';
+        }
+        r->path.append(h->name, strnlen(h->name, sizeof(h->name)));
+    }
+    r->long_name.clear();
+
+    r->entry.path = r->path.c_str();
+    r->entry.type = type;
+    r->entry.size = type == TAR_TYPE_FILE ? size : 0;
+    r->entry.mtime = mtime;
+    esp_err_t err = r->cb.entry_begin ? r->cb.entry_begin(r->ctx, &r->entry) : ESP_OK;
+    if (err != ESP_OK)
+        return err;
+    if (type == TAR_TYPE_FILE && size > 0)
+    {
+        r->state = TR_DATA;
+        return ESP_OK;
+    }
+    return end_entry(r);
+}
+
+tar_reader_t* tar_reader_create(const tar_callbacks_t* cb, void* ctx)
+{
+    tar_reader_t* r = new (std::nothrow) tar_reader_t();
+    if (r == NULL)
+        return NULL;
+    r->cb = *cb;
+    r->ctx = ctx;
+    r->state = TR_HEADER;
+    return r;
+}
+
+void tar_reader_free(tar_reader_t* r)
+{
+    delete r;
+}
+
+esp_err_t tar_reader_feed(tar_reader_t* r, const uint8_t* data, size_t len)
+{
+    esp_err_t err = ESP_OK;
+    while (len > 0 && err == ESP_OK)
+    {
+        size_t n = 0;
+        switch (r->state)
+        {
+        case TR_HEADER:
+            n = MIN(len, TAR_BLOCK - r->count);
+            memcpy(r->block + r->count, data, n);
+            r->count += n;
+            if (r->count == TAR_BLOCK)
+            {
+                r->count = 0;
+                err = begin_entry(r);
+            }
+            break;
+
+        case TR_DATA:
+            n = MIN(len, r->remaining);
+            if (r->cb.data)
+                err = r->cb.data(r->ctx, data, n);
+            r->remaining -= n;
+            if (r->remaining == 0 && err == ESP_OK)
+                err = end_entry(r);
+            break;
+
+        case TR_META:
+            n = MIN(len, r->remaining);
+            r->meta.append((const char*)data, n);
+            r->remaining -= n;
+            if (r->remaining == 0)
+            {
+                apply_meta(r);
+                skip_data(r);
+            }
+            break;
+
+        case TR_SKIP:
+            n = MIN(len, r->remaining);
+            r->remaining -= n;
+            if (r->remaining == 0)
+                r->state = TR_HEADER;
+            break;
+
+        case TR_END:
+            return ESP_OK; // Padding to the record size is ignored
+        }
+        data += n;
+        len -= n;
+    }
+    return err;
+}
+
+bool tar_reader_done(const tar_reader_t* r)
+{
+    return r->state == TR_END;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+// Streaming ustar writer and reader. A directory tree is written one file at
+// a time through a caller supplied buffer, and an archive is read from pieces
+// of any size, so memory use does not depend on the size of the archive.
+
+#define TAR_BLOCK 512
+
+typedef esp_err_t (*tar_output_t)(void* ctx, const uint8_t* data, size_t len);
+
+typedef struct
+{
+    size_t files;
+    size_t skipped; // Entries whose path does not fit a ustar header
+    size_t bytes;   // Archive size
+} tar_stats_t;
+
+// Archive everything below dir, named relative to its parent so the archive
+// unpacks into a directory of the same name. buf of at least TAR_BLOCK bytes
+// is used for file reads. Uploads in progress (.part) are left out.
+esp_err_t tar_write_tree(const char* dir, tar_output_t output, void* ctx, uint8_t* buf, size_t bufsize, tar_stats_t* stats);
+
+#define TAR_TYPE_FILE '0'
+#define TAR_TYPE_DIR '5'
+#define TAR_META_MAX 1024 // Longer GNU long names and pax headers are skipped
+
+typedef struct
+{
+    const char* path; // As in the archive, pax and GNU long names applied
+    char type;        // TAR_TYPE_FILE or TAR_TYPE_DIR
+    size_t size;
+    uint32_t mtime;
+} tar_entry_t;
+
+// Any callback may be NULL. Entries of other types, links and devices, are
+// skipped without a callback. An error returned from a callback stops reading
+// and is returned from tar_reader_feed.
+typedef struct
+{
+    esp_err_t (*entry_begin)(void* ctx, const tar_entry_t* entry);
+    esp_err_t (*data)(void* ctx, const uint8_t* data, size_t len);
+    esp_err_t (*entry_end)(void* ctx, const tar_entry_t* entry);
+} tar_callbacks_t;
+
+typedef struct tar_reader tar_reader_t;
+
+tar_reader_t* tar_reader_create(const tar_callbacks_t* cb, void* ctx);
+void tar_reader_free(tar_reader_t* r);
+// ESP_ERR_INVALID_RESPONSE for a block that is not a tar header.
+esp_err_t tar_reader_feed(tar_reader_t* r, const uint8_t* data, size_t len);
+// The end of archive marker was seen. An archive cut between two entries is
+// not done, so nothing is taken as complete that was not sent as such.
+bool tar_reader_done(const tar_reader_t* r);
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "esp_err.h"
+
+// Request type only, the tests feed bodies through their own _recv.
+
+typedef void* httpd_handle_t;
+
+typedef struct httpd_req
+{
+    httpd_handle_t handle;
+    size_t content_len;
+    void* user_ctx;
+} httpd_req_t;
+
+#define HTTPD_SOCK_ERR_FAIL -1
+#define HTTPD_SOCK_ERR_TIMEOUT -3
@@ -0,0 +1,5 @@
+#pragma once
+
+#include "esp_err.h"
+
+#define ESP_VFS_PATH_MAX 15
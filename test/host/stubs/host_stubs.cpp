@@ -0,0 +1,74 @@
+#include <zlib.h>
+#include "esp_rom_crc.h"
+#include "rom/miniz.h"
+
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t* buf, uint32_t len)
+{
+    return crc32(crc, buf, len);
+}
+
+static voidpf arena_alloc(voidpf opaque, uInt items, uInt size)
+{
+    tinfl_decompressor* r = (tinfl_decompressor*)opaque;
+    size_t len = ((size_t)items * size + 15) & ~(size_t)15;
+    if (len > sizeof(r->arena) - r->arena_used)
+        return Z_NULL;
+    voidpf p = r->arena + r->arena_used;
+    r->arena_used += len;
+    return p;
+}
+
+static void arena_free(voidpf, voidpf)
+{
+}
+
+// Raw deflate through zlib, with the output contract of tinfl used in wrapping
+// mode. Like tinfl's bit buffer, it may consume up to 3 bytes past the end of
+// the deflate data, so the caller's trailer handling is exercised too.
+tinfl_status tinfl_decompress(tinfl_decompressor* r, const mz_uint8* in, size_t* in_size, mz_uint8*, mz_uint8* out_next,
+                              size_t* out_size, const mz_uint32)
+{
+    z_stream* z = &r->stream;
+    if (r->m_state == 0)
+    {
+        *z = z_stream();
+        z->zalloc = arena_alloc;
+        z->zfree = arena_free;
+        z->opaque = r;
+        if (inflateInit2(z, -15) != Z_OK)
+            return TINFL_STATUS_FAILED;
+        r->m_state = 1;
+    }
+    if (r->m_state == 3)
+        return TINFL_STATUS_FAILED;
+    if (r->m_state == 2)
+    {
+        *in_size = 0;
+        *out_size = 0;
+        return TINFL_STATUS_DONE;
+    }
+
+    z->next_in = (Bytef*)in;
+    z->avail_in = *in_size;
+    z->next_out = out_next;
+    z->avail_out = *out_size;
+    int ret = inflate(z, Z_NO_FLUSH);
+    size_t used = *in_size - z->avail_in;
+    *out_size -= z->avail_out;
+
+    if (ret == Z_STREAM_END)
+    {
+        *in_size = used + (z->avail_in < 3 ? z->avail_in : 3);
+        inflateEnd(z);
+        r->m_state = 2;
+        return TINFL_STATUS_DONE;
+    }
+    *in_size = used;
+    if (ret != Z_OK && ret != Z_BUF_ERROR)
+    {
+        inflateEnd(z);
+        r->m_state = 3;
+        return TINFL_STATUS_FAILED;
+    }
+    return z->avail_out == 0 ? TINFL_STATUS_HAS_MORE_OUTPUT : TINFL_STATUS_NEEDS_MORE_INPUT;
+}
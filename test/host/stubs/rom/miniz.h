@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <zlib.h>
+
+// The part of the ROM miniz API that inflate.cpp uses, backed by zlib in
+// host_stubs.cpp.
+
+typedef unsigned char mz_uint8;
+typedef uint32_t mz_uint32;
+
+enum
+{
+    TINFL_FLAG_PARSE_ZLIB_HEADER = 1,
+    TINFL_FLAG_HAS_MORE_INPUT = 2,
+    TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF = 4,
+};
+
+#define TINFL_LZ_DICT_SIZE 32768
+
+typedef enum
+{
+    TINFL_STATUS_BAD_PARAM = -3,
+    TINFL_STATUS_ADLER32_MISMATCH = -2,
+    TINFL_STATUS_FAILED = -1,
+    TINFL_STATUS_DONE = 0,
+    TINFL_STATUS_NEEDS_MORE_INPUT = 1,
+    TINFL_STATUS_HAS_MORE_OUTPUT = 2,
+} tinfl_status;
+
+// zlib allocates its state and window from the arena, so like the ROM
+// decompressor it needs no heap and nothing is left over when the inflate
+// stream is freed part way through.
+#define TINFL_STUB_ARENA (48 * 1024)
+
+typedef struct
+{
+    mz_uint32 m_state;
+    z_stream stream;
+    size_t arena_used;
+    alignas(16) unsigned char arena[TINFL_STUB_ARENA];
+} tinfl_decompressor;
+
+#define tinfl_init(r)        \
+    do                       \
+    {                        \
+        (r)->m_state = 0;    \
+        (r)->arena_used = 0; \
+    } while (0)
+
+tinfl_status tinfl_decompress(tinfl_decompressor* r, const mz_uint8* in, size_t* in_size, mz_uint8* out_start,
+                              mz_uint8* out_next, size_t* out_size, const mz_uint32 flags);
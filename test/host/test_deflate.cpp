@@ -0,0 +1,124 @@
+#include <string.h>
+#include <zlib.h>
+#include <random>
+#include <string>
+#include "host_test.hpp"
+#include "deflate.hpp"
+
+// deflate.cpp against zlib's gzip reader: whatever the level, window and the
+// way the input is split, the output must be a gzip stream that inflates back
+// to the input.
+
+static esp_err_t collect(void* ctx, const uint8_t* data, size_t len)
+{
+    ((std::string*)ctx)->append((const char*)data, len);
+    return ESP_OK;
+}
+
+static std::string gunzip(const std::string& gz)
+{
+    z_stream z = {};
+    CHECK(inflateInit2(&z, 16 + 15) == Z_OK);
+    std::string out;
+    char buf[16384];
+    z.next_in = (Bytef*)gz.data();
+    z.avail_in = gz.size();
+    int ret;
+    do
+    {
+        z.next_out = (Bytef*)buf;
+        z.avail_out = sizeof(buf);
+        ret = inflate(&z, Z_NO_FLUSH);
+        CHECK(ret == Z_OK || ret == Z_STREAM_END);
+        out.append(buf, sizeof(buf) - z.avail_out);
+    } while (ret != Z_STREAM_END);
+    // Nothing may follow the trailer.
+    CHECK(z.avail_in == 0);
+    inflateEnd(&z);
+    return out;
+}
+
+static std::string random_data(std::mt19937& rng, size_t size)
+{
+    std::string data(size, 0);
+    for (auto& c : data)
+        c = rng();
+    return data;
+}
+
+// Something like /metrics or a file listing: repeated lines with small changes,
+// so matches of every length and distance turn up.
+static std::string repetitive(std::mt19937& rng, size_t size)
+{
+    static const char* lines[] = {
+        "{\"path\": \"/littlefs/logs/", "\", \"size\": ", ", \"modification_time\": 17", "}\n",
+        "serviceweb_heap_free_bytes ", "# TYPE serviceweb_requests_total counter\n", "aaaaaaaaaaaaaaaa",
+    };
+    std::string data;
+    while (data.size() < size)
+    {
+        data += lines[rng() % (sizeof(lines) / sizeof(lines[0]))];
+        if (rng() % 4 == 0)
+            data += std::to_string(rng() % 100000);
+    }
+    data.resize(size);
+    return data;
+}
+
+static std::string deflate_pieces(const std::string& data, int level, size_t budget, std::mt19937& rng,
+                                  size_t max_piece)
+{
+    std::string gz;
+    deflate_stream_t* s = deflate_create(level, budget, collect, &gz);
+    CHECK(s != NULL);
+    for (size_t pos = 0; pos < data.size();)
+    {
+        size_t len = 1 + rng() % max_piece;
+        if (len > data.size() - pos)
+            len = data.size() - pos;
+        CHECK(deflate_write(s, data.data() + pos, len) == ESP_OK);
+        pos += len;
+    }
+    CHECK(deflate_finish(s) == ESP_OK);
+    CHECK(deflate_total_in(s) == data.size());
+    CHECK(deflate_total_out(s) == gz.size());
+    deflate_free(s);
+    return gz;
+}
+
+static void test_round_trip(void)
+{
+    std::mt19937 rng(1);
+    const size_t sizes[] = {0, 1, 3, DEFLATE_MAX_WINDOW - 1, DEFLATE_MAX_WINDOW, DEFLATE_MAX_WINDOW + 1,
+                            2 * DEFLATE_MAX_WINDOW + 1, 200000};
+    const size_t pieces[] = {1, 7, 1024, 65536};
+    const int levels[] = {1, 3, 9};
+    const size_t budgets[] = {4 * 1024, 16 * 1024, 128 * 1024};
+    for (size_t size : sizes)
+        for (size_t piece : pieces)
+            for (int level : levels)
+                for (size_t budget : budgets)
+                {
+                    std::string data = (piece + level) % 2 ? repetitive(rng, size) : random_data(rng, size);
+                    std::string gz = deflate_pieces(data, level, budget, rng, piece);
+                    CHECK(gunzip(gz) == data);
+                }
+}
+
+static void test_ratio(void)
+{
+    // Repetitive text has to shrink, or the match finder is not doing its job.
+    std::mt19937 rng(2);
+    std::string data = repetitive(rng, 100000);
+    std::string gz = deflate_pieces(data, 3, 16 * 1024, rng, 4096);
+    CHECK(gz.size() < data.size() / 3);
+    CHECK(gunzip(gz) == data);
+}
+
+int main(void)
+{
+    test_round_trip();
+    test_ratio();
+    printf("deflate: ok\n");
+    return 0;
+}
@@ -0,0 +1,145 @@
+#include <string.h>
+#include <zlib.h>
+#include <random>
+#include <string>
+#include "host_test.hpp"
+#include "inflate.hpp"
+#include "rom/miniz.h"
+
+// inflate.cpp against zlib's gzip writer: the output must match the original
+// byte for byte however the input is split, and damaged streams must fail.
+
+static esp_err_t collect(void* ctx, const uint8_t* data, size_t len)
+{
+    ((std::string*)ctx)->append((const char*)data, len);
+    return ESP_OK;
+}
+
+static std::string gzip(const std::string& data, bool with_name)
+{
+    z_stream z = {};
+    CHECK(deflateInit2(&z, 9, Z_DEFLATED, 16 + 15, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+    gz_header header = {};
+    char name[] = "firmware.bin";
+    if (with_name)
+    {
+        // FNAME and FHCRC, the optional fields the parser has to skip.
+        header.name = (Bytef*)name;
+        header.hcrc = 1;
+        CHECK(deflateSetHeader(&z, &header) == Z_OK);
+    }
+    std::string out(deflateBound(&z, data.size()) + 64, 0);
+    z.next_in = (Bytef*)data.data();
+    z.avail_in = data.size();
+    z.next_out = (Bytef*)&out[0];
+    z.avail_out = out.size();
+    CHECK(deflate(&z, Z_FINISH) == Z_STREAM_END);
+    out.resize(z.total_out);
+    deflateEnd(&z);
+    return out;
+}
+
+// Something like an app image: runs of code-like bytes, zero padding and noise.
+static std::string image(std::mt19937& rng, size_t size)
+{
+    std::string data(size, 0);
+    for (size_t i = 0; i < size; i++)
+    {
+        switch ((i / 4096) % 3)
+        {
+        case 0:
+            data[i] = "\xe9\x03\x02\x20\x40\x08\x00\x00"[i % 8] + (rng() % 16 == 0);
+            break;
+        case 1:
+            data[i] = 0;
+            break;
+        default:
+            data[i] = rng();
+            break;
+        }
+    }
+    return data;
+}
+
+static esp_err_t inflate_pieces(const std::string& gz, std::mt19937& rng, size_t max_piece, std::string& out)
+{
+    inflate_stream_t* s = inflate_create(collect, &out);
+    CHECK(s != NULL);
+    esp_err_t err = ESP_OK;
+    for (size_t pos = 0; pos < gz.size() && err == ESP_OK;)
+    {
+        size_t len = 1 + rng() % max_piece;
+        if (len > gz.size() - pos)
+            len = gz.size() - pos;
+        err = inflate_write(s, gz.data() + pos, len);
+        pos += len;
+    }
+    if (err == ESP_OK)
+        err = inflate_finish(s);
+    CHECK(err != ESP_OK || inflate_total_in(s) == gz.size());
+    inflate_free(s);
+    return err;
+}
+
+static void test_magic(void)
+{
+    const uint8_t gz[] = {0x1f, 0x8b, 0x08, 0x00};
+    const uint8_t app[] = {0xe9, 0x03, 0x02, 0x20};
+    const uint8_t stored[] = {0x1f, 0x8b, 0x07, 0x00};
+    const uint8_t first_only[] = {0x1f, 0x00, 0x08, 0x00};
+    CHECK(inflate_is_gzip(gz, sizeof(gz)));
+    CHECK(!inflate_is_gzip(gz, INFLATE_GZIP_ID_LEN - 1));
+    CHECK(!inflate_is_gzip(app, sizeof(app)));
+    CHECK(!inflate_is_gzip(stored, sizeof(stored)));
+    CHECK(!inflate_is_gzip(first_only, sizeof(first_only)));
+}
+
+static void test_round_trip(void)
+{
+    std::mt19937 rng(1);
+    const size_t sizes[] = {0, 1, TINFL_LZ_DICT_SIZE - 1, TINFL_LZ_DICT_SIZE, TINFL_LZ_DICT_SIZE + 1, 300000};
+    const size_t pieces[] = {1, 7, 1024, 65536};
+    for (size_t size : sizes)
+        for (size_t piece : pieces)
+        {
+            std::string data = image(rng, size);
+            std::string gz = gzip(data, piece % 2);
+            std::string out;
+            CHECK(inflate_pieces(gz, rng, piece, out) == ESP_OK);
+            CHECK(out == data);
+        }
+}
+
+static void test_damaged(void)
+{
+    std::mt19937 rng(2);
+    std::string data = image(rng, 100000);
+    std::string gz = gzip(data, false);
+    std::string out;
+
+    std::string bad_crc = gz;
+    bad_crc[bad_crc.size() - 8] ^= 1;
+    CHECK(inflate_pieces(bad_crc, rng, 4096, out) == ESP_ERR_INVALID_CRC);
+
+    std::string bad_size = gz;
+    bad_size[bad_size.size() - 1] ^= 1;
+    out.clear();
+    CHECK(inflate_pieces(bad_size, rng, 4096, out) == ESP_ERR_INVALID_CRC);
+
+    out.clear();
+    CHECK(inflate_pieces(gz.substr(0, gz.size() / 2), rng, 4096, out) == ESP_ERR_INVALID_SIZE);
+
+    std::string bad_method = gz;
+    bad_method[2] = 7;
+    out.clear();
+    CHECK(inflate_pieces(bad_method, rng, 4096, out) == ESP_ERR_INVALID_ARG);
+}
+
+int main(void)
+{
+    test_magic();
+    test_round_trip();
+    test_damaged();
+    printf("inflate: ok\n");
+    return 0;
+}
@@ -0,0 +1,250 @@
+#include <string.h>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include "host_test.hpp"
+#include "multipart.hpp"
+
+// Randomised messages against multipart.cpp: binary bodies full of boundary
+// fragments, split at every possible kind of position, must come back part
+// for part. "bench" as the argument measures throughput instead.
+
+typedef struct
+{
+    std::vector<std::string> names;
+    std::vector<std::string> filenames;
+    std::vector<std::string> bodies;
+    int ended;
+} parsed_t;
+
+static esp_err_t on_begin(void* ctx, const multipart_part_t* part)
+{
+    parsed_t* p = (parsed_t*)ctx;
+    CHECK(part->index == (int)p->bodies.size());
+    p->names.push_back(part->name);
+    p->filenames.push_back(part->filename);
+    p->bodies.emplace_back();
+    return ESP_OK;
+}
+
+static esp_err_t on_data(void* ctx, const multipart_part_t*, const uint8_t* data, size_t len)
+{
+    ((parsed_t*)ctx)->bodies.back().append((const char*)data, len);
+    return ESP_OK;
+}
+
+static esp_err_t on_end(void* ctx, const multipart_part_t*)
+{
+    ((parsed_t*)ctx)->ended++;
+    return ESP_OK;
+}
+
+static const multipart_callbacks_t callbacks = {on_begin, on_data, on_end};
+
+// The request body for multipart_receive, handed out in pieces of random size.
+typedef struct
+{
+    std::string body;
+    size_t pos;
+    std::mt19937* rng;
+} fake_body_t;
+
+// Stands in for the one in api_upload.cpp.
+int _recv(httpd_req_t* req, char* buf, size_t len)
+{
+    fake_body_t* b = (fake_body_t*)req->user_ctx;
+    size_t n = 1 + (*b->rng)() % len;
+    if (n > b->body.size() - b->pos)
+        n = b->body.size() - b->pos;
+    memcpy(buf, b->body.data() + b->pos, n);
+    b->pos += n;
+    return (int)n;
+}
+
+static std::string random_boundary(std::mt19937& rng)
+{
+    // Few distinct characters, so bodies often hold long partial matches.
+    std::string boundary = "--";
+    size_t len = 1 + rng() % 40;
+    for (size_t i = 0; i < len; i++)
+        boundary += "ab-"[rng() % 3];
+    return boundary;
+}
+
+static std::string random_body(std::mt19937& rng, const std::string& boundary)
+{
+    const std::string delim = "\r\n" + boundary;
+    for (;;)
+    {
+        std::string body;
+        size_t len = rng() % 200;
+        while (body.size() < len)
+        {
+            switch (rng() % 5)
+            {
+            case 0:
+                body += "\r\n";
+                break;
+            case 1:
+                body += delim.substr(0, rng() % delim.size()); // Never the whole delimiter
+                break;
+            case 2:
+                body += '\0';
+                break;
+            default:
+                body += (char)rng();
+                break;
+            }
+        }
+        // A delimiter may also form across what was appended, or with the
+        // CRLF and boundary that close the part.
+        if (("\r\n" + body + delim).find(delim) == body.size() + 2)
+            return body;
+    }
+}
+
+static std::string build_message(std::mt19937& rng, const std::string& boundary, const std::vector<std::string>& bodies)
+{
+    std::string msg = rng() % 2 ? "This is the preamble.\r\n" : "";
+    for (size_t i = 0; i < bodies.size(); i++)
+    {
+        msg += (i == 0 ? "" : "\r\n") + boundary + (rng() % 2 ? "  \r\n" : "\r\n");
+        msg += "Content-Disposition: form-data; name=\"part" + std::to_string(i) + "\"; filename=\"f" +
+               std::to_string(i) + ".bin\"\r\n";
+        if (rng() % 2)
+            msg += "Content-Type: application/octet-stream\r\n";
+        msg += "\r\n" + bodies[i];
+    }
+    msg += "\r\n" + boundary + "--\r\nepilogue";
+    return msg;
+}
+
+static void check_parsed(const parsed_t& p, const std::vector<std::string>& bodies)
+{
+    CHECK(p.bodies == bodies);
+    CHECK(p.ended == (int)bodies.size());
+    for (size_t i = 0; i < bodies.size(); i++)
+    {
+        CHECK(p.names[i] == "part" + std::to_string(i));
+        CHECK(p.filenames[i] == "f" + std::to_string(i) + ".bin");
+    }
+}
+
+static void fuzz_feed(int rounds)
+{
+    std::mt19937 rng(1);
+    for (int round = 0; round < rounds; round++)
+    {
+        std::string boundary = random_boundary(rng);
+        std::vector<std::string> bodies(1 + rng() % 4);
+        for (auto& body : bodies)
+            body = random_body(rng, boundary);
+        std::string msg = build_message(rng, boundary, bodies);
+
+        parsed_t p = {};
+        multipart_t* mp = multipart_create(boundary.c_str(), &callbacks, &p);
+        CHECK(mp != NULL);
+        size_t max_piece = 1 + rng() % 64;
+        for (size_t pos = 0; pos < msg.size();)
+        {
+            size_t len = 1 + rng() % max_piece;
+            if (len > msg.size() - pos)
+                len = msg.size() - pos;
+            CHECK(multipart_feed(mp, (const uint8_t*)msg.data() + pos, len) == ESP_OK);
+            pos += len;
+        }
+        CHECK(multipart_done(mp));
+        check_parsed(p, bodies);
+        multipart_free(mp);
+    }
+}
+
+static void fuzz_receive(int rounds)
+{
+    std::mt19937 rng(2);
+    static char buf[512];
+    for (int round = 0; round < rounds; round++)
+    {
+        std::string boundary = random_boundary(rng);
+        std::vector<std::string> bodies(1 + rng() % 3);
+        for (auto& body : bodies)
+            body = random_body(rng, boundary);
+        fake_body_t body = {build_message(rng, boundary, bodies), 0, &rng};
+        bool truncate = rng() % 4 == 0;
+        if (truncate)
+            body.body.resize(body.body.find("\r\n" + boundary + "--"));
+
+        httpd_req_t req = {};
+        req.content_len = body.body.size();
+        req.user_ctx = &body;
+        parsed_t p = {};
+        multipart_t* mp = multipart_create(boundary.c_str(), &callbacks, &p);
+        esp_err_t err = multipart_receive(&req, mp, buf, 1 + rng() % sizeof(buf));
+        if (truncate)
+            CHECK(err == ESP_ERR_INVALID_SIZE && !multipart_done(mp));
+        else
+        {
+            CHECK(err == ESP_OK);
+            check_parsed(p, bodies);
+        }
+        multipart_free(mp);
+    }
+}
+
+static void test_limits(void)
+{
+    parsed_t p = {};
+    std::string longest(MULTIPART_DELIM_MAX - 2, '-');
+    multipart_t* mp = multipart_create(longest.c_str(), &callbacks, &p);
+    CHECK(mp != NULL);
+    multipart_free(mp);
+    CHECK(multipart_create((longest + "x").c_str(), &callbacks, &p) == NULL);
+    CHECK(multipart_create("", &callbacks, &p) == NULL);
+}
+
+// One large file part in 1 KB pieces, the size the upload handler receives.
+static void bench(void)
+{
+    std::mt19937 rng(3);
+    const std::string boundary = "------WebKitFormBoundary7MA4YWxkTrZu0gW";
+    std::vector<std::string> bodies(1, std::string(16 << 20, 0));
+    for (auto& c : bodies[0])
+        c = (char)rng();
+    // Random bytes almost never start a match, this file starts one every line.
+    std::string lines;
+    while (lines.size() < bodies[0].size())
+        lines += "\r\n--------WebKitFormBoundary line of a text file\r\n";
+    lines.resize(bodies[0].size());
+
+    const char* labels[] = {"binary", "text"};
+    const std::string* inputs[] = {&bodies[0], &lines};
+    for (int i = 0; i < 2; i++)
+    {
+        const std::string& data = *inputs[i];
+        std::string msg = build_message(rng, boundary, {data});
+        parsed_t p = {};
+        multipart_t* mp = multipart_create(boundary.c_str(), &callbacks, &p);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t pos = 0; pos < msg.size(); pos += 1024)
+            multipart_feed(mp, (const uint8_t*)msg.data() + pos, std::min<size_t>(1024, msg.size() - pos));
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        CHECK(multipart_done(mp) && p.bodies[0] == data);
+        multipart_free(mp);
+        printf("multipart %s: %.0f MB/s\n", labels[i], msg.size() / seconds / 1e6);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+    {
+        bench();
+        return 0;
+    }
+    test_limits();
+    fuzz_feed(20000);
+    fuzz_receive(5000);
+    printf("multipart: ok\n");
+    return 0;
+}
@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+"""Download throughput across file sizes.
+
+Uploads test files of several sizes through /api/upload, times
+/api/download for each of them and removes them again with /api/delete.
+
+    tools/bench_download.py 192.168.1.10 --dir /littlefs --runs 3
+"""
+import argparse
+import json
+import os
+import time
+import urllib.request
+
+SIZES = [1 << 10, 4 << 10, 16 << 10, 64 << 10, 256 << 10, 1 << 20, 4 << 20]
+
+
+def upload(host, path, data):
+    boundary = "----servicewebbench"
+    body = (f"--{boundary}\r\nContent-Disposition: form-data; name=\"file\"; filename=\"{os.path.basename(path)}\"\r\n"
+            f"Content-Type: application/octet-stream\r\n\r\n").encode() + data + f"\r\n--{boundary}--\r\n".encode()
+    req = urllib.request.Request(f"http://{host}/api/upload?file={path}", data=body, method="POST",
+                                 headers={"Content-Type": f"multipart/form-data; boundary={boundary}"})
+    job = json.loads(urllib.request.urlopen(req).read())
+    # Deletion runs in the background, wait for it so the files are gone on return.
+    while True:
+        with urllib.request.urlopen(f"http://{host}/api/delete/status?id={job['id']}") as resp:
+            status = json.loads(resp.read())
+        if status["state"] == "done":
+            return status
+        time.sleep(0.1)
+
+
+def download(host, path):
+    start = time.monotonic()
+    with urllib.request.urlopen(f"http://{host}/api/download?file={path}") as resp:
+        size = len(resp.read())
+    return size, time.monotonic() - start
+
+
+def delete(host, paths):
+    req = urllib.request.Request(f"http://{host}/api/delete", data=json.dumps({"files": paths}).encode(), method="POST",
+                                 headers={"Content-Type": "application/json"})
+    urllib.request.urlopen(req).read()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("host")
+    parser.add_argument("--dir", default="/littlefs")
+    parser.add_argument("--runs", type=int, default=3)
+    args = parser.parse_args()
+
+    paths = []
+    print(f"{'size':>10} {'best ms':>10} {'kB/s':>10}")
+    try:
+        for size in SIZES:
+            path = f"{args.dir}/bench_{size}.bin"
+            upload(args.host, path, os.urandom(size))
+            paths.append(path)
+            best = min(download(args.host, path)[1] for _ in range(args.runs))
+            print(f"{size:>10} {best * 1000:>10.1f} {size / 1024 / best:>10.1f}")
+    finally:
+        if paths:
+            delete(args.host, paths)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,50 @@
+#!/usr/bin/env python3
+"""Upload throughput across file sizes.
+
+Posts random files of several sizes to /api/upload, checks each one by
+downloading it again and removes them with /api/delete. The bodies are random
+bytes, so they contain CR, LF and NUL bytes the multipart parser has to pass
+through.
+
+    tools/bench_upload.py 192.168.1.10 --dir /littlefs --runs 3
+"""
+import argparse
+import os
+import time
+import urllib.request
+
+from bench_download import SIZES, delete, upload
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("host")
+    parser.add_argument("--dir", default="/littlefs")
+    parser.add_argument("--runs", type=int, default=3)
+    args = parser.parse_args()
+
+    paths = []
+    print(f"{'size':>10} {'best ms':>10} {'kB/s':>10}")
+    try:
+        for size in SIZES:
+            path = f"{args.dir}/bench_{size}.bin"
+            data = os.urandom(size)
+            best = None
+            for _ in range(args.runs):
+                start = time.monotonic()
+                upload(args.host, path, data)
+                elapsed = time.monotonic() - start
+                best = elapsed if best is None else min(best, elapsed)
+            paths.append(path)
+            with urllib.request.urlopen(f"http://{args.host}/api/download?file={path}") as resp:
+                if resp.read() != data:
+                    print(f"{size:>10} content mismatch")
+                    continue
+            print(f"{size:>10} {best * 1000:>10.1f} {size / 1024 / best:>10.1f}")
+    finally:
+        if paths:
+            delete(args.host, paths)
+
+
+if __name__ == "__main__":
+    main()
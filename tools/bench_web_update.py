@@ -0,0 +1,44 @@
+#!/usr/bin/env python3
+"""Time a web partition update end to end.
+
+Posts a LittleFS image to /update/web and reports the time until the device
+answers, which includes erasing and writing. With a single web partition it
+also includes remounting and rebuilding the file index. With two slots the
+device answers once the image mounts, and the switch is in the device log along
+with the split between transfer and erase time.
+
+    tools/bench_web_update.py 192.168.1.10 build/web.bin --runs 3
+"""
+import argparse
+import time
+import urllib.request
+
+
+def post_image(host, data):
+    boundary = "----servicewebweb"
+    body = (f"--{boundary}\r\nContent-Disposition: form-data; name=\"file\"; filename=\"web.bin\"\r\n"
+            f"Content-Type: application/octet-stream\r\n\r\n").encode() + data + f"\r\n--{boundary}--\r\n".encode()
+    req = urllib.request.Request(f"http://{host}/update/web", data=body, method="POST",
+                                 headers={"Content-Type": f"multipart/form-data; boundary={boundary}"})
+    start = time.monotonic()
+    with urllib.request.urlopen(req, timeout=120) as resp:
+        resp.read()
+    return time.monotonic() - start
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("host")
+    parser.add_argument("image")
+    parser.add_argument("--runs", type=int, default=1)
+    args = parser.parse_args()
+
+    with open(args.image, "rb") as f:
+        data = f.read()
+    for run in range(args.runs):
+        seconds = post_image(args.host, data)
+        print(f"run {run + 1}: {len(data)} bytes in {seconds:.2f} s, {len(data) / 1024 / seconds:.1f} kB/s")
+
+
+if __name__ == "__main__":
+    main()
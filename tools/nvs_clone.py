@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+"""Copy an NVS namespace from one device to others.
+
+The namespace is exported from the source in the binary format and imported
+on each target in one request, all keys with a single nvs_commit. --dry-run
+only prints what would change, --replace also erases keys the source does not
+have. --save keeps the export in a file, --load imports a saved one instead of
+reading a source device.
+
+    tools/nvs_clone.py --namespace config 192.168.1.10 192.168.1.11 192.168.1.12
+    tools/nvs_clone.py --namespace config --load config.bin --dry-run 192.168.1.11
+"""
+import argparse
+import json
+import sys
+import time
+import urllib.error
+import urllib.request
+
+
+def export(host, namespace):
+    url = f"http://{host}/api/nvs?cmd=export&namespace={namespace}&format=bin"
+    with urllib.request.urlopen(url) as resp:
+        return resp.read()
+
+
+def import_(host, namespace, data, dry_run, replace):
+    url = (f"http://{host}/api/nvs?cmd=import&namespace={namespace}"
+           f"&dry_run={int(dry_run)}&replace={int(replace)}")
+    req = urllib.request.Request(url, data=data, method="POST", headers={"Content-Type": "application/octet-stream"})
+    try:
+        with urllib.request.urlopen(req) as resp:
+            return json.loads(resp.read())
+    except urllib.error.HTTPError as e:
+        return json.loads(e.read() or b"{}") | {"status": e.code}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("hosts", nargs="+", help="source then targets, or only targets with --load")
+    parser.add_argument("--namespace", required=True)
+    parser.add_argument("--load", help="import this file instead of exporting from the first host")
+    parser.add_argument("--save", help="also write the export to this file")
+    parser.add_argument("--dry-run", action="store_true")
+    parser.add_argument("--replace", action="store_true")
+    args = parser.parse_args()
+
+    hosts = args.hosts
+    if args.load:
+        with open(args.load, "rb") as f:
+            data = f.read()
+    else:
+        data = export(hosts[0], args.namespace)
+        hosts = hosts[1:]
+        print(f"{args.hosts[0]}: exported {len(data)} bytes")
+    if args.save:
+        with open(args.save, "wb") as f:
+            f.write(data)
+
+    failed = False
+    for host in hosts:
+        start = time.monotonic()
+        result = import_(host, args.namespace, data, args.dry_run, args.replace)
+        ms = (time.monotonic() - start) * 1000
+        if "error" in result:
+            failed = True
+            print(f"{host}: {result['error']} {result.get('key', '')}")
+            continue
+        print(f"{host}: {'applied' if result['applied'] else 'dry run'} in {ms:.0f} ms, "
+              f"{result['unchanged']} unchanged")
+        for change in ("added", "changed", "removed"):
+            if result[change]:
+                print(f"  {change}: {', '.join(result[change])}")
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+"""Send a firmware and a web image to /update/bundle in one request.
+
+The manifest with the SHA-256 of both images is made on the fly. With --key
+each hash is signed with openssl, for devices set up with
+serviceweb_set_ota_public_key. Both images take effect at the next restart,
+--restart asks the device for it through /api/reboot.
+
+    tools/ota_bundle.py 192.168.1.10 --firmware build/app.bin.gz --web build/web.bin --key signing_key.pem
+"""
+import argparse
+import base64
+import gzip
+import hashlib
+import json
+import subprocess
+import time
+import urllib.request
+
+
+def manifest_entry(data, key):
+    if data[:2] == b"\x1f\x8b":
+        data = gzip.decompress(data)
+    entry = {"sha256": hashlib.sha256(data).hexdigest()}
+    if key:
+        signature = subprocess.run(["openssl", "dgst", "-sha256", "-sign", key], input=data,
+                                   capture_output=True, check=True).stdout
+        entry["signature"] = base64.b64encode(signature).decode()
+    return entry
+
+
+def part(boundary, name, content_type, data, filename=None):
+    disposition = f"form-data; name=\"{name}\"" + (f"; filename=\"{filename}\"" if filename else "")
+    return (f"--{boundary}\r\nContent-Disposition: {disposition}\r\n"
+            f"Content-Type: {content_type}\r\n\r\n").encode() + data + b"\r\n"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("host")
+    parser.add_argument("--firmware", help="app image, raw or gzip")
+    parser.add_argument("--web", help="LittleFS image")
+    parser.add_argument("--key", help="PEM private key, RSA or EC")
+    parser.add_argument("--restart", action="store_true")
+    args = parser.parse_args()
+    if not args.firmware and not args.web:
+        parser.error("nothing to send, give --firmware and/or --web")
+
+    boundary = "----servicewebbundle"
+    manifest = {}
+    parts = []
+    for name, path in (("firmware", args.firmware), ("web", args.web)):
+        if not path:
+            continue
+        with open(path, "rb") as f:
+            data = f.read()
+        manifest[name] = manifest_entry(data, args.key)
+        parts.append(part(boundary, name, "application/octet-stream", data, path.rsplit("/", 1)[-1]))
+    body = part(boundary, "manifest", "application/json", json.dumps(manifest).encode())
+    body += b"".join(parts) + f"--{boundary}--\r\n".encode()
+
+    req = urllib.request.Request(f"http://{args.host}/update/bundle", data=body, method="POST",
+                                 headers={"Content-Type": f"multipart/form-data; boundary={boundary}"})
+    start = time.monotonic()
+    with urllib.request.urlopen(req, timeout=300) as resp:
+        print(resp.read().decode(), f"in {time.monotonic() - start:.1f} s, {len(body)} bytes")
+
+    if args.restart:
+        urllib.request.urlopen(urllib.request.Request(f"http://{args.host}/api/reboot", method="POST"), timeout=10)
+
+
+if __name__ == "__main__":
+    main()
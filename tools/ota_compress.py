@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+"""Compress a firmware image for /update/firmware.
+
+Writes a gzip image the device inflates while it streams into the OTA
+partition. The result is checked by decompressing it again and comparing it
+with the original byte for byte. With --host the image is uploaded as well.
+
+    tools/ota_compress.py build/app.bin                 # writes build/app.bin.gz
+    tools/ota_compress.py build/app.bin --host 192.168.1.10
+"""
+import argparse
+import gzip
+import time
+import urllib.request
+
+ESP_IMAGE_MAGIC = 0xE9
+
+
+def upload(host, name, data, manifest=None):
+    boundary = "----servicewebota"
+    body = b""
+    if manifest:
+        body += (f"--{boundary}\r\nContent-Disposition: form-data; name=\"manifest\"\r\n"
+                 f"Content-Type: application/json\r\n\r\n").encode() + manifest + b"\r\n"
+    body += (f"--{boundary}\r\nContent-Disposition: form-data; name=\"file\"; filename=\"{name}\"\r\n"
+             f"Content-Type: application/gzip\r\n\r\n").encode() + data + f"\r\n--{boundary}--\r\n".encode()
+    req = urllib.request.Request(f"http://{host}/update/firmware", data=body, method="POST",
+                                 headers={"Content-Type": f"multipart/form-data; boundary={boundary}"})
+    start = time.monotonic()
+    with urllib.request.urlopen(req) as resp:
+        print(resp.read().decode(), f"in {time.monotonic() - start:.1f} s")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("image")
+    parser.add_argument("-o", "--output")
+    parser.add_argument("--host")
+    parser.add_argument("--manifest", help="manifest from tools/ota_manifest.py, sent along with the image")
+    args = parser.parse_args()
+
+    with open(args.image, "rb") as f:
+        raw = f.read()
+    if not raw or raw[0] != ESP_IMAGE_MAGIC:
+        parser.error(f"{args.image} is not an app image")
+
+    # mtime 0 keeps the output reproducible
+    packed = gzip.compress(raw, compresslevel=9, mtime=0)
+    if gzip.decompress(packed) != raw:
+        raise SystemExit("round trip mismatch")
+
+    output = args.output or args.image + ".gz"
+    with open(output, "wb") as f:
+        f.write(packed)
+    print(f"{output}: {len(raw)} -> {len(packed)} bytes ({100 * len(packed) / len(raw):.0f}%)")
+
+    if args.host:
+        manifest = open(args.manifest, "rb").read() if args.manifest else None
+        upload(args.host, output.rsplit("/", 1)[-1], packed, manifest)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,43 @@
+#!/usr/bin/env python3
+"""Write the OTA manifest for a firmware image.
+
+The manifest holds the SHA-256 of the image as it ends up in flash, so a gzip
+image is hashed after decompression. With --key the hash is signed with
+openssl, for devices set up with serviceweb_set_ota_public_key.
+
+    tools/ota_manifest.py build/app.bin.gz --key signing_key.pem   # writes build/app.bin.gz.manifest.json
+"""
+import argparse
+import base64
+import gzip
+import hashlib
+import json
+import subprocess
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("image")
+    parser.add_argument("--key", help="PEM private key, RSA or EC")
+    parser.add_argument("-o", "--output")
+    args = parser.parse_args()
+
+    with open(args.image, "rb") as f:
+        data = f.read()
+    if data[:2] == b"\x1f\x8b":
+        data = gzip.decompress(data)
+
+    manifest = {"sha256": hashlib.sha256(data).hexdigest()}
+    if args.key:
+        signature = subprocess.run(["openssl", "dgst", "-sha256", "-sign", args.key], input=data,
+                                   capture_output=True, check=True).stdout
+        manifest["signature"] = base64.b64encode(signature).decode()
+
+    output = args.output or args.image + ".manifest.json"
+    with open(output, "w") as f:
+        json.dump(manifest, f)
+    print(f"{output}: sha256 {manifest['sha256']}{', signed' if args.key else ''}")
+
+
+if __name__ == "__main__":
+    main()
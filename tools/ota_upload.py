@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+"""Upload a firmware image with the resumable OTA API.
+
+Sends the image in chunks to /update/firmware/chunk. After a dropped
+connection it asks the device for the offset it has and continues from
+there, until the image is complete and committed. Raw and gzip images
+(tools/ota_compress.py) are both accepted.
+
+    tools/ota_upload.py 192.168.1.10 build/app.bin.gz --chunk 65536
+"""
+import argparse
+import hashlib
+import json
+import time
+import urllib.error
+import urllib.request
+
+
+def call(host, endpoint, data=None, method="POST"):
+    req = urllib.request.Request(f"http://{host}/update/firmware/{endpoint}", data=data, method=method,
+                                 headers={"Content-Type": "application/octet-stream"})
+    with urllib.request.urlopen(req, timeout=30) as resp:
+        return resp.read()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("host")
+    parser.add_argument("image")
+    parser.add_argument("--chunk", type=int, default=64 << 10)
+    parser.add_argument("--retries", type=int, default=20)
+    parser.add_argument("--manifest", help="manifest from tools/ota_manifest.py, sent with the commit")
+    args = parser.parse_args()
+
+    with open(args.image, "rb") as f:
+        data = f.read()
+    digest = hashlib.sha256(data).hexdigest()
+
+    session = json.loads(call(args.host, f"start?size={len(data)}&sha256={digest}"))
+    offset = session["offset"]
+    start = time.monotonic()
+    retries = 0
+    while offset < len(data):
+        try:
+            chunk = data[offset:offset + args.chunk]
+            offset = json.loads(call(args.host, f"chunk?id={session['id']}&offset={offset}", chunk))["offset"]
+            print(f"\r{offset} / {len(data)}", end="", flush=True)
+        except (urllib.error.URLError, OSError) as e:
+            retries += 1
+            if retries > args.retries:
+                raise
+            print(f"\n{e}, resuming")
+            time.sleep(1)
+            offset = json.loads(call(args.host, f"session?id={session['id']}", method="GET"))["offset"]
+    print(f"\nsent in {time.monotonic() - start:.1f} s")
+    manifest = open(args.manifest, "rb").read() if args.manifest else None
+    print(call(args.host, f"commit?id={session['id']}", manifest).decode())
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+"""Upload a file with the resumable chunked upload API.
+
+Starts or resumes a session, sends the missing chunks and commits. The device
+writes chunks one at a time, --parallel only overlaps the round trips. Run it again after an interruption to continue where it stopped.
+
+    tools/upload_chunked.py 192.168.1.10 firmware.bin /littlefs/firmware.bin --chunk 32768 --parallel 2
+"""
+import argparse
+import json
+import os
+import urllib.request
+import zlib
+from concurrent.futures import ThreadPoolExecutor
+
+
+def call(host, endpoint, data=None, method="POST"):
+    req = urllib.request.Request(f"http://{host}/api/upload/{endpoint}", data=data, method=method,
+                                 headers={"Content-Type": "application/octet-stream"})
+    with urllib.request.urlopen(req) as resp:
+        return json.loads(resp.read())
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("host")
+    parser.add_argument("source")
+    parser.add_argument("path")
+    parser.add_argument("--chunk", type=int, default=32 << 10)
+    parser.add_argument("--parallel", type=int, default=2)
+    args = parser.parse_args()
+
+    with open(args.source, "rb") as f:
+        data = f.read()
+
+    status = call(args.host, f"start?file={args.path}&size={len(data)}")
+    session = status["id"]
+    print(f"session {session}, resuming at {status['offset']} of {len(data)}")
+
+    def send(offset):
+        chunk = data[offset:offset + args.chunk]
+        return call(args.host, f"chunk?id={session}&offset={offset}&crc={zlib.crc32(chunk):08x}", chunk)
+
+    with ThreadPoolExecutor(args.parallel) as pool:
+        for status in pool.map(send, range(status["offset"], len(data), args.chunk)):
+            print(f"\r{status['received']} / {len(data)}", end="", flush=True)
+    print()
+    print(call(args.host, f"commit?id={session}")["message"])
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,461 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <unordered_map>
+#include "esp_log.h"
+#include "esp_random.h"
+#include "nvs.h"
+#include "web_index.hpp"
+#include "nvs_cache.hpp"
+
+#define MANIFEST_NAME ".swindex"
+#define MANIFEST_MAGIC 0x58495753 // "SWIX"
+#define MANIFEST_VERSION 2
+#define MANIFEST_NVS_NAMESPACE "serviceweb"
+#define MANIFEST_NVS_KEY "webidx"
+#define INDEX_PATH_MAX 256
+
+// Manifest file layout, all disk routes in a single read:
+// manifest_header_t, then per route one variants byte and the NUL terminated url.
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t stamp; // Must match the stamp in NVS, otherwise the manifest is stale
+    uint32_t count;
+    uint32_t size;  // Bytes of route entries following the header
+} manifest_header_t;
+
+static const char* TAG = "WEB_INDEX";
+static const char* const encoding_suffix[WEB_ENCODING_COUNT] = {"", ".gz", ".br"};
+static const char* const encoding_name[WEB_ENCODING_COUNT] = {NULL, "gzip", "br"};
+typedef std::unordered_map<std::string, web_route_t> route_map_t;
+
+// Disk routes of a tree scanned away from the live index, see web_index_build.
+struct web_index_set
+{
+    route_map_t routes;
+};
+
+static route_map_t routes;
+static std::string root;
+static bool dirty = false;
+
+static void add_disk_variant(route_map_t& map, const std::string& url, uint8_t variant)
+{
+    web_route_t& route = map[url];
+    route.disk_variants |= variant;
+}
+
+static void remove_disk_variant(const std::string& url, uint8_t variant)
+{
+    auto it = routes.find(url);
+    if (it == routes.end())
+        return;
+    it->second.disk_variants &= ~variant;
+    if (it->second.disk_variants == 0 && it->second.memory_variants == 0)
+        routes.erase(it);
+}
+
+const char* web_encoding_suffix(int encoding)
+{
+    return encoding_suffix[encoding];
+}
+
+const char* web_encoding_name(int encoding)
+{
+    return encoding_name[encoding];
+}
+
+// Encoding of a precompressed file name, identity when it has no known suffix.
+static int url_encoding(const char* url, size_t len)
+{
+    for (int i = 1; i < WEB_ENCODING_COUNT; i++)
+    {
+        size_t n = strlen(encoding_suffix[i]);
+        if (len > n && strcmp(url + len - n, encoding_suffix[i]) == 0)
+            return i;
+    }
+    return SERVICEWEB_ENCODING_IDENTITY;
+}
+
+static void add_disk_file(route_map_t& map, const char* url)
+{
+    add_disk_variant(map, url, WEB_VARIANT_IDENTITY);
+
+    // A .gz or .br file is also a precompressed variant of the url without the suffix
+    size_t len = strlen(url);
+    int encoding = url_encoding(url, len);
+    if (encoding != SERVICEWEB_ENCODING_IDENTITY)
+        add_disk_variant(map, std::string(url, len - strlen(encoding_suffix[encoding])), WEB_VARIANT(encoding));
+}
+
+void web_index_add_disk_file(const char* url)
+{
+    add_disk_file(routes, url);
+}
+
+static void remove_disk_file(const char* url)
+{
+    remove_disk_variant(url, WEB_VARIANT_IDENTITY);
+
+    size_t len = strlen(url);
+    int encoding = url_encoding(url, len);
+    if (encoding != SERVICEWEB_ENCODING_IDENTITY)
+        remove_disk_variant(std::string(url, len - strlen(encoding_suffix[encoding])), WEB_VARIANT(encoding));
+}
+
+void web_index_add_memory_file(const char* url, const uint8_t* start, const uint8_t* end, serviceweb_encoding_t encoding)
+{
+    web_route_t& route = routes[url];
+    route.memory_variants |= WEB_VARIANT(encoding);
+    route.memory[encoding].start = start;
+    route.memory[encoding].end = end;
+}
+
+// Walk the tree with one shared path buffer, using d_type to avoid a stat per entry.
+// Urls are the paths with the first base_len characters stripped.
+static void scan_dir(route_map_t& map, size_t base_len, char* path, size_t len)
+{
+    DIR* dp = opendir(path);
+    if (dp == NULL)
+    {
+        ESP_LOGE(TAG, "Unable to open directory %s: %s", path, strerror(errno));
+        return;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dp)) != NULL)
+    {
+        if (strcmp(".", entry->d_name) == 0 || strcmp("..", entry->d_name) == 0)
+            continue;
+
+        int n = snprintf(path + len, INDEX_PATH_MAX - len, "/%s", entry->d_name);
+        if (n < 0 || len + n >= INDEX_PATH_MAX)
+        {
+            path[len] = 0;
+            ESP_LOGE(TAG, "Path too long in %s: %s", path, entry->d_name);
+            continue;
+        }
+
+        bool is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN)
+        {
+            struct stat statbuf;
+            if (stat(path, &statbuf) == -1)
+            {
+                ESP_LOGE(TAG, "Failed to get file status for %s", path);
+                continue;
+            }
+            is_dir = S_ISDIR(statbuf.st_mode);
+        }
+
+        if (is_dir)
+            scan_dir(map, base_len, path, len + n);
+        else if (strcmp(path + base_len, "/" MANIFEST_NAME) != 0)
+            add_disk_file(map, path + base_len);
+    }
+    path[len] = 0;
+    closedir(dp);
+}
+
+static uint32_t nvs_stamp(void)
+{
+    uint32_t stamp = 0;
+    nvs_handle_t h;
+    if (ESP_OK == nvs_open(MANIFEST_NVS_NAMESPACE, NVS_READONLY, &h))
+    {
+        nvs_get_u32(h, MANIFEST_NVS_KEY, &stamp);
+        nvs_close(h);
+    }
+    return stamp;
+}
+
+static bool manifest_load(void)
+{
+    std::string path = root + "/" MANIFEST_NAME;
+    FILE* f = fopen(path.c_str(), "rb");
+    if (f == NULL)
+    {
+        ESP_LOGI(TAG, "No manifest %s", path.c_str());
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0 || st.st_size < (off_t)sizeof(manifest_header_t))
+    {
+        fclose(f);
+        return false;
+    }
+
+    uint8_t* buf = (uint8_t*)malloc(st.st_size);
+    if (buf == NULL)
+    {
+        fclose(f);
+        return false;
+    }
+    size_t read = fread(buf, 1, st.st_size, f);
+    fclose(f);
+
+    const manifest_header_t* hdr = (const manifest_header_t*)buf;
+    uint32_t stamp = nvs_stamp();
+    if (read != (size_t)st.st_size || hdr->magic != MANIFEST_MAGIC || hdr->version != MANIFEST_VERSION ||
+        hdr->size != read - sizeof(manifest_header_t) || stamp == 0 || hdr->stamp != stamp)
+    {
+        ESP_LOGW(TAG, "Manifest %s is stale or invalid", path.c_str());
+        free(buf);
+        return false;
+    }
+
+    const uint8_t* p = buf + sizeof(manifest_header_t);
+    const uint8_t* end = buf + read;
+    uint32_t count = 0;
+    while (p < end)
+    {
+        uint8_t variants = *p++;
+        const uint8_t* nul = (const uint8_t*)memchr(p, 0, end - p);
+        if (nul == NULL)
+            break;
+        add_disk_variant(routes, std::string((const char*)p, nul - p), variants);
+        p = nul + 1;
+        count++;
+    }
+    free(buf);
+
+    if (count != hdr->count)
+    {
+        ESP_LOGW(TAG, "Manifest %s is truncated, %lu of %lu routes", path.c_str(), count, hdr->count);
+        web_index_clear_disk();
+        return false;
+    }
+    return true;
+}
+
+static bool manifest_save(void)
+{
+    std::string data(sizeof(manifest_header_t), '\0');
+    uint32_t count = 0;
+    for (auto& it : routes)
+    {
+        if (it.second.disk_variants == 0)
+            continue;
+        data.push_back((char)it.second.disk_variants);
+        data.append(it.first.c_str(), it.first.size() + 1);
+        count++;
+    }
+
+    manifest_header_t hdr = {};
+    hdr.magic = MANIFEST_MAGIC;
+    hdr.version = MANIFEST_VERSION;
+    hdr.stamp = esp_random() | 1;
+    hdr.count = count;
+    hdr.size = data.size() - sizeof(manifest_header_t);
+    memcpy(&data[0], &hdr, sizeof(hdr));
+
+    // Write to a temporary file and rename, a reader never sees a partial manifest.
+    std::string path = root + "/" MANIFEST_NAME;
+    std::string tmp = path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (f == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to create manifest %s", tmp.c_str());
+        return false;
+    }
+    size_t written = fwrite(data.data(), 1, data.size(), f);
+    fclose(f);
+    if (written != data.size() || rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        ESP_LOGE(TAG, "Failed to write manifest %s", path.c_str());
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    nvs_handle_t h;
+    if (ESP_OK != nvs_open(MANIFEST_NVS_NAMESPACE, NVS_READWRITE, &h))
+    {
+        ESP_LOGE(TAG, "Failed to open nvs namespace %s", MANIFEST_NVS_NAMESPACE);
+        return false;
+    }
+    esp_err_t err = nvs_set_u32(h, MANIFEST_NVS_KEY, hdr.stamp);
+    if (err == ESP_OK)
+        err = nvs_commit(h);
+    nvs_close(h);
+    nvs_cache_invalidate(MANIFEST_NVS_NAMESPACE);
+
+    ESP_LOGI(TAG, "Manifest saved, %lu routes", count);
+    return err == ESP_OK;
+}
+
+void web_index_clear_disk(void)
+{
+    for (auto it = routes.begin(); it != routes.end();)
+    {
+        it->second.disk_variants = 0;
+        if (it->second.memory_variants == 0)
+            it = routes.erase(it);
+        else
+            it++;
+    }
+}
+
+void web_index_scan(const char* basePath, const char* path)
+{
+    root = basePath;
+
+    // The manifest describes the whole web root, a sub tree is always scanned.
+    if (strcmp(basePath, path) == 0 && manifest_load())
+    {
+        ESP_LOGI(TAG, "Loaded %u routes from manifest", (unsigned)routes.size());
+        return;
+    }
+
+    char* buf = (char*)malloc(INDEX_PATH_MAX);
+    if (buf == NULL)
+        return;
+    snprintf(buf, INDEX_PATH_MAX, "%s", path);
+    scan_dir(routes, root.size(), buf, strlen(buf));
+    free(buf);
+
+    if (strcmp(basePath, path) == 0)
+        manifest_save();
+}
+
+void web_index_rebuild(void)
+{
+    if (root.empty())
+        return;
+
+    web_index_clear_disk();
+    char* buf = (char*)malloc(INDEX_PATH_MAX);
+    if (buf == NULL)
+        return;
+    snprintf(buf, INDEX_PATH_MAX, "%s", root.c_str());
+    scan_dir(routes, root.size(), buf, strlen(buf));
+    free(buf);
+
+    manifest_save();
+    dirty = false;
+}
+
+// Only touches the new set, so it can run on any task while the live index
+// keeps serving.
+web_index_set_t* web_index_build(const char* path)
+{
+    char* buf = (char*)malloc(INDEX_PATH_MAX);
+    if (buf == NULL)
+        return NULL;
+    web_index_set_t* set = new web_index_set_t;
+    snprintf(buf, INDEX_PATH_MAX, "%s", path);
+    scan_dir(set->routes, strlen(buf), buf, strlen(buf));
+    free(buf);
+    ESP_LOGI(TAG, "Built %u routes from %s", (unsigned)set->routes.size(), path);
+    return set;
+}
+
+void web_index_activate(web_index_set_t* set)
+{
+    // Memory files are not part of the image, carry them over.
+    for (auto& it : routes)
+    {
+        if (it.second.memory_variants == 0)
+            continue;
+        web_route_t& route = set->routes[it.first];
+        route.memory_variants = it.second.memory_variants;
+        memcpy(route.memory, it.second.memory, sizeof(route.memory));
+    }
+    routes.swap(set->routes);
+    delete set;
+
+    manifest_save();
+    dirty = false;
+}
+
+void web_index_discard(web_index_set_t* set)
+{
+    delete set;
+}
+
+size_t web_index_set_size(const web_index_set_t* set)
+{
+    return set->routes.size();
+}
+
+const char* web_index_root(void)
+{
+    return root.empty() ? NULL : root.c_str();
+}
+
+// Paths outside the web root, and the manifest itself, are not indexed.
+static const char* path_to_url(const char* path)
+{
+    if (root.empty() || strncmp(path, root.c_str(), root.size()) != 0 || path[root.size()] != '/')
+        return NULL;
+    const char* url = path + root.size();
+    if (strcmp(url, "/" MANIFEST_NAME) == 0)
+        return NULL;
+    return url;
+}
+
+void web_index_file_written(const char* path)
+{
+    const char* url = path_to_url(path);
+    if (url == NULL)
+        return;
+    web_index_add_disk_file(url);
+    dirty = true;
+}
+
+void web_index_file_removed(const char* path)
+{
+    const char* url = path_to_url(path);
+    if (url == NULL)
+        return;
+    remove_disk_file(url);
+    dirty = true;
+}
+
+void web_index_save(void)
+{
+    if (dirty && manifest_save())
+        dirty = false;
+}
+
+static void apply_changes(void* arg)
+{
+    web_index_changes_t* changes = (web_index_changes_t*)arg;
+    for (auto& path : changes->removed)
+        web_index_file_removed(path.c_str());
+    for (auto& path : changes->written)
+        web_index_file_written(path.c_str());
+    web_index_save();
+    delete changes;
+}
+
+void web_index_queue_changes(httpd_handle_t server, web_index_changes_t* changes)
+{
+    if (changes->written.empty() && changes->removed.empty())
+        delete changes;
+    else if (httpd_queue_work(server, apply_changes, changes) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to queue web index update");
+        delete changes;
+    }
+}
+
+const web_route_t* web_index_find(const char* url)
+{
+    auto it = routes.find(url);
+    if (it == routes.end())
+        return NULL;
+    return &it->second;
+}
+
+size_t web_index_size(void)
+{
+    return routes.size();
+}
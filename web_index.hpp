@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#include "esp_http_server.h"
+#include "serviceweb.h"
+
+#define WEB_ENCODING_COUNT 3
+#define WEB_VARIANT(encoding) (1 << (encoding))
+
+// Variant flags, one bit per serviceweb_encoding_t.
+enum
+{
+    WEB_VARIANT_IDENTITY = WEB_VARIANT(SERVICEWEB_ENCODING_IDENTITY), // <url>
+    WEB_VARIANT_GZIP = WEB_VARIANT(SERVICEWEB_ENCODING_GZIP),         // <url>.gz
+    WEB_VARIANT_BR = WEB_VARIANT(SERVICEWEB_ENCODING_BR),             // <url>.br
+};
+
+typedef struct
+{
+    const uint8_t* start;
+    const uint8_t* end;
+} web_blob_t;
+
+typedef struct
+{
+    uint8_t disk_variants;   // WEB_VARIANT_* files present on disk
+    uint8_t memory_variants; // WEB_VARIANT_* blobs registered in memory
+    web_blob_t memory[WEB_ENCODING_COUNT];
+} web_route_t;
+
+// File suffix and Content-Encoding value for an encoding, "" and NULL for identity.
+const char* web_encoding_suffix(int encoding);
+const char* web_encoding_name(int encoding);
+
+// Route index for all static files, disk and memory. Served by a single
+// wildcard handler so lookup cost does not depend on the number of assets.
+void web_index_add_disk_file(const char* url);
+void web_index_add_memory_file(const char* url, const uint8_t* start, const uint8_t* end, serviceweb_encoding_t encoding);
+const web_route_t* web_index_find(const char* url);
+size_t web_index_size(void);
+const char* web_index_root(void);
+
+// Disk routes are loaded from a manifest in the web root when it is current,
+// otherwise the tree is scanned and the manifest written.
+void web_index_scan(const char* basePath, const char* path);
+void web_index_rebuild(void);
+void web_index_clear_disk(void);
+
+// Index a tree mounted elsewhere without touching the live index, then swap it
+// in once that tree is mounted at the web root. Build and discard run on any
+// task, activate runs on the httpd task. Both take ownership of the set.
+typedef struct web_index_set web_index_set_t;
+web_index_set_t* web_index_build(const char* path);
+void web_index_activate(web_index_set_t* set);
+void web_index_discard(web_index_set_t* set);
+size_t web_index_set_size(const web_index_set_t* set);
+
+// Keep the index and manifest in sync with files written through the api.
+// Paths outside the web root are ignored. web_index_save writes the manifest
+// once after a batch of changes.
+void web_index_file_written(const char* path);
+void web_index_file_removed(const char* path);
+void web_index_save(void);
+
+// Paths changed by a job on another task. The batch is applied and saved on
+// the httpd task of server, which owns the index. Takes ownership, an empty
+// batch is just freed.
+typedef struct
+{
+    std::vector<std::string> written;
+    std::vector<std::string> removed;
+} web_index_changes_t;
+void web_index_queue_changes(httpd_handle_t server, web_index_changes_t* changes);
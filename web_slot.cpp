@@ -0,0 +1,296 @@
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_littlefs.h"
+#include "esp_ota_ops.h"
+#include "esp_app_desc.h"
+#include "nvs.h"
+#include "serviceweb.h"
+#include "web_index.hpp"
+#include "nvs_cache.hpp"
+#include "web_slot.hpp"
+
+#define WEB_NVS_NAMESPACE "serviceweb"
+#define WEB_NVS_SLOT_KEY "webslot" // 1 when WEB_SLOT_B is active
+#define WEB_NVS_SIZE_KEY "websize" // Bytes used by the active web image
+#define WEB_NVS_NEXT_KEY "webnext"      // Slot for the first boot of the app below
+#define WEB_NVS_NEXT_SIZE_KEY "webnsize"
+#define WEB_NVS_APP_KEY "webapp"        // ELF SHA-256 of that app, written last
+#define WEB_SLOT_PRIORITY (tskIDLE_PRIORITY + 1) // Below httpd, indexing yields to serving
+
+static const char* TAG = "WEB_SLOT";
+static std::atomic<bool> busy(false);
+static std::atomic<bool> resolved(false);
+static std::atomic<int> holds(0);
+static std::atomic<bool> draining(false);
+
+typedef struct
+{
+    httpd_handle_t server;
+    const esp_partition_t* partition;
+    size_t size;
+    web_index_set_t* index;
+} web_switch_t;
+
+static const esp_partition_t* find_slot(const char* label)
+{
+    return esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_LITTLEFS, label);
+}
+
+// A slot staged with a firmware update becomes active on the first boot of
+// that firmware. Booting any other app means the boot partition switch after
+// it never happened, or was rolled back, so the slot is dropped.
+static void resolve_staged(void)
+{
+    nvs_handle_t h;
+    if (ESP_OK != nvs_open(WEB_NVS_NAMESPACE, NVS_READWRITE, &h))
+        return;
+    uint8_t app[sizeof(((esp_app_desc_t*)NULL)->app_elf_sha256)];
+    size_t len = sizeof(app);
+    if (ESP_OK == nvs_get_blob(h, WEB_NVS_APP_KEY, app, &len))
+    {
+        uint8_t slot = 0;
+        uint32_t size = 0;
+        nvs_get_u8(h, WEB_NVS_NEXT_KEY, &slot);
+        nvs_get_u32(h, WEB_NVS_NEXT_SIZE_KEY, &size);
+        if (len == sizeof(app) && memcmp(app, esp_app_get_description()->app_elf_sha256, sizeof(app)) == 0)
+        {
+            ESP_LOGI(TAG, "First boot of the updated firmware, web slot %u", slot);
+            nvs_set_u8(h, WEB_NVS_SLOT_KEY, slot);
+            nvs_set_u32(h, WEB_NVS_SIZE_KEY, size);
+        }
+        else
+            ESP_LOGW(TAG, "Dropping the web slot staged for another firmware");
+        // The marker goes first, a repeat after a power loss changes nothing.
+        nvs_erase_key(h, WEB_NVS_APP_KEY);
+        nvs_erase_key(h, WEB_NVS_NEXT_KEY);
+        nvs_erase_key(h, WEB_NVS_NEXT_SIZE_KEY);
+        nvs_commit(h);
+        nvs_cache_invalidate(WEB_NVS_NAMESPACE);
+    }
+    nvs_close(h);
+}
+
+static uint8_t nvs_slot(void)
+{
+    if (!resolved.exchange(true))
+        resolve_staged();
+
+    uint8_t slot = 0;
+    nvs_handle_t h;
+    if (ESP_OK == nvs_open(WEB_NVS_NAMESPACE, NVS_READONLY, &h))
+    {
+        nvs_get_u8(h, WEB_NVS_SLOT_KEY, &slot);
+        nvs_close(h);
+    }
+    return slot;
+}
+
+const esp_partition_t* web_slot_active(void)
+{
+    const esp_partition_t* b = find_slot(WEB_SLOT_B);
+    if (b != NULL && nvs_slot() == 1)
+        return b;
+    return find_slot(WEB_SLOT_A);
+}
+
+const esp_partition_t* web_slot_inactive(void)
+{
+    const esp_partition_t* b = find_slot(WEB_SLOT_B);
+    if (b == NULL)
+        return NULL;
+    return web_slot_active() == b ? find_slot(WEB_SLOT_A) : b;
+}
+
+const char* serviceweb_web_partition(void)
+{
+    const esp_partition_t* part = web_slot_active();
+    return part ? part->label : WEB_SLOT_A;
+}
+
+bool web_slot_claim(void)
+{
+    bool expected = false;
+    return busy.compare_exchange_strong(expected, true);
+}
+
+void web_slot_release(void)
+{
+    busy = false;
+}
+
+bool web_slot_hold(void)
+{
+    holds++;
+    if (!draining)
+        return true;
+    holds--;
+    return false;
+}
+
+void web_slot_unhold(void)
+{
+    holds--;
+}
+
+// Stop new holds and wait for the current ones, false when they outlast the
+// timeout. New holds are refused until switch_done.
+static bool drain(void)
+{
+    draining = true;
+    int64_t deadline = esp_timer_get_time() + WEB_SLOT_DRAIN_MS * 1000LL;
+    while (holds > 0 && esp_timer_get_time() < deadline)
+        vTaskDelay(pdMS_TO_TICKS(20));
+    return holds == 0;
+}
+
+// The slot mounted at boot. A single write and commit, the new image is used
+// from the next boot on or not at all.
+esp_err_t web_slot_commit(const esp_partition_t* part, size_t image_size)
+{
+    nvs_handle_t h;
+    esp_err_t err = nvs_open(WEB_NVS_NAMESPACE, NVS_READWRITE, &h);
+    if (err != ESP_OK)
+        return err;
+    err = nvs_set_u32(h, WEB_NVS_SIZE_KEY, image_size);
+    if (err == ESP_OK)
+        err = nvs_set_u8(h, WEB_NVS_SLOT_KEY, strcmp(part->label, WEB_SLOT_B) == 0 ? 1 : 0);
+    if (err == ESP_OK)
+        err = nvs_commit(h);
+    nvs_close(h);
+    nvs_cache_invalidate(WEB_NVS_NAMESPACE);
+    return err;
+}
+
+esp_err_t web_slot_stage(const esp_partition_t* part, size_t image_size, const esp_partition_t* app)
+{
+    esp_app_desc_t desc;
+    esp_err_t err = esp_ota_get_partition_description(app, &desc);
+    if (err != ESP_OK)
+        return err;
+
+    nvs_handle_t h;
+    err = nvs_open(WEB_NVS_NAMESPACE, NVS_READWRITE, &h);
+    if (err != ESP_OK)
+        return err;
+    err = nvs_set_u8(h, WEB_NVS_NEXT_KEY, strcmp(part->label, WEB_SLOT_B) == 0 ? 1 : 0);
+    if (err == ESP_OK)
+        err = nvs_set_u32(h, WEB_NVS_NEXT_SIZE_KEY, image_size);
+    if (err == ESP_OK)
+        err = nvs_set_blob(h, WEB_NVS_APP_KEY, desc.app_elf_sha256, sizeof(desc.app_elf_sha256));
+    if (err == ESP_OK)
+        err = nvs_commit(h);
+    nvs_close(h);
+    nvs_cache_invalidate(WEB_NVS_NAMESPACE);
+    return err;
+}
+
+static esp_err_t mount(const esp_partition_t* part, const char* path)
+{
+    esp_vfs_littlefs_conf_t conf = {};
+    conf.base_path = path;
+    conf.partition_label = part->label;
+    esp_err_t err = esp_vfs_littlefs_register(&conf);
+    if (err != ESP_OK)
+        ESP_LOGE(TAG, "Failed to mount %s at %s: %s", part->label, path, esp_err_to_name(err));
+    return err;
+}
+
+esp_err_t web_slot_check(const esp_partition_t* part)
+{
+    esp_err_t err = mount(part, WEB_SLOT_STAGING);
+    if (err == ESP_OK)
+        esp_vfs_littlefs_unregister(part->label);
+    return err;
+}
+
+static void switch_done(web_switch_t* sw, esp_err_t err)
+{
+    if (err != ESP_OK)
+        web_index_discard(sw->index);
+    free(sw);
+    draining = false;
+    busy = false;
+}
+
+// Runs on the httpd task, so no request sees the web root between the two
+// mounts or the index half swapped. No other task has a file open here, the
+// holds were drained before this was queued.
+static void switch_work(void* arg)
+{
+    web_switch_t* sw = (web_switch_t*)arg;
+    const esp_partition_t* old = web_slot_active();
+    const char* root = web_index_root();
+    esp_vfs_littlefs_unregister(sw->partition->label);
+    if (root == NULL || old == NULL)
+    {
+        switch_done(sw, ESP_ERR_INVALID_STATE);
+        return;
+    }
+
+    esp_vfs_littlefs_unregister(old->label);
+    esp_err_t err = mount(sw->partition, root);
+    if (err != ESP_OK)
+    {
+        if (mount(old, root) != ESP_OK)
+            web_index_clear_disk();
+        switch_done(sw, err);
+        return;
+    }
+
+    err = web_slot_commit(sw->partition, sw->size);
+    if (err != ESP_OK)
+        ESP_LOGE(TAG, "Failed to store active slot, %s is used until reboot: %s", sw->partition->label, esp_err_to_name(err));
+    web_index_activate(sw->index);
+    ESP_LOGI(TAG, "Web root switched from %s to %s", old->label, sw->partition->label);
+    switch_done(sw, ESP_OK);
+}
+
+static void index_task(void* arg)
+{
+    web_switch_t* sw = (web_switch_t*)arg;
+    int64_t start = esp_timer_get_time();
+    sw->index = web_index_build(WEB_SLOT_STAGING);
+    ESP_LOGI(TAG, "Indexed %s in %lld ms", sw->partition->label, (long long)(esp_timer_get_time() - start) / 1000);
+    // A mounted but empty image would serve nothing but 404s.
+    if (sw->index == NULL || web_index_set_size(sw->index) == 0 || !drain() ||
+        httpd_queue_work(sw->server, switch_work, sw) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Switch to %s dropped", sw->partition->label);
+        esp_vfs_littlefs_unregister(sw->partition->label);
+        switch_done(sw, ESP_FAIL);
+    }
+    vTaskDelete(NULL);
+}
+
+esp_err_t web_slot_switch(httpd_req_t* req, const esp_partition_t* part, size_t image_size)
+{
+    // An image that doesn't mount never replaces the serving one.
+    esp_err_t err = mount(part, WEB_SLOT_STAGING);
+    if (err != ESP_OK)
+    {
+        busy = false;
+        return err;
+    }
+
+    web_switch_t* sw = (web_switch_t*)malloc(sizeof(web_switch_t));
+    if (sw != NULL)
+    {
+        sw->server = req->handle;
+        sw->partition = part;
+        sw->size = image_size;
+        sw->index = NULL;
+    }
+    if (sw == NULL || xTaskCreate(index_task, "web_slot", WEB_SLOT_STACK, sw, WEB_SLOT_PRIORITY, NULL) != pdPASS)
+    {
+        free(sw);
+        esp_vfs_littlefs_unregister(part->label);
+        busy = false;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
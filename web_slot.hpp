@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+#include "esp_http_server.h"
+#include "esp_partition.h"
+
+// Two LittleFS web partitions, "web" and "web_b". The one mounted at the web
+// root is recorded in NVS, an update is written to the other one and only
+// becomes active once it mounts. Without a "web_b" partition there is a single
+// slot that is updated in place.
+
+#define WEB_SLOT_A "web"
+#define WEB_SLOT_B "web_b"
+#define WEB_SLOT_STAGING "/web_next" // Where a new image is mounted for checking and indexing
+#define WEB_SLOT_STACK 4096
+#define WEB_SLOT_DRAIN_MS 30000 // Wait for held files before a switch is dropped
+
+const esp_partition_t* web_slot_active(void);
+// NULL when there is only one slot.
+const esp_partition_t* web_slot_inactive(void);
+// Held from the start of an update until the new slot is serving or dropped.
+bool web_slot_claim(void);
+void web_slot_release(void);
+// Taken by work that uses the file system off the httpd task, from before it
+// is queued until it is done. A switch waits for all of them before the old
+// slot is unmounted. False while a switch is waiting, the caller answers busy
+// or serves on the httpd task instead.
+bool web_slot_hold(void);
+void web_slot_unhold(void);
+// Record part as the slot to mount at boot, with the size of its image.
+esp_err_t web_slot_commit(const esp_partition_t* part, size_t image_size);
+// Record part as the slot to mount from the first boot of the firmware in app
+// on, for an update of both. Call it before the boot partition is switched to
+// app: a power loss in between boots the old firmware, which drops the slot.
+esp_err_t web_slot_stage(const esp_partition_t* part, size_t image_size, const esp_partition_t* app);
+// ESP_OK when the image in part mounts.
+esp_err_t web_slot_check(const esp_partition_t* part);
+
+// Mount the freshly written inactive slot at WEB_SLOT_STAGING, then index it on
+// a background task and switch the web root over on the httpd task. The old
+// slot keeps serving until the switch, which waits for the holds above. Fails
+// with the slot unchanged when the image doesn't mount. An image without any
+// files to serve is dropped after indexing. Releases the claim when the switch
+// is over.
+esp_err_t web_slot_switch(httpd_req_t* req, const esp_partition_t* part, size_t image_size);
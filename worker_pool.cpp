@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <atomic>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "worker_pool.hpp"
+
+#define WORKER_TASK_PRIORITY (tskIDLE_PRIORITY + 3) // Below the httpd task
+
+static const char* TAG = "WORKER_POOL";
+
+typedef struct
+{
+    httpd_req_t* req;
+    worker_fn_t fn;
+    void* arg;
+} worker_job_t;
+
+static QueueHandle_t queues[WORKER_PRIORITY_COUNT];
+static SemaphoreHandle_t pending = NULL;
+static std::atomic<int> active(0);
+static std::atomic<uint32_t> done(0);
+static std::atomic<uint32_t> failed(0);
+static std::atomic<uint32_t> rejected(0);
+
+static void run_job(worker_job_t* job)
+{
+    esp_err_t err = job->fn(job->req, job->arg);
+    done++;
+    if (err != ESP_OK)
+    {
+        failed++;
+        ESP_LOGW(TAG, "%s failed: %s", job->req->uri, esp_err_to_name(err));
+        httpd_sess_trigger_close(job->req->handle, httpd_req_to_sockfd(job->req));
+    }
+    httpd_req_async_handler_complete(job->req);
+    free(job->arg);
+}
+
+static void worker_task(void* arg)
+{
+    worker_job_t job;
+    while (true)
+    {
+        xSemaphoreTake(pending, portMAX_DELAY);
+
+        // Higher priorities are always drained first.
+        bool found = false;
+        for (int i = 0; i < WORKER_PRIORITY_COUNT && !found; i++)
+            found = xQueueReceive(queues[i], &job, 0) == pdTRUE;
+        if (!found)
+            continue;
+
+        active++;
+        run_job(&job);
+        active--;
+    }
+}
+
+static void spawned_task(void* arg)
+{
+    worker_job_t* job = (worker_job_t*)arg;
+    run_job(job);
+    free(job);
+    vTaskDelete(NULL);
+}
+
+void worker_pool_start(void)
+{
+    if (pending != NULL)
+        return;
+
+    pending = xSemaphoreCreateCounting(WORKER_POOL_QUEUE * WORKER_PRIORITY_COUNT, 0);
+    for (int i = 0; i < WORKER_PRIORITY_COUNT; i++)
+        queues[i] = xQueueCreate(WORKER_POOL_QUEUE, sizeof(worker_job_t));
+
+    for (int i = 0; i < WORKER_POOL_TASKS; i++)
+    {
+        if (xTaskCreate(worker_task, "sw_worker", WORKER_POOL_STACK, NULL, WORKER_TASK_PRIORITY, NULL) != pdPASS)
+            ESP_LOGE(TAG, "Failed to create worker %d", i);
+    }
+}
+
+esp_err_t worker_pool_submit(httpd_req_t* req, worker_fn_t fn, void* arg, worker_priority_t priority)
+{
+    if (pending == NULL || queues[priority] == NULL)
+        return ESP_ERR_INVALID_STATE;
+    if (uxQueueMessagesWaiting(queues[priority]) >= WORKER_POOL_QUEUE)
+    {
+        rejected++;
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    worker_job_t job = {NULL, fn, arg};
+    esp_err_t err = httpd_req_async_handler_begin(req, &job.req);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to start async request %s: %s", req->uri, esp_err_to_name(err));
+        return err;
+    }
+
+    if (xQueueSend(queues[priority], &job, 0) != pdTRUE)
+    {
+        httpd_req_async_handler_complete(job.req);
+        rejected++;
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreGive(pending);
+    return ESP_OK;
+}
+
+esp_err_t worker_pool_spawn(httpd_req_t* req, worker_fn_t fn, void* arg, const char* name)
+{
+    worker_job_t* job = (worker_job_t*)malloc(sizeof(worker_job_t));
+    if (job == NULL)
+        return ESP_ERR_NO_MEM;
+    job->fn = fn;
+    job->arg = arg;
+    esp_err_t err = httpd_req_async_handler_begin(req, &job->req);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to start async request %s: %s", req->uri, esp_err_to_name(err));
+        free(job);
+        return err;
+    }
+
+    if (xTaskCreate(spawned_task, name, WORKER_POOL_STACK, job, WORKER_TASK_PRIORITY, NULL) != pdPASS)
+    {
+        httpd_req_async_handler_complete(job->req);
+        free(job);
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+int worker_pool_active(void)
+{
+    return active;
+}
+
+void worker_pool_get_stats(worker_pool_stats_t* stats)
+{
+    stats->done = done;
+    stats->failed = failed;
+    stats->rejected = rejected;
+    stats->active = active;
+    for (int i = 0; i < WORKER_PRIORITY_COUNT; i++)
+        stats->queued[i] = queues[i] ? uxQueueMessagesWaiting(queues[i]) : 0;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_http_server.h"
+
+#define WORKER_POOL_TASKS 2
+#define WORKER_POOL_QUEUE 4 // Waiting requests per priority
+#define WORKER_POOL_STACK 4096
+
+typedef enum
+{
+    WORKER_PRIORITY_HIGH = 0, // Page assets a browser waits for
+    WORKER_PRIORITY_LOW,      // Bulk transfers
+    WORKER_PRIORITY_COUNT,
+} worker_priority_t;
+
+// Runs on a worker task with the async copy of the request. arg is freed
+// with free() afterwards.
+typedef esp_err_t (*worker_fn_t)(httpd_req_t* req, void* arg);
+
+void worker_pool_start(void);
+// Hand req over to a worker, the httpd handler then returns ESP_OK without
+// responding. ESP_ERR_INVALID_STATE when the queue for that priority is full,
+// any other error when the request has to be served in place.
+esp_err_t worker_pool_submit(httpd_req_t* req, worker_fn_t fn, void* arg, worker_priority_t priority);
+// Run req on a task of its own instead, for a request that streams for as long
+// as its upload takes and would hold a pool worker all that time. Same
+// contract for fn and arg, any error means nothing was started.
+esp_err_t worker_pool_spawn(httpd_req_t* req, worker_fn_t fn, void* arg, const char* name);
+int worker_pool_active(void);
+
+typedef struct
+{
+    uint32_t done;     // Jobs run, failed ones included
+    uint32_t failed;   // Jobs that returned an error
+    uint32_t rejected; // Submits refused with a full queue
+    int active;
+    int queued[WORKER_PRIORITY_COUNT];
+} worker_pool_stats_t;
+
+void worker_pool_get_stats(worker_pool_stats_t* stats);